@@ -0,0 +1,121 @@
+// Microbenchmark & self check of codec.h: sprintf, scalar and vector
+// paths for hex and base64 on digest, UUID and bulk sized inputs.
+//
+// usage: ./bench [MB per case]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "codec.h"
+
+typedef size_t (*encoder)(const uint8_t *, size_t, char *);
+typedef ptrdiff_t (*decoder)(const char *, size_t, uint8_t *);
+
+static size_t hex_sprintf(const uint8_t *src, size_t n, char *dst) {
+    size_t i;
+    char xx[3];
+    for (i = 0; i < n; i++) {
+	sprintf(xx, "%02x", src[i]);
+	memcpy(dst + 2*i, xx, 2);
+    }
+    return 2*n;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void check(int ok, const char *what, size_t n) {
+    if (!ok) {
+	fprintf(stderr, "MISMATCH: %s with %zu bytes\n", what, n);
+	exit(1);
+    }
+}
+
+// every vector path must agree with the scalar one, at every length &
+// alignment around its block sizes
+static void self_check(void) {
+    uint8_t src[300], back[300];
+    char a[700], b[700];
+    size_t n, k;
+    for (n = 0; n < 200; n++) {
+	for (k = 0; k < n; k++)
+	    src[k] = rand();
+	size_t m = codec_hex_encode_scalar(src, n, a);
+	check(codec_hex_encode(src, n, b) == m && !memcmp(a, b, m), "hex encode", n);
+	check(codec_hex_decode(a, m, back) == (ptrdiff_t)n && !memcmp(src, back, n), "hex decode", n);
+	for (k = 0; k < m; k++)
+	    b[k] = k % 3 ? a[k] : (a[k] >= 'a' ? a[k] - 32 : a[k]); // mixed case
+	check(codec_hex_decode(b, m, back) == (ptrdiff_t)n && !memcmp(src, back, n), "hex decode upper", n);
+	if (m > 0) {
+	    b[m-1] = 'g';
+	    check(codec_hex_decode(b, m, back) == -1, "hex invalid", n);
+	}
+
+	m = codec_b64_encode_scalar(src, n, a);
+	check(codec_b64_encode(src, n, b) == m && !memcmp(a, b, m), "base64 encode", n);
+	check(codec_b64_decode(a, m, back) == (ptrdiff_t)n && !memcmp(src, back, n), "base64 decode", n);
+	if (m > 4) {
+	    memcpy(b, a, m);
+	    b[m/2] = '*';
+	    check(codec_b64_decode(b, m, back) == -1, "base64 invalid", n);
+	}
+    }
+}
+
+static void bench_encode(const char *name, encoder f, const uint8_t *src, size_t n, size_t total, char *dst) {
+    size_t i, reps = total / n + 1;
+    double t = now();
+    for (i = 0; i < reps; i++)
+	f(src, n, dst);
+    t = now() - t;
+    printf("%-22s %8zu %10.1f MB/s %10.1f ns/op\n", name, n, reps * n / t / 1048576, t * 1e9 / reps);
+}
+
+static void bench_decode(const char *name, decoder f, const char *src, size_t n, size_t total, uint8_t *dst) {
+    size_t i, reps = total / n + 1;
+    double t = now();
+    for (i = 0; i < reps; i++)
+	f(src, n, dst);
+    t = now() - t;
+    printf("%-22s %8zu %10.1f MB/s %10.1f ns/op\n", name, n, reps * n / t / 1048576, t * 1e9 / reps);
+}
+
+int main(int argc, char **argv) {
+    size_t total = (argc > 1 ? atoi(argv[1]) : 64) << 20;
+    size_t sizes[] = {16, 32, 1024, 1 << 20};
+    size_t i, k;
+
+    codec_init();
+    self_check();
+
+    uint8_t *src = malloc(1 << 20), *back = malloc(codec_unb64_size(2 << 20));
+    char *txt = malloc(codec_hex_size(1 << 20)), *txt2 = malloc(codec_hex_size(1 << 20));
+    for (k = 0; k < (1 << 20); k++)
+	src[k] = rand();
+
+    printf("%-22s %8s %15s %15s\n", "codec", "bytes", "throughput", "latency");
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+	size_t n = sizes[i], m;
+	bench_encode("hex sprintf", hex_sprintf, src, n, total / 16, txt);
+	bench_encode("hex scalar", codec_hex_encode_scalar, src, n, total, txt);
+	bench_encode("hex", codec_hex_encode, src, n, total, txt);
+	m = codec_hex_encode(src, n, txt);
+	bench_decode("unhex scalar", codec_hex_decode_scalar, txt, m, total, back);
+	bench_decode("unhex", codec_hex_decode, txt, m, total, back);
+
+	bench_encode("base64 scalar", codec_b64_encode_scalar, src, n, total, txt2);
+	bench_encode("base64", codec_b64_encode, src, n, total, txt2);
+	m = codec_b64_encode(src, n, txt2);
+	bench_decode("unbase64 scalar", codec_b64_decode_scalar, txt2, m, total, back);
+	bench_decode("unbase64", codec_b64_decode, txt2, m, total, back);
+	printf("\n");
+    }
+
+    free(src); free(back); free(txt); free(txt2);
+    return 0;
+}
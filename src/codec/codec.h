@@ -0,0 +1,321 @@
+#ifndef CAAP_CODEC_H
+#define CAAP_CODEC_H
+
+// Hex & base64 (RFC 4648) codecs shared by lints and lbsd.
+//
+// Encoders write exactly codec_hex_size(n) / codec_b64_size(n) bytes;
+// decoders need codec_unhex_size(n) / codec_unb64_size(n) bytes of room,
+// return the number of bytes written, or -1 on invalid input.
+// Vector paths are chosen at run time: hex uses SSE2 or AVX2, base64 uses
+// SSSE3 (it needs pshufb); every other platform takes the scalar tables.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CODEC_X86 1
+#include <immintrin.h>
+#define CODEC_TARGET(x) __attribute__((target(x)))
+#endif
+
+#define codec_hex_size(n) (2*(n))
+#define codec_unhex_size(n) ((n)/2)
+#define codec_b64_size(n) (4*(((n)+2)/3))
+#define codec_unb64_size(n) (3*((n)/4) + 3)
+
+static const char CODEC_HEX[] = "0123456789abcdef";
+static const char CODEC_B64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// 0xff invalid, 0xfe whitespace (base64 only); filled by codec_init
+static uint8_t CODEC_UNHEX[256], CODEC_UNB64[256];
+
+static inline void codec_init(void) {
+    int i;
+    for (i = 0; i < 256; i++)
+	CODEC_UNHEX[i] = CODEC_UNB64[i] = 0xff;
+    for (i = 0; i < 16; i++)
+	CODEC_UNHEX[(uint8_t)CODEC_HEX[i]] = i;
+    for (i = 10; i < 16; i++)
+	CODEC_UNHEX['A' + i - 10] = i;
+    for (i = 0; i < 64; i++)
+	CODEC_UNB64[(uint8_t)CODEC_B64[i]] = i;
+    CODEC_UNB64[' '] = CODEC_UNB64['\t'] = CODEC_UNB64['\r'] = CODEC_UNB64['\n'] = 0xfe;
+#ifdef CODEC_X86
+    __builtin_cpu_init();
+#endif
+}
+
+/////////////////////////////////// scalar
+
+static inline size_t codec_hex_encode_scalar(const uint8_t *src, size_t n, char *dst) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+	dst[2*i] = CODEC_HEX[src[i] >> 4];
+	dst[2*i+1] = CODEC_HEX[src[i] & 0x0f];
+    }
+    return 2*n;
+}
+
+static inline ptrdiff_t codec_hex_decode_scalar(const char *src, size_t n, uint8_t *dst) {
+    size_t i;
+    if (n % 2)
+	return -1;
+    for (i = 0; i < n; i += 2) {
+	uint8_t hi = CODEC_UNHEX[(uint8_t)src[i]], lo = CODEC_UNHEX[(uint8_t)src[i+1]];
+	if ((hi | lo) & 0xf0)
+	    return -1;
+	dst[i/2] = (hi << 4) | lo;
+    }
+    return n/2;
+}
+
+static inline size_t codec_b64_encode_scalar(const uint8_t *src, size_t n, char *dst) {
+    char *p = dst;
+    size_t i;
+    for (i = 0; i + 3 <= n; i += 3, p += 4) {
+	uint32_t x = ((uint32_t)src[i] << 16) | ((uint32_t)src[i+1] << 8) | src[i+2];
+	p[0] = CODEC_B64[x >> 18];
+	p[1] = CODEC_B64[(x >> 12) & 0x3f];
+	p[2] = CODEC_B64[(x >> 6) & 0x3f];
+	p[3] = CODEC_B64[x & 0x3f];
+    }
+    if (i < n) {
+	uint32_t x = (uint32_t)src[i] << 16;
+	if (i + 1 < n)
+	    x |= (uint32_t)src[i+1] << 8;
+	p[0] = CODEC_B64[x >> 18];
+	p[1] = CODEC_B64[(x >> 12) & 0x3f];
+	p[2] = i + 1 < n ? CODEC_B64[(x >> 6) & 0x3f] : '=';
+	p[3] = '=';
+	p += 4;
+    }
+    return p - dst;
+}
+
+// skips whitespace; padding is optional but nothing may follow it
+static inline ptrdiff_t codec_b64_decode_scalar(const char *src, size_t n, uint8_t *dst) {
+    uint8_t *p = dst;
+    uint32_t x = 0;
+    int k = 0, pad = 0;
+    size_t i;
+    for (i = 0; i < n; i++) {
+	uint8_t c = CODEC_UNB64[(uint8_t)src[i]];
+	if (c == 0xfe)
+	    continue;
+	if (src[i] == '=' && k >= 2 && pad < 2) {
+	    pad++;
+	    continue;
+	}
+	if (c == 0xff || pad)
+	    return -1;
+	x = (x << 6) | c;
+	if (++k == 4) {
+	    p[0] = x >> 16; p[1] = x >> 8; p[2] = x;
+	    p += 3;
+	    k = 0;
+	}
+    }
+    if (k == 1 || (pad && k + pad != 4))
+	return -1;
+    if (k == 2)
+	*p++ = x >> 4;
+    else if (k == 3) {
+	p[0] = x >> 10; p[1] = x >> 2;
+	p += 2;
+    }
+    return p - dst;
+}
+
+#ifdef CODEC_X86
+
+/////////////////////////////////// hex, SSE2 & AVX2
+
+// nibbles to ascii: n + '0', plus 39 more for a..f
+#define HEX_DIGITS(v, gt9, add, w) \
+    _mm##w##_add_epi8(_mm##w##_add_epi8(v, _mm##w##_set1_epi8('0')), \
+	_mm##w##_and_si##add(_mm##w##_cmpgt_epi8(v, gt9), _mm##w##_set1_epi8(39)))
+
+CODEC_TARGET("sse2")
+static inline size_t codec_hex_encode_sse2(const uint8_t *src, size_t n, char *dst) {
+    const __m128i mask = _mm_set1_epi8(0x0f), nine = _mm_set1_epi8(9);
+    size_t i;
+    for (i = 0; i + 16 <= n; i += 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+	__m128i lo = _mm_and_si128(x, mask);
+	__m128i a = _mm_unpacklo_epi8(hi, lo), b = _mm_unpackhi_epi8(hi, lo);
+	_mm_storeu_si128((__m128i *)(dst + 2*i), HEX_DIGITS(a, nine, 128, ));
+	_mm_storeu_si128((__m128i *)(dst + 2*i + 16), HEX_DIGITS(b, nine, 128, ));
+    }
+    return 2*i + codec_hex_encode_scalar(src + i, n - i, dst + 2*i);
+}
+
+CODEC_TARGET("avx2")
+static inline size_t codec_hex_encode_avx2(const uint8_t *src, size_t n, char *dst) {
+    const __m256i mask = _mm256_set1_epi8(0x0f), nine = _mm256_set1_epi8(9);
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32) {
+	__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), mask);
+	__m256i lo = _mm256_and_si256(x, mask);
+	__m256i a = _mm256_unpacklo_epi8(hi, lo), b = _mm256_unpackhi_epi8(hi, lo);
+	a = HEX_DIGITS(a, nine, 256, 256);
+	b = HEX_DIGITS(b, nine, 256, 256);
+	// unpack works per 128-bit lane
+	_mm256_storeu_si256((__m256i *)(dst + 2*i), _mm256_permute2x128_si256(a, b, 0x20));
+	_mm256_storeu_si256((__m256i *)(dst + 2*i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    return 2*i + codec_hex_encode_sse2(src + i, n - i, dst + 2*i);
+}
+
+// ascii to nibbles, all lanes of valid set if every char is a hex digit
+#define HEX_VALUES(c, valid, w, add) do { \
+	__m##add##i d = _mm##w##_sub_epi8(c, _mm##w##_set1_epi8('0')); \
+	__m##add##i l = _mm##w##_sub_epi8(_mm##w##_or_si##add(c, _mm##w##_set1_epi8(0x20)), _mm##w##_set1_epi8('a')); \
+	__m##add##i vd = _mm##w##_cmpeq_epi8(_mm##w##_subs_epu8(d, _mm##w##_set1_epi8(9)), zero); \
+	__m##add##i vl = _mm##w##_cmpeq_epi8(_mm##w##_subs_epu8(l, _mm##w##_set1_epi8(5)), zero); \
+	valid = _mm##w##_and_si##add(valid, _mm##w##_or_si##add(vd, vl)); \
+	c = _mm##w##_or_si##add(_mm##w##_and_si##add(vd, d), \
+	    _mm##w##_and_si##add(vl, _mm##w##_add_epi8(l, _mm##w##_set1_epi8(10)))); \
+    } while (0)
+
+CODEC_TARGET("sse2")
+static inline ptrdiff_t codec_hex_decode_sse2(const char *src, size_t n, uint8_t *dst) {
+    const __m128i zero = _mm_setzero_si128(), lowbyte = _mm_set1_epi16(0x00ff);
+    size_t i;
+    if (n % 2)
+	return -1;
+    for (i = 0; i + 32 <= n; i += 32) {
+	__m128i valid = _mm_cmpeq_epi8(zero, zero);
+	__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+	__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+	HEX_VALUES(a, valid, , 128);
+	HEX_VALUES(b, valid, , 128);
+	if (_mm_movemask_epi8(valid) != 0xffff)
+	    return -1;
+	// (hi, lo) nibbles in each 16-bit word to one byte per word
+	a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, lowbyte), 4), _mm_srli_epi16(a, 8));
+	b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, lowbyte), 4), _mm_srli_epi16(b, 8));
+	_mm_storeu_si128((__m128i *)(dst + i/2), _mm_packus_epi16(a, b));
+    }
+    ptrdiff_t k = codec_hex_decode_scalar(src + i, n - i, dst + i/2);
+    return k == -1 ? -1 : (ptrdiff_t)(i/2) + k;
+}
+
+CODEC_TARGET("avx2")
+static inline ptrdiff_t codec_hex_decode_avx2(const char *src, size_t n, uint8_t *dst) {
+    const __m256i zero = _mm256_setzero_si256(), lowbyte = _mm256_set1_epi16(0x00ff);
+    size_t i;
+    if (n % 2)
+	return -1;
+    for (i = 0; i + 64 <= n; i += 64) {
+	__m256i valid = _mm256_cmpeq_epi8(zero, zero);
+	__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+	__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+	HEX_VALUES(a, valid, 256, 256);
+	HEX_VALUES(b, valid, 256, 256);
+	if (_mm256_movemask_epi8(valid) != -1)
+	    return -1;
+	a = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(a, lowbyte), 4), _mm256_srli_epi16(a, 8));
+	b = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(b, lowbyte), 4), _mm256_srli_epi16(b, 8));
+	// pack works per 128-bit lane
+	_mm256_storeu_si256((__m256i *)(dst + i/2), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+    }
+    ptrdiff_t k = codec_hex_decode_sse2(src + i, n - i, dst + i/2);
+    return k == -1 ? -1 : (ptrdiff_t)(i/2) + k;
+}
+
+/////////////////////////////////// base64, SSSE3
+
+// 12 input bytes to 16 sextets, one per byte (W. Mula & D. Lemire)
+CODEC_TARGET("ssse3")
+static inline size_t codec_b64_encode_ssse3(const uint8_t *src, size_t n, char *dst) {
+    const __m128i shuf = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t i, o = 0;
+    for (i = 0; i + 16 <= n; i += 12, o += 16) {
+	__m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i)), shuf);
+	__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(x, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+	__m128i t1 = _mm_mullo_epi16(_mm_and_si128(x, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+	__m128i v = _mm_or_si128(t0, t1);
+	// sextets to ascii: index of the range in the shift table
+	__m128i r = _mm_subs_epu8(v, _mm_set1_epi8(51));
+	r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), v), _mm_set1_epi8(13)));
+	r = _mm_add_epi8(_mm_shuffle_epi8(shift, r), v);
+	_mm_storeu_si128((__m128i *)(dst + o), r);
+    }
+    return o + codec_b64_encode_scalar(src + i, n - i, dst + o);
+}
+
+// sextets back from ascii by ranges; stops at the first non base64 char,
+// which is left to the scalar decoder
+CODEC_TARGET("ssse3")
+static inline ptrdiff_t codec_b64_decode_ssse3(const char *src, size_t n, uint8_t *dst) {
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i, o = 0;
+    for (i = 0; i + 24 <= n; i += 16, o += 12) {
+	__m128i c = _mm_loadu_si128((const __m128i *)(src + i));
+	__m128i up = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('Z' + 1)));
+	__m128i lo = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+	__m128i dg = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	__m128i pl = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+	__m128i sl = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+	__m128i valid = _mm_or_si128(_mm_or_si128(up, lo), _mm_or_si128(dg, _mm_or_si128(pl, sl)));
+	if (_mm_movemask_epi8(valid) != 0xffff)
+	    break;
+	__m128i d = _mm_and_si128(up, _mm_set1_epi8(-65));
+	d = _mm_or_si128(d, _mm_and_si128(lo, _mm_set1_epi8(-71)));
+	d = _mm_or_si128(d, _mm_and_si128(dg, _mm_set1_epi8(4)));
+	d = _mm_or_si128(d, _mm_and_si128(pl, _mm_set1_epi8(19)));
+	d = _mm_or_si128(d, _mm_and_si128(sl, _mm_set1_epi8(16)));
+	__m128i v = _mm_add_epi8(c, d);
+	v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+	v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+	_mm_storeu_si128((__m128i *)(dst + o), _mm_shuffle_epi8(v, pack));
+    }
+    ptrdiff_t k = codec_b64_decode_scalar(src + i, n - i, dst + o);
+    return k == -1 ? -1 : (ptrdiff_t)o + k;
+}
+
+#endif
+
+/////////////////////////////////// dispatch
+
+static inline size_t codec_hex_encode(const uint8_t *src, size_t n, char *dst) {
+#ifdef CODEC_X86
+    if (__builtin_cpu_supports("avx2"))
+	return codec_hex_encode_avx2(src, n, dst);
+    if (__builtin_cpu_supports("sse2"))
+	return codec_hex_encode_sse2(src, n, dst);
+#endif
+    return codec_hex_encode_scalar(src, n, dst);
+}
+
+static inline ptrdiff_t codec_hex_decode(const char *src, size_t n, uint8_t *dst) {
+#ifdef CODEC_X86
+    if (__builtin_cpu_supports("avx2"))
+	return codec_hex_decode_avx2(src, n, dst);
+    if (__builtin_cpu_supports("sse2"))
+	return codec_hex_decode_sse2(src, n, dst);
+#endif
+    return codec_hex_decode_scalar(src, n, dst);
+}
+
+static inline size_t codec_b64_encode(const uint8_t *src, size_t n, char *dst) {
+#ifdef CODEC_X86
+    if (__builtin_cpu_supports("ssse3"))
+	return codec_b64_encode_ssse3(src, n, dst);
+#endif
+    return codec_b64_encode_scalar(src, n, dst);
+}
+
+static inline ptrdiff_t codec_b64_decode(const char *src, size_t n, uint8_t *dst) {
+#ifdef CODEC_X86
+    if (__builtin_cpu_supports("ssse3"))
+	return codec_b64_decode_ssse3(src, n, dst);
+#endif
+    return codec_b64_decode_scalar(src, n, dst);
+}
+
+#endif
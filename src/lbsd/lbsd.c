@@ -6,12 +6,11 @@
 #include <string.h>
 #include <time.h>
 
-#include <netinet/in.h>
-#include <resolv.h>
-
 #include <uuid.h>
 #include <md5.h>
 
+#include "codec.h"
+
 // // // // // // // // //
 
 static uuid_t *UUID, UID;
@@ -87,9 +86,7 @@ static int32_t uuid_compare_octet(uint8_t *x, uint8_t *y) {
 }
 
 static int octet_as_b64(uint8_t *octet, char *uuid) {
-    if (-1 == b64_ntop(octet, OCTET_SIZE, uuid, UUID_SIZE))
-	return -1;
-
+    uuid[codec_b64_encode(octet, OCTET_SIZE, uuid)] = '\0';
     return 0;
 }
 
@@ -180,6 +177,13 @@ static int uuid_asb64(lua_State *L) {
     return 1;
 }
 
+static int uuid_ashex(lua_State *L) {
+    uint8_t *octet = checkuuid(L, 1);
+    char uuid[32];
+    lua_pushlstring(L, uuid, codec_hex_encode(octet, OCTET_SIZE, uuid));
+    return 1;
+}
+
 static int uuid_gc(lua_State *L) {
     uint8_t *octet = checkuuid(L, 1);
     if (octet != NULL)
@@ -225,34 +229,27 @@ static int sleep_msec(lua_State *L) {
 
 static int str2b64(lua_State *L) {
     size_t N;
-    const unsigned char *y = (unsigned char *)luaL_checklstring(L, 1, &N);
-    size_t M = 4*(N/3+1)+1;
-
-    char *z  = (char *)lua_newuserdata(L, M);
-    if (-1 == b64_ntop(y, N, z, M)) {
-	lua_pushnil(L);
-	lua_pushliteral(L, "ERROR: b64_ntop encoding base64");
-	return 2;
-    } else
-	lua_pushstring(L, z);
+    const uint8_t *y = (const uint8_t *)luaL_checklstring(L, 1, &N);
 
+    luaL_Buffer b;
+    char *z = luaL_buffinitsize(L, &b, codec_b64_size(N));
+    luaL_pushresultsize(&b, codec_b64_encode(y, N, z));
     return 1;
 }
 
 static int b642str(lua_State *L) {
     size_t N;
     const char *y = luaL_checklstring(L, 1, &N);
-    size_t M = 3*N/4 + 1;
 
-    unsigned char *z  = (unsigned char *)lua_newuserdata(L, M);
-    int len = b64_pton(y, z, M);
-    if (-1 == len) {
+    luaL_Buffer b;
+    uint8_t *z = (uint8_t *)luaL_buffinitsize(L, &b, codec_unb64_size(N));
+    ptrdiff_t M = codec_b64_decode(y, N, z);
+    if (-1 == M) {
 	lua_pushnil(L);
-	lua_pushliteral(L, "ERROR: b64_pton encoding base64");
+	lua_pushliteral(L, "ERROR: decoding base64");
 	return 2;
-    } else
-	lua_pushlstring(L, (char *)z, len);
-
+    }
+    luaL_pushresultsize(&b, M);
     return 1;
 }
 
@@ -277,6 +274,7 @@ static const struct luaL_Reg uuid_meths[] = {
     {"__lt",	    uuid_lt},
     {"__le",	    uuid_le},
     {"b64",         uuid_asb64},
+    {"hex",         uuid_ashex},
     {"compare",     uuid_comparison},
     {NULL,	    NULL}
 };
@@ -293,6 +291,9 @@ int luaopen_lbsd (lua_State *L) {
     // initialize & check, uuid library is up and running
     init_uuid(L);
 
+    // hex & base64 tables
+    codec_init();
+
     // create library
     luaL_newlib(L, bsd_funcs);
 
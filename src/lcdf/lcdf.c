@@ -2,11 +2,19 @@
 #include <lauxlib.h>
 #include <float.h>
 #include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "cdflib.h"
+#include "lcdf.h"
 
 #define LBOUND (1.0e-20) /* ditto */
 #define MAXITER (1000) /* used in dchisq */
 #define SQRT2PI (2.506628274631) /* sqrt(2*pi) */
+#define MINSPLIT (1 << 14) /* elements per thread in array variants */
+#define MEMOSIZE (256) /* quantile memo entries, a power of 2 */
+#define NEWTONTOL (1.0e-13) /* relative step to stop refining fast quantiles */
 
 /* {=====================================================================
  *    Auxiliary
@@ -26,6 +34,208 @@ static void check_status (lua_State *L, int status, lua_Number bound) {
     luaL_error(L, "error in cumgam: %d", status);
 }
 
+/* {=======   Quantiles   =======}
+ *
+ * The quantile functions below take p in (0, 1). In "exact" precision
+ * they go through dcdflib; in "fast" precision the normal quantile uses
+ * AS241 and the t and chi-square quantiles start from a closed form (Hill,
+ * Wilson-Hilferty) refined by Newton steps on cumt and cumchi, falling back
+ * to dcdflib's search when that does not converge. Recent t and chi-square
+ * quantiles are kept in a small direct-mapped memo.
+ */
+
+enum { PREC_EXACT, PREC_FAST };
+enum { QUANT_T = 1, QUANT_CHISQ };
+
+typedef struct cdf_memo {
+  int kind; /* 0 if empty, else QUANT_xxx shifted by precision */
+  double p, df, pnonc, x;
+} cdf_memo;
+
+static int precision = PREC_EXACT;
+static cdf_memo memo[MEMOSIZE];
+
+static cdf_memo *memo_slot (int kind, double p, double df, double pnonc) {
+  double key[3];
+  unsigned char *b = (unsigned char *)key;
+  unsigned h = 2166136261u ^ kind; /* FNV-1a */
+  size_t i;
+  key[0] = p; key[1] = df; key[2] = pnonc;
+  for (i = 0; i < sizeof(key); i++)
+    h = (h ^ b[i]) * 16777619u;
+  return &memo[h & (MEMOSIZE - 1)];
+}
+
+/* Wichura's AS241 (PPND16), accurate to about 1e-16 */
+static double as241 (double p) {
+  double q = p - 0.5, r, x;
+  if (fabs(q) <= 0.425) {
+    r = 0.180625 - q * q;
+    return q * (((((((r * 2509.0809287301226727
+        + 33430.575583588128105) * r + 67265.770927008700853) * r
+        + 45921.953931549871457) * r + 13731.693765509461125) * r
+        + 1971.5909503065514427) * r + 133.14166789178437745) * r
+        + 3.387132872796366608)
+      / (((((((r * 5226.495278852545925
+        + 28729.085735721942674) * r + 39307.89580009271061) * r
+        + 21213.794301586595867) * r + 5394.1960214247511077) * r
+        + 687.1870074920579083) * r + 42.313330701600911252) * r + 1);
+  }
+  r = sqrt(-log(q < 0 ? p : 1 - p));
+  if (r <= 5) {
+    r -= 1.6;
+    x = (((((((r * 7.7454501427834140764e-4
+        + .0227238449892691845833) * r + .24178072517745061177) * r
+        + 1.27045825245236838258) * r + 3.64784832476320460504) * r
+        + 5.7694972214606914055) * r + 4.6303378461565452959) * r
+        + 1.42343711074968357734)
+      / (((((((r * 1.05075007164441684324e-9
+        + 5.475938084995344946e-4) * r + .0151986665636164571966) * r
+        + .14810397642748007459) * r + .68976733498510000455) * r
+        + 1.6763848301838038494) * r + 2.05319162663775882187) * r + 1);
+  } else {
+    r -= 5;
+    x = (((((((r * 2.01033439929228813265e-7
+        + 2.71155556874348757815e-5) * r + .0012426609473880784386) * r
+        + .026532189526576123093) * r + .29656057182850489123) * r
+        + 1.7848265399172913358) * r + 5.4637849111641143699) * r
+        + 6.6579046435011037772)
+      / (((((((r * 2.04426310338993978564e-15
+        + 1.4215117583164458887e-7) * r + 1.8463183175100546818e-5) * r
+        + 7.868691311456132591e-4) * r + .0148753612908506148525) * r
+        + .13692988092273580531) * r + .59983220655588793769) * r + 1);
+  }
+  return (q < 0) ? -x : x;
+}
+
+/* standard normal quantile */
+static double quant_norm (double p) {
+  double q;
+  if (precision == PREC_FAST) return as241(p);
+  q = 1 - p;
+  return dinvnr(&p, &q);
+}
+
+/* Hill's algorithm 396 for the t quantile, from p < 0.5 */
+static double hill (double p, double df) {
+  double a, b, c, d, x, y;
+  p *= 2; /* two-tailed */
+  if (df == 2) return -sqrt(2 / (p * (2 - p)) - 2);
+  if (df == 1) return -cos(p * M_PI_2) / sin(p * M_PI_2);
+  a = 1 / (df - 0.5);
+  b = 48 / (a * a);
+  c = ((20700 * a / b - 98) * a - 16) * a + 96.36;
+  d = ((94.5 / (b + c) - 3) / b + 1) * sqrt(a * M_PI_2) * df;
+  y = pow(d * p, 2 / df);
+  if (y > 0.05 + a) { /* asymptotic inverse expansion about normal */
+    x = as241(p / 2);
+    y = x * x;
+    if (df < 5) c += 0.3 * (df - 4.5) * (x + 0.6);
+    c = (((0.05 * d * x - 5) * x - 7) * x - 2) * x + b + c;
+    y = (((((0.4 * y + 6.3) * y + 36) * y + 94.5) / c - y - 3) / b + 1) * x;
+    y = expm1(a * y * y);
+  } else
+    y = ((1 / (((df + 6) / (df * y) - 0.089 * d - 0.822) * (df + 2) * 3)
+        + 0.5 / (df + 4)) * y - 1) * (df + 1) / (df + 2) + 1 / y;
+  return -sqrt(df * y);
+}
+
+/* t quantile by Hill's guess and Newton steps; 0 if those don't converge */
+static int fast_t (double p, double df, double *t) {
+  double h = df / 2, half = 0.5, c, x, cum, ccum, step;
+  int i, lower = p < 0.5;
+  if (df < 1) return 0;
+  c = -dlnbet(&h, &half) - log(df) / 2;
+  x = hill(lower ? p : 1 - p, df);
+  if (!lower) x = -x;
+  for (i = 0; i < 4; i++) {
+    cumt(&x, &df, &cum, &ccum);
+    step = (lower ? cum - p : (1 - p) - ccum)
+      / exp(c - (df + 1) / 2 * log(1 + x * x / df));
+    x -= step;
+    if (!isfinite(x)) return 0;
+    if (fabs(step) <= NEWTONTOL * fabs(x)) {
+      *t = x;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* central chi-square quantile by Wilson-Hilferty and Newton steps */
+static int fast_chisq (double p, double df, double *x) {
+  double h = df / 2, c, v = 2 / (9 * df), y, cum, ccum, step;
+  int i, lower = p < 0.5;
+  if (df < 1) return 0;
+  c = h * M_LN2 + dlngam(&h);
+  if (df < -1.24 * log(p)) /* lower tail, as AS91 */
+    y = 2 * exp((log(p * h) + dlngam(&h)) / h);
+  else {
+    y = 1 - v + as241(p) * sqrt(v);
+    y = df * y * y * y;
+  }
+  for (i = 0; i < 12; i++) {
+    cumchi(&y, &df, &cum, &ccum);
+    step = (lower ? cum - p : (1 - p) - ccum)
+      / exp((h - 1) * log(y) - y / 2 - c);
+    if (step >= y) step = y / 2; /* stay positive */
+    y -= step;
+    if (!isfinite(y)) return 0;
+    if (fabs(step) <= NEWTONTOL * y) {
+      *x = y;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static double quant_t (lua_State *L, double p, double df) {
+  cdf_memo *m = memo_slot(QUANT_T << 1 | precision, p, df, 0);
+  if (m->kind == (QUANT_T << 1 | precision) && m->p == p && m->df == df)
+    return m->x;
+  m->kind = 0; /* check_status may leave */
+  if (precision == PREC_EXACT || !fast_t(p, df, &m->x)) {
+    double q = 1 - p, bound;
+    int which = 2, status;
+    cdft(&which, &p, &q, &m->x, &df, &status, &bound);
+    check_status(L, status, bound);
+  }
+  m->kind = QUANT_T << 1 | precision;
+  m->p = p; m->df = df; m->pnonc = 0;
+  return m->x;
+}
+
+static double quant_chisq (lua_State *L, double p, double df, double pnonc) {
+  cdf_memo *m = memo_slot(QUANT_CHISQ << 1 | precision, p, df, pnonc);
+  if (m->kind == (QUANT_CHISQ << 1 | precision) && m->p == p && m->df == df
+      && m->pnonc == pnonc)
+    return m->x;
+  m->kind = 0; /* check_status may leave */
+  if (precision == PREC_EXACT || pnonc != 0 || !fast_chisq(p, df, &m->x)) {
+    double q = 1 - p, bound;
+    int which = 2, status;
+    if (pnonc == 0) /* central? */
+      cdfchi(&which, &p, &q, &m->x, &df, &status, &bound);
+    else /* non-central */
+      cdfchn(&which, &p, &q, &m->x, &df, &pnonc, &status, &bound);
+    check_status(L, status, bound);
+  }
+  m->kind = QUANT_CHISQ << 1 | precision;
+  m->p = p; m->df = df; m->pnonc = pnonc;
+  return m->x;
+}
+
+/* lcdf.precision(["exact" | "fast"]) sets how quantiles are computed;
+ * returns the previous setting */
+static int set_precision (lua_State *L) {
+  static const char *const modes[] = {"exact", "fast", NULL};
+  int old = precision;
+  if (!lua_isnoneornil(L, 1))
+    precision = luaL_checkoption(L, 1, NULL, modes);
+  lua_pushstring(L, modes[old]);
+  return 1;
+}
+
 //* {=======   Normal   =======} */
 
 static void check_norm (lua_State *L, int which, lua_Number x,
@@ -72,14 +282,7 @@ static int stat_qnorm (lua_State *L) {
   lua_Number x;
   check_norm(L, 2, p, sd);
   if (p == 0 || p == 1) x = (p == 0) ? -HUGE_VAL : HUGE_VAL;
-  else {
-    lua_Number q = 1 - p;
-    lua_Number bound;
-    int which = 2;
-    int status;
-    cdfnor(&which, &p, &q, &x, &mean, &sd, &status, &bound);
-    check_status(L, status, bound);
-  }
+  else x = mean + sd * quant_norm(p);
   lua_pushnumber(L, x);
   return 1;
 }
@@ -129,14 +332,7 @@ static int stat_qt (lua_State *L) {
   lua_Number t;
   check_t(L, 2, p, df);
   if (p == 0 || p == 1) t = (p == 0) ? -HUGE_VAL : HUGE_VAL;
-  else {
-    lua_Number q = 1 - p;
-    lua_Number bound;
-    int which = 2;
-    int status;
-    cdft(&which, &p, &q, &t, &df, &status, &bound);
-    check_status(L, status, bound);
-  }
+  else t = quant_t(L, p, df);
   lua_pushnumber(L, t);
   return 1;
 }
@@ -273,17 +469,7 @@ static int stat_qchisq (lua_State *L) {
   lua_Number x;
   check_chisq(L, 2, p, df, pnonc);
   if (p == 0 || p == 1) x = (p == 0) ? 0 : HUGE_VAL;
-  else {
-    lua_Number q = 1 - p;
-    lua_Number bound;
-    int which = 2;
-    int status;
-    if (pnonc == 0) /* central? */
-      cdfchi(&which, &p, &q, &x, &df, &status, &bound);
-    else /* non-central */
-      cdfchn(&which, &p, &q, &x, &df, &pnonc, &status, &bound);
-    check_status(L, status, bound);
-  }
+  else x = quant_chisq(L, p, df, pnonc);
   lua_pushnumber(L, x);
   return 1;
 }
@@ -309,6 +495,469 @@ static int mathx_choose (lua_State *L) {
     return 1;
 }
 
+/* {=====================================================================
+ *    Arrays
+ *
+ *    The xxx_many variants take a table, a vector or a string of packed
+ *    doubles as their first argument, check the remaining arguments once
+ *    and return a vector. dcdflib keeps its state in static variables, so
+ *    only the densities, which do not call it per element, are split
+ *    among threads.
+ * ======================================================================} */
+
+static int max_threads = 0; /* 0: as many as online processors */
+
+cdf_vector *lcdf_newvector (lua_State *L, size_t n) {
+  cdf_vector *v;
+  if (n > LCDF_MAXVECTOR)
+    luaL_error(L, "vector too large");
+  v = (cdf_vector *)lua_newuserdata(L,
+      sizeof(cdf_vector) + (n ? n - 1 : 0) * sizeof(double));
+  v->n = n;
+  luaL_setmetatable(L, "caap.cdf.vector");
+  return v;
+}
+
+cdf_vector *lcdf_tovector (lua_State *L, int i) {
+  cdf_vector *v;
+  size_t k, n;
+  if (lua_type(L, i) == LUA_TSTRING) {
+    const char *s = lua_tolstring(L, i, &n);
+    luaL_argcheck(L, n % sizeof(double) == 0, i, "packed doubles expected");
+    v = lcdf_newvector(L, n / sizeof(double));
+    memcpy(v->x, s, n);
+  } else if (lua_type(L, i) == LUA_TTABLE) {
+    n = luaL_len(L, i);
+    v = lcdf_newvector(L, n);
+    for (k = 0; k < n; k++) {
+      int isnum;
+      lua_rawgeti(L, i, k + 1);
+      v->x[k] = lua_tonumberx(L, -1, &isnum);
+      if (!isnum)
+        luaL_error(L, "number expected at position %d", (int)k + 1);
+      lua_pop(L, 1);
+    }
+  } else
+    return checkvector(L, i);
+  lua_replace(L, i);
+  return v;
+}
+
+const double *lcdf_checkdoubles (lua_State *L, int i, size_t *n) {
+  cdf_vector *v;
+  if (lua_type(L, i) == LUA_TSTRING) {
+    const char *s = lua_tolstring(L, i, n);
+    luaL_argcheck(L, *n % sizeof(double) == 0, i, "packed doubles expected");
+    *n /= sizeof(double);
+    return (const double *)s; /* string contents are suitably aligned */
+  }
+  v = lcdf_tovector(L, i);
+  *n = v->n;
+  return v->x;
+}
+
+/* p at position k out of [0, 1] */
+static void check_prob (lua_State *L, const double *p, size_t n) {
+  size_t k;
+  for (k = 0; k < n; k++)
+    if (!(p[k] >= 0 && p[k] <= 1))
+      luaL_error(L, "out of range at position %d: %f", (int)k + 1, p[k]);
+}
+
+static void check_nonneg (lua_State *L, const double *x, size_t n) {
+  size_t k;
+  for (k = 0; k < n; k++)
+    if (!(x[k] >= 0))
+      luaL_error(L, "out of range at position %d: %f", (int)k + 1, x[k]);
+}
+
+/* {=======   Threads   =======} */
+
+typedef void (*cdf_kernel) (const double *x, double *y, size_t n,
+    const double *par);
+
+typedef struct cdf_task {
+  cdf_kernel f;
+  const double *x, *par;
+  double *y;
+  size_t n;
+} cdf_task;
+
+static void *run_task (void *arg) {
+  cdf_task *t = (cdf_task *)arg;
+  t->f(t->x, t->y, t->n, t->par);
+  return NULL;
+}
+
+/* applies f on contiguous slices of x, one per thread */
+static void parallel (cdf_kernel f, const double *x, double *y, size_t n,
+    const double *par) {
+  long threads = max_threads ? max_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  cdf_task tasks[64];
+  pthread_t ids[64];
+  int i, started = 0;
+  size_t k, slice;
+  if (threads > 64) threads = 64;
+  if (threads > (long)(n / MINSPLIT)) threads = n / MINSPLIT;
+  if (threads < 2) {
+    f(x, y, n, par);
+    return;
+  }
+  slice = (n + threads - 1) / threads;
+  for (i = 0, k = 0; k < n; i++, k += slice) {
+    tasks[i].f = f;
+    tasks[i].x = x + k;
+    tasks[i].y = y + k;
+    tasks[i].n = k + slice < n ? slice : n - k;
+    tasks[i].par = par;
+  }
+  for (started = 1; started < i; started++) /* the first one is ours */
+    if (pthread_create(&ids[started], NULL, run_task, &tasks[started]) != 0)
+      break;
+  for (k = started; (int)k < i; k++) /* not started, run here */
+    run_task(&tasks[k]);
+  run_task(&tasks[0]);
+  while (--started > 0)
+    pthread_join(ids[started], NULL);
+}
+
+/* lcdf.threads([n]) sets the threads used by the array variants, 0 for
+ * as many as processors; returns the previous setting */
+static int set_threads (lua_State *L) {
+  int old = max_threads;
+  if (!lua_isnoneornil(L, 1)) {
+    lua_Integer n = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, n >= 0, 1, "non-negative value expected");
+    max_threads = n;
+  }
+  lua_pushinteger(L, old);
+  return 1;
+}
+
+/* {=======   Densities   =======} */
+
+static void kern_dnorm (const double *x, double *y, size_t n,
+    const double *par) {
+  double mean = par[0], sd = par[1], c = 1 / (SQRT2PI * sd), d;
+  size_t k;
+  for (k = 0; k < n; k++) {
+    d = (x[k] - mean) / sd;
+    y[k] = c * exp(-d*d / 2);
+  }
+}
+
+static void kern_dt (const double *x, double *y, size_t n,
+    const double *par) {
+  double df = par[0], c = par[1]; /* c: -log(beta(df/2, 1/2) sqrt(df)) */
+  size_t k;
+  for (k = 0; k < n; k++)
+    y[k] = exp(c - (df + 1) / 2 * log(1 + x[k] * x[k] / df));
+}
+
+static void kern_df (const double *x, double *y, size_t n,
+    const double *par) {
+  double df1 = par[0], df2 = par[1], r = par[2], c = par[3];
+  size_t k;
+  for (k = 0; k < n; k++)
+    y[k] = exp(c + (df1 - 1) * log(x[k]) - (df1 + df2) * log(1 + r * x[k]));
+}
+
+static void kern_dchisq (const double *x, double *y, size_t n,
+    const double *par) {
+  double h = par[0], c = par[1], df = par[2], pnonc = par[3], d, t;
+  size_t k;
+  int i;
+  for (k = 0; k < n; k++) {
+    d = exp((h - 1) * log(x[k]) - x[k] / 2 - c);
+    if (pnonc != 0) { /* weighted series, as in dchisq */
+      t = d *= exp(-pnonc / 2);
+      for (i = 1; i < MAXITER && d > LBOUND && t > DBL_EPSILON * d; i++)
+        d += t *= x[k] * pnonc / (2 * i * (df + 2 * (i - 1)));
+    }
+    y[k] = d;
+  }
+}
+
+static int many_dnorm (lua_State *L) {
+  cdf_vector *x = lcdf_tovector(L, 1), *y;
+  double par[2];
+  par[0] = luaL_optnumber(L, 2, 0);
+  par[1] = luaL_optnumber(L, 3, 1);
+  check_norm(L, 1, 0, par[1]);
+  y = lcdf_newvector(L, x->n);
+  parallel(kern_dnorm, x->x, y->x, x->n, par);
+  return 1;
+}
+
+static int many_dt (lua_State *L) {
+  cdf_vector *x = lcdf_tovector(L, 1), *y;
+  double par[2], d, t = 0.5;
+  par[0] = luaL_checknumber(L, 2);
+  check_t(L, 1, 0, par[0]);
+  d = par[0] / 2;
+  par[1] = -dlnbet(&d, &t) - log(par[0]) / 2;
+  y = lcdf_newvector(L, x->n);
+  parallel(kern_dt, x->x, y->x, x->n, par);
+  return 1;
+}
+
+static int many_df (lua_State *L) {
+  cdf_vector *x = lcdf_tovector(L, 1), *y;
+  double par[4], dfn = luaL_checknumber(L, 2), dfd = luaL_checknumber(L, 3);
+  check_f(L, 1, 0, dfn, dfd);
+  check_nonneg(L, x->x, x->n);
+  par[0] = dfn / 2;
+  par[1] = dfd / 2;
+  par[2] = dfn / dfd;
+  par[3] = par[0] * log(par[2]) - dlnbet(&par[0], &par[1]);
+  y = lcdf_newvector(L, x->n);
+  parallel(kern_df, x->x, y->x, x->n, par);
+  return 1;
+}
+
+static int many_dchisq (lua_State *L) {
+  cdf_vector *x = lcdf_tovector(L, 1), *y;
+  double par[4];
+  par[2] = luaL_checknumber(L, 2);
+  par[3] = luaL_optnumber(L, 3, 0);
+  check_chisq(L, 1, 0, par[2], par[3]);
+  check_nonneg(L, x->x, x->n);
+  par[0] = par[2] / 2;
+  par[1] = par[0] * M_LN2 + dlngam(&par[0]);
+  y = lcdf_newvector(L, x->n);
+  parallel(kern_dchisq, x->x, y->x, x->n, par);
+  return 1;
+}
+
+/* {=======   Distributions & quantiles   =======} */
+
+static int many_pnorm (lua_State *L) {
+  cdf_vector *x = lcdf_tovector(L, 1), *y;
+  lua_Number mean = luaL_optnumber(L, 2, 0);
+  lua_Number sd = luaL_optnumber(L, 3, 1);
+  lua_Number z, q;
+  size_t k;
+  check_norm(L, 1, 0, sd);
+  y = lcdf_newvector(L, x->n);
+  for (k = 0; k < x->n; k++) { /* as cdfnor, without its checks */
+    z = (x->x[k] - mean) / sd;
+    cumnor(&z, &y->x[k], &q);
+  }
+  return 1;
+}
+
+static int many_qnorm (lua_State *L) {
+  cdf_vector *p = lcdf_tovector(L, 1), *y;
+  lua_Number mean = luaL_optnumber(L, 2, 0);
+  lua_Number sd = luaL_optnumber(L, 3, 1);
+  size_t k;
+  check_norm(L, 2, 0, sd);
+  check_prob(L, p->x, p->n);
+  y = lcdf_newvector(L, p->n);
+  for (k = 0; k < p->n; k++) {
+    if (p->x[k] == 0 || p->x[k] == 1)
+      y->x[k] = (p->x[k] == 0) ? -HUGE_VAL : HUGE_VAL;
+    else
+      y->x[k] = mean + sd * quant_norm(p->x[k]);
+  }
+  return 1;
+}
+
+static int many_pt (lua_State *L) {
+  cdf_vector *x = lcdf_tovector(L, 1), *y;
+  lua_Number df = luaL_checknumber(L, 2);
+  lua_Number p, q, bound;
+  int which = 1, status;
+  size_t k;
+  check_t(L, 1, 0, df);
+  y = lcdf_newvector(L, x->n);
+  for (k = 0; k < x->n; k++) {
+    cdft(&which, &p, &q, &x->x[k], &df, &status, &bound);
+    check_status(L, status, bound);
+    y->x[k] = p;
+  }
+  return 1;
+}
+
+static int many_qt (lua_State *L) {
+  cdf_vector *p = lcdf_tovector(L, 1), *y;
+  lua_Number df = luaL_checknumber(L, 2);
+  size_t k;
+  check_t(L, 2, 0, df);
+  check_prob(L, p->x, p->n);
+  y = lcdf_newvector(L, p->n);
+  for (k = 0; k < p->n; k++) {
+    if (p->x[k] == 0 || p->x[k] == 1)
+      y->x[k] = (p->x[k] == 0) ? -HUGE_VAL : HUGE_VAL;
+    else
+      y->x[k] = quant_t(L, p->x[k], df);
+  }
+  return 1;
+}
+
+static int many_pf (lua_State *L) {
+  cdf_vector *x = lcdf_tovector(L, 1), *y;
+  lua_Number dfn = luaL_checknumber(L, 2);
+  lua_Number dfd = luaL_checknumber(L, 3);
+  lua_Number phonc = luaL_optnumber(L, 4, 0);
+  lua_Number p, q, bound;
+  int which = 1, status;
+  size_t k;
+  check_f(L, 1, 0, dfn, dfd);
+  check_nonneg(L, x->x, x->n);
+  y = lcdf_newvector(L, x->n);
+  for (k = 0; k < x->n; k++) {
+    if (phonc == 0) /* central? */
+      cdff(&which, &p, &q, &x->x[k], &dfn, &dfd, &status, &bound);
+    else /* non-central */
+      cdffnc(&which, &p, &q, &x->x[k], &dfn, &dfd, &phonc, &status, &bound);
+    check_status(L, status, bound);
+    y->x[k] = p;
+  }
+  return 1;
+}
+
+static int many_qf (lua_State *L) {
+  cdf_vector *p = lcdf_tovector(L, 1), *y;
+  lua_Number dfn = luaL_checknumber(L, 2);
+  lua_Number dfd = luaL_checknumber(L, 3);
+  lua_Number phonc = luaL_optnumber(L, 4, 0);
+  lua_Number q, bound;
+  int which = 2, status;
+  size_t k;
+  check_f(L, 2, 0, dfn, dfd);
+  check_prob(L, p->x, p->n);
+  y = lcdf_newvector(L, p->n);
+  for (k = 0; k < p->n; k++) {
+    if (p->x[k] == 0 || p->x[k] == 1)
+      y->x[k] = (p->x[k] == 0) ? 0 : HUGE_VAL;
+    else {
+      q = 1 - p->x[k];
+      if (phonc == 0) /* central? */
+        cdff(&which, &p->x[k], &q, &y->x[k], &dfn, &dfd, &status, &bound);
+      else /* non-central */
+        cdffnc(&which, &p->x[k], &q, &y->x[k], &dfn, &dfd, &phonc, &status,
+            &bound);
+      check_status(L, status, bound);
+    }
+  }
+  return 1;
+}
+
+static int many_pchisq (lua_State *L) {
+  cdf_vector *x = lcdf_tovector(L, 1), *y;
+  lua_Number df = luaL_checknumber(L, 2);
+  lua_Number pnonc = luaL_optnumber(L, 3, 0);
+  lua_Number p, q, bound;
+  int which = 1, status;
+  size_t k;
+  check_chisq(L, 1, 0, df, pnonc);
+  check_nonneg(L, x->x, x->n);
+  y = lcdf_newvector(L, x->n);
+  for (k = 0; k < x->n; k++) {
+    if (pnonc == 0) /* central? */
+      cdfchi(&which, &p, &q, &x->x[k], &df, &status, &bound);
+    else /* non-central */
+      cdfchn(&which, &p, &q, &x->x[k], &df, &pnonc, &status, &bound);
+    check_status(L, status, bound);
+    y->x[k] = p;
+  }
+  return 1;
+}
+
+static int many_qchisq (lua_State *L) {
+  cdf_vector *p = lcdf_tovector(L, 1), *y;
+  lua_Number df = luaL_checknumber(L, 2);
+  lua_Number pnonc = luaL_optnumber(L, 3, 0);
+  size_t k;
+  check_chisq(L, 2, 0, df, pnonc);
+  check_prob(L, p->x, p->n);
+  y = lcdf_newvector(L, p->n);
+  for (k = 0; k < p->n; k++) {
+    if (p->x[k] == 0 || p->x[k] == 1)
+      y->x[k] = (p->x[k] == 0) ? 0 : HUGE_VAL;
+    else
+      y->x[k] = quant_chisq(L, p->x[k], df, pnonc);
+  }
+  return 1;
+}
+
+/* {=======   Vectors   =======} */
+
+/* lcdf.vector(n | table | packed doubles) */
+static int vector_new (lua_State *L) {
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    lua_Integer n = luaL_checkinteger(L, 1);
+    cdf_vector *v;
+    luaL_argcheck(L, n >= 0, 1, "non-negative value expected");
+    luaL_argcheck(L, (lua_Unsigned)n <= LCDF_MAXVECTOR, 1, "vector too large");
+    v = lcdf_newvector(L, n);
+    memset(v->x, 0, n * sizeof(double));
+    return 1;
+  }
+  lua_settop(L, 1);
+  lcdf_tovector(L, 1);
+  return 1;
+}
+
+/* v[i] for 1 <= i <= #v, else the method named i */
+static int vector_index (lua_State *L) {
+  cdf_vector *v = checkvector(L, 1);
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    lua_Integer i = luaL_checkinteger(L, 2);
+    if (i < 1 || i > (lua_Integer)v->n)
+      return 0;
+    lua_pushnumber(L, v->x[i-1]);
+    return 1;
+  }
+  lua_gettable(L, lua_upvalueindex(1));
+  return 1;
+}
+
+static int vector_newindex (lua_State *L) {
+  cdf_vector *v = checkvector(L, 1);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, i >= 1 && i <= (lua_Integer)v->n, 2, "index out of range");
+  v->x[i-1] = luaL_checknumber(L, 3);
+  return 0;
+}
+
+static int vector_len (lua_State *L) {
+  cdf_vector *v = checkvector(L, 1);
+  lua_pushinteger(L, v->n);
+  return 1;
+}
+
+static int vector_totable (lua_State *L) {
+  cdf_vector *v = checkvector(L, 1);
+  size_t k;
+  lua_createtable(L, v->n, 0);
+  for (k = 0; k < v->n; k++) {
+    lua_pushnumber(L, v->x[k]);
+    lua_rawseti(L, -2, k + 1);
+  }
+  return 1;
+}
+
+/* packed doubles, as string.pack('d', ...) */
+static int vector_pack (lua_State *L) {
+  cdf_vector *v = checkvector(L, 1);
+  lua_pushlstring(L, (const char *)v->x, v->n * sizeof(double));
+  return 1;
+}
+
+static int vector_asstr (lua_State *L) {
+  cdf_vector *v = checkvector(L, 1);
+  lua_pushfstring(L, "CDF vector (%d)", (int)v->n);
+  return 1;
+}
+
+static const struct luaL_Reg vector_meths[] = {
+    {"totable", vector_totable},
+    {"pack", vector_pack},
+    {NULL, NULL}
+};
+
 /* {=====================================================================
  *    Interface
  * ======================================================================} */
@@ -328,12 +977,43 @@ static const struct luaL_Reg cdf_funcs[] = {
     {"pchisq", stat_pchisq},
     {"qchisq", stat_qchisq},
     {"choose", mathx_choose},
+    /* arrays */
+    {"dnorm_many", many_dnorm},
+    {"pnorm_many", many_pnorm},
+    {"qnorm_many", many_qnorm},
+    {"dstud_many", many_dt},
+    {"pstud_many", many_pt},
+    {"qstud_many", many_qt},
+    {"dfstat_many", many_df},
+    {"pfstat_many", many_pf},
+    {"qfstat_many", many_qf},
+    {"dchisq_many", many_dchisq},
+    {"pchisq_many", many_pchisq},
+    {"qchisq_many", many_qchisq},
+    {"vector", vector_new},
+    {"threads", set_threads},
+    {"precision", set_precision},
      {NULL, NULL}
 };
 
 int luaopen_lcdf (lua_State *L) {
+    // array results
+    luaL_newmetatable(L, "caap.cdf.vector");
+    luaL_newlib(L, vector_meths);
+    lua_pushcclosure(L, vector_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, vector_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, vector_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, vector_asstr);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
+
     // create library
     luaL_newlib(L, cdf_funcs);
+    lcdf_openstats(L);
+    lua_setfield(L, -2, "stats");
     return 1;
 }
 
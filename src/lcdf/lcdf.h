@@ -0,0 +1,34 @@
+#ifndef LCDF_H
+#define LCDF_H
+
+/* shared by lcdf.c & lstats.c */
+
+#include <lua.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define checkvector(L,i) (cdf_vector *)luaL_checkudata(L, i, "caap.cdf.vector")
+
+/* n doubles, as returned by the xxx_many functions */
+typedef struct cdf_vector {
+  size_t n;
+  double x[1];
+} cdf_vector;
+
+/* longest vector whose size fits in size_t */
+#define LCDF_MAXVECTOR ((SIZE_MAX - sizeof(cdf_vector)) / sizeof(double))
+
+cdf_vector *lcdf_newvector (lua_State *L, size_t n);
+
+/* vector at i; a table or a string of packed doubles is converted into a
+ * vector, replacing it on the stack */
+cdf_vector *lcdf_tovector (lua_State *L, int i);
+
+/* read-only doubles at i: packed strings are used in place, tables are
+ * converted as by lcdf_tovector */
+const double *lcdf_checkdoubles (lua_State *L, int i, size_t *n);
+
+/* pushes the lcdf.stats table */
+int lcdf_openstats (lua_State *L);
+
+#endif
@@ -0,0 +1,387 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "lcdf.h"
+
+/* Descriptive statistics over packed doubles, lcdf vectors or Lua arrays,
+ * as lcdf.stats. Summaries are tables {n, avg, s2, sd, min, max, sum} with
+ * s2 the sample variance, as expected by carlos.stats (one, pooled,
+ * unequal, ...). NaN values are not skipped. */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define STATS_X86 1
+#include <immintrin.h>
+#define STATS_TARGET(x) __attribute__((target(x)))
+#endif
+
+#define LANES (4) /* independent accumulators per pass */
+#define DENSEKEYS(n) (2 * (n) + 1024) /* key span grouped without sorting */
+
+/* {=====================================================================
+ *    Kernels
+ * ======================================================================} */
+
+typedef struct stats_acc {
+  double n, avg, m2, min, max, sum;
+} stats_acc;
+
+static void acc_init (stats_acc *a) {
+  a->n = a->avg = a->m2 = a->sum = 0;
+  a->min = HUGE_VAL;
+  a->max = -HUGE_VAL;
+}
+
+/* Welford update */
+static void acc_add (stats_acc *a, double x) {
+  double d = x - a->avg;
+  a->n++;
+  a->avg += d / a->n;
+  a->m2 += d * (x - a->avg);
+  a->sum += x;
+  if (x < a->min) a->min = x;
+  if (x > a->max) a->max = x;
+}
+
+/* Chan et al. pairwise combination of b into a */
+static void acc_merge (stats_acc *a, const stats_acc *b) {
+  double n = a->n + b->n, d = b->avg - a->avg;
+  if (b->n == 0) return;
+  a->avg += d * b->n / n;
+  a->m2 += b->m2 + d * d * a->n * b->n / n;
+  a->n = n;
+  a->sum += b->sum;
+  if (b->min < a->min) a->min = b->min;
+  if (b->max > a->max) a->max = b->max;
+}
+
+/* single pass over x, one Welford accumulator per lane */
+static void summarize (const double *x, size_t n, stats_acc *a) {
+  stats_acc lane[LANES];
+  size_t i, j;
+  for (j = 0; j < LANES; j++) acc_init(&lane[j]);
+  for (i = 0; i + LANES <= n; i += LANES)
+    for (j = 0; j < LANES; j++)
+      acc_add(&lane[j], x[i+j]);
+  for (; i < n; i++)
+    acc_add(&lane[0], x[i]);
+  *a = lane[0];
+  for (j = 1; j < LANES; j++) acc_merge(a, &lane[j]);
+}
+
+static void reduce_scalar (const double *x, size_t n, double *sum,
+    double *min, double *max) {
+  double s[LANES] = {0}, lo[LANES], hi[LANES];
+  size_t i, j;
+  for (j = 0; j < LANES; j++) {
+    lo[j] = HUGE_VAL;
+    hi[j] = -HUGE_VAL;
+  }
+  for (i = 0; i + LANES <= n; i += LANES)
+    for (j = 0; j < LANES; j++) {
+      s[j] += x[i+j];
+      lo[j] = (x[i+j] < lo[j]) ? x[i+j] : lo[j];
+      hi[j] = (x[i+j] > hi[j]) ? x[i+j] : hi[j];
+    }
+  for (; i < n; i++) {
+    s[0] += x[i];
+    lo[0] = (x[i] < lo[0]) ? x[i] : lo[0];
+    hi[0] = (x[i] > hi[0]) ? x[i] : hi[0];
+  }
+  for (j = 1; j < LANES; j++) {
+    s[0] += s[j];
+    lo[0] = (lo[j] < lo[0]) ? lo[j] : lo[0];
+    hi[0] = (hi[j] > hi[0]) ? hi[j] : hi[0];
+  }
+  *sum = s[0];
+  *min = lo[0];
+  *max = hi[0];
+}
+
+#ifdef STATS_X86
+STATS_TARGET("avx")
+static void reduce_avx (const double *x, size_t n, double *sum,
+    double *min, double *max) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  __m256d lo0 = _mm256_set1_pd(HUGE_VAL), lo1 = lo0;
+  __m256d hi0 = _mm256_set1_pd(-HUGE_VAL), hi1 = hi0;
+  double s[8], lo[8], hi[8];
+  size_t i, j;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256d v0 = _mm256_loadu_pd(x + i), v1 = _mm256_loadu_pd(x + i + 4);
+    s0 = _mm256_add_pd(s0, v0);
+    s1 = _mm256_add_pd(s1, v1);
+    lo0 = _mm256_min_pd(lo0, v0);
+    lo1 = _mm256_min_pd(lo1, v1);
+    hi0 = _mm256_max_pd(hi0, v0);
+    hi1 = _mm256_max_pd(hi1, v1);
+  }
+  _mm256_storeu_pd(s, s0); _mm256_storeu_pd(s + 4, s1);
+  _mm256_storeu_pd(lo, lo0); _mm256_storeu_pd(lo + 4, lo1);
+  _mm256_storeu_pd(hi, hi0); _mm256_storeu_pd(hi + 4, hi1);
+  reduce_scalar(x + i, n - i, sum, min, max); /* tail */
+  for (j = 0; j < 8; j++) {
+    *sum += s[j];
+    *min = (lo[j] < *min) ? lo[j] : *min;
+    *max = (hi[j] > *max) ? hi[j] : *max;
+  }
+}
+#endif
+
+/* sum, min & max of x; the vector path is chosen when the module opens */
+static void (*reduce) (const double *x, size_t n, double *sum,
+    double *min, double *max) = reduce_scalar;
+
+/* rearranges a[lo..hi] so that a[k] is in its sorted position, with no
+ * greater value before it and no smaller one after it */
+static void nth_element (double *a, ptrdiff_t lo, ptrdiff_t hi, ptrdiff_t k) {
+  double t, pivot;
+  while (lo < hi) {
+    ptrdiff_t mid = lo + (hi - lo) / 2, i = lo, j = hi;
+    /* median of three into a[mid] */
+    if (a[mid] < a[lo]) { t = a[mid]; a[mid] = a[lo]; a[lo] = t; }
+    if (a[hi] < a[lo]) { t = a[hi]; a[hi] = a[lo]; a[lo] = t; }
+    if (a[hi] < a[mid]) { t = a[hi]; a[hi] = a[mid]; a[mid] = t; }
+    pivot = a[mid];
+    while (i <= j) {
+      while (a[i] < pivot) i++;
+      while (a[j] > pivot) j--;
+      if (i <= j) {
+        t = a[i]; a[i] = a[j]; a[j] = t;
+        i++; j--;
+      }
+    }
+    if (k <= j) hi = j;
+    else if (k >= i) lo = i;
+    else return; /* between j and i all equal the pivot */
+  }
+}
+
+/* quantile p of a, R's type 7, once a[0..from) hold no value greater than
+ * any in a[from..n); a is partially reordered */
+static double quantile (double *a, size_t n, size_t from, double p) {
+  double h = (n - 1) * p, next;
+  size_t k = (size_t)floor(h), i;
+  nth_element(a, from, n - 1, k);
+  if (k + 1 >= n || h == k) return a[k];
+  for (next = a[k+1], i = k + 2; i < n; i++) /* least after a[k] */
+    if (a[i] < next) next = a[i];
+  return a[k] + (h - k) * (next - a[k]);
+}
+
+/* {=====================================================================
+ *    Interface
+ * ======================================================================} */
+
+static void push_acc (lua_State *L, const stats_acc *a) {
+  double s2 = (a->n > 1) ? a->m2 / (a->n - 1) : 0;
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, (lua_Integer)a->n);
+  lua_setfield(L, -2, "n");
+  lua_pushnumber(L, a->avg);
+  lua_setfield(L, -2, "avg");
+  lua_pushnumber(L, s2);
+  lua_setfield(L, -2, "s2");
+  lua_pushnumber(L, sqrt(s2));
+  lua_setfield(L, -2, "sd");
+  lua_pushnumber(L, a->min);
+  lua_setfield(L, -2, "min");
+  lua_pushnumber(L, a->max);
+  lua_setfield(L, -2, "max");
+  lua_pushnumber(L, a->sum);
+  lua_setfield(L, -2, "sum");
+}
+
+/* stats.summary(x) */
+static int stats_summary (lua_State *L) {
+  size_t n;
+  const double *x = lcdf_checkdoubles(L, 1, &n);
+  stats_acc a;
+  summarize(x, n, &a);
+  push_acc(L, &a);
+  return 1;
+}
+
+/* stats.sum(x) */
+static int stats_sum (lua_State *L) {
+  size_t n;
+  const double *x = lcdf_checkdoubles(L, 1, &n);
+  double sum, min, max;
+  reduce(x, n, &sum, &min, &max);
+  lua_pushnumber(L, sum);
+  return 1;
+}
+
+/* stats.range(x) returns min and max */
+static int stats_range (lua_State *L) {
+  size_t n;
+  const double *x = lcdf_checkdoubles(L, 1, &n);
+  double sum, min, max;
+  reduce(x, n, &sum, &min, &max);
+  lua_pushnumber(L, min);
+  lua_pushnumber(L, max);
+  return 2;
+}
+
+typedef struct stats_prob {
+  double p;
+  int pos;
+} stats_prob;
+
+static int cmp_prob (const void *a, const void *b) {
+  double pa = ((const stats_prob *)a)->p, pb = ((const stats_prob *)b)->p;
+  return (pa > pb) - (pa < pb);
+}
+
+/* stats.quantile(x, p | {p...}): a number, or a table in the order of the
+ * given probabilities */
+static int stats_quantile (lua_State *L) {
+  size_t n, m, k, from = 0;
+  const double *x = lcdf_checkdoubles(L, 1, &n);
+  int many = lua_istable(L, 2);
+  stats_prob *ps;
+  double *a;
+  m = many ? luaL_len(L, 2) : 1;
+  ps = (stats_prob *)lua_newuserdata(L, m * sizeof(stats_prob));
+  for (k = 0; k < m; k++) {
+    if (many) {
+      lua_rawgeti(L, 2, k + 1);
+      ps[k].p = luaL_checknumber(L, -1);
+      lua_pop(L, 1);
+    } else
+      ps[k].p = luaL_checknumber(L, 2);
+    ps[k].pos = k + 1;
+    if (!(ps[k].p >= 0 && ps[k].p <= 1))
+      luaL_error(L, "probability out of range at position %d", (int)k + 1);
+  }
+  luaL_argcheck(L, n > 0, 1, "empty sample");
+  a = (double *)lua_newuserdata(L, n * sizeof(double));
+  for (k = 0; k < n; k++)
+    if (isnan(a[k] = x[k]))
+      luaL_error(L, "NaN at position %d", (int)k + 1);
+  qsort(ps, m, sizeof(stats_prob), cmp_prob);
+  if (many) lua_createtable(L, m, 0);
+  for (k = 0; k < m; k++) { /* ascending, each selection narrows the next */
+    lua_pushnumber(L, quantile(a, n, from, ps[k].p));
+    from = (size_t)floor((n - 1) * ps[k].p);
+    if (many) lua_rawseti(L, -2, ps[k].pos);
+  }
+  return 1;
+}
+
+/* stats.histogram(x, bins [, lo [, hi]]) returns counts, lo and hi; values
+ * out of [lo, hi] and non-finite values are not counted, hi falls in the
+ * last bin. Bounds must be finite, defaults are the sample's min and max */
+static int stats_histogram (lua_State *L) {
+  size_t n, k;
+  const double *x = lcdf_checkdoubles(L, 1, &n);
+  lua_Integer bins = luaL_checkinteger(L, 2), b;
+  double lo, hi, scale, sum;
+  size_t *counts;
+  luaL_argcheck(L, bins > 0, 2, "positive value expected");
+  luaL_argcheck(L, bins <= INT_MAX && (size_t)bins <= SIZE_MAX / sizeof(size_t),
+      2, "too many bins");
+  reduce(x, n, &sum, &lo, &hi);
+  lo = luaL_optnumber(L, 3, lo);
+  hi = luaL_optnumber(L, 4, hi);
+  if (n > 0 && !(isfinite(lo) && isfinite(hi) && isfinite(hi - lo)))
+    luaL_error(L, "histogram bounds must be finite");
+  luaL_argcheck(L, n == 0 || lo <= hi, 4, "upper bound below lower bound");
+  counts = (size_t *)lua_newuserdata(L, bins * sizeof(size_t));
+  memset(counts, 0, bins * sizeof(size_t));
+  scale = (hi > lo) ? bins / (hi - lo) : 0;
+  for (k = 0; k < n; k++)
+    if (isfinite(x[k]) && x[k] >= lo && x[k] <= hi) {
+      b = (lua_Integer)((x[k] - lo) * scale);
+      counts[b < bins ? b : bins - 1]++;
+    }
+  lua_createtable(L, bins, 0);
+  for (b = 0; b < bins; b++) {
+    lua_pushinteger(L, counts[b]);
+    lua_rawseti(L, -2, b + 1);
+  }
+  lua_pushnumber(L, lo);
+  lua_pushnumber(L, hi);
+  return 3;
+}
+
+typedef struct stats_key {
+  double key;
+  size_t i;
+} stats_key;
+
+static int cmp_key (const void *a, const void *b) {
+  const stats_key *ka = (const stats_key *)a, *kb = (const stats_key *)b;
+  if (ka->key != kb->key) return (ka->key > kb->key) - (ka->key < kb->key);
+  return (ka->i > kb->i) - (ka->i < kb->i); /* stable: keep sample order */
+}
+
+/* stats.group(x, keys) returns {[key] = summary}; keys are integers,
+ * one per element of x */
+static int stats_group (lua_State *L) {
+  size_t n, m, k;
+  const double *x = lcdf_checkdoubles(L, 1, &n);
+  const double *keys = lcdf_checkdoubles(L, 2, &m);
+  double sum, kmin, kmax;
+  luaL_argcheck(L, m == n, 2, "one key per value expected");
+  for (k = 0; k < n; k++)
+    if (keys[k] != floor(keys[k]) || fabs(keys[k]) > 9007199254740992.0)
+      luaL_error(L, "integer key expected at position %d", (int)k + 1);
+  reduce(keys, n, &sum, &kmin, &kmax);
+  lua_newtable(L);
+  if (n == 0) return 1;
+  if (kmax - kmin < DENSEKEYS(n)) { /* accumulators indexed by key */
+    size_t span = (size_t)(kmax - kmin) + 1;
+    stats_acc *acc = (stats_acc *)lua_newuserdata(L, span * sizeof(stats_acc));
+    for (k = 0; k < span; k++) acc_init(&acc[k]);
+    for (k = 0; k < n; k++)
+      acc_add(&acc[(size_t)(keys[k] - kmin)], x[k]);
+    for (k = 0; k < span; k++)
+      if (acc[k].n > 0) {
+        push_acc(L, &acc[k]);
+        lua_rawseti(L, -3, (lua_Integer)kmin + k);
+      }
+    lua_pop(L, 1);
+  } else { /* sparse keys: sort, then one run per key */
+    stats_key *sk = (stats_key *)lua_newuserdata(L, n * sizeof(stats_key));
+    stats_acc a;
+    size_t r;
+    for (k = 0; k < n; k++) {
+      sk[k].key = keys[k];
+      sk[k].i = k;
+    }
+    qsort(sk, n, sizeof(stats_key), cmp_key);
+    for (k = 0; k < n; k = r) {
+      acc_init(&a);
+      for (r = k; r < n && sk[r].key == sk[k].key; r++)
+        acc_add(&a, x[sk[r].i]);
+      push_acc(L, &a);
+      lua_rawseti(L, -3, (lua_Integer)sk[k].key);
+    }
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
+static const struct luaL_Reg stats_funcs[] = {
+    {"summary", stats_summary},
+    {"sum", stats_sum},
+    {"range", stats_range},
+    {"quantile", stats_quantile},
+    {"histogram", stats_histogram},
+    {"group", stats_group},
+    {NULL, NULL}
+};
+
+int lcdf_openstats (lua_State *L) {
+#ifdef STATS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+      reduce = reduce_avx;
+#endif
+    luaL_newlib(L, stats_funcs);
+    return 1;
+}
@@ -5,75 +5,210 @@
 #include <stdio.h>
 
 #include <openssl/evp.h>
+#include <openssl/core_names.h>
 
+#define checkdigester(L) (dgst_state *)luaL_checkudata(L, 1, "caap.openssl.digester")
 
-static int digestData(lua_State *L, const EVP_MD *md, const char *mssg) {
-    EVP_MD_CTX *mdctx;
+// a reusable context, either a plain digest or an HMAC keyed at creation
+typedef struct dgst_state {
+    const EVP_MD *md;
+    EVP_MD_CTX *mdctx;   // plain digests
+    EVP_MAC_CTX *macctx; // HMAC, NULL for plain digests
+} dgst_state;
+
+// a NULL key restarts the HMAC with the key set at creation
+static int dgst_reset(dgst_state *st) {
+    if (st->macctx)
+	return EVP_MAC_init(st->macctx, NULL, 0, NULL);
+    return EVP_DigestInit_ex(st->mdctx, st->md, NULL);
+}
+
+static int dgst_update(dgst_state *st, const char *data, size_t len) {
+    if (st->macctx)
+	return EVP_MAC_update(st->macctx, (const unsigned char *)data, len);
+    return EVP_DigestUpdate(st->mdctx, (const void *)data, len);
+}
+
+// pushes the digest and leaves the context ready for the next message
+static int dgst_final(lua_State *L, dgst_state *st) {
     unsigned char md_value[EVP_MAX_MD_SIZE];
     unsigned int md_len;
+    size_t len = EVP_MAX_MD_SIZE;
+    int rc;
+    if (st->macctx)
+	rc = EVP_MAC_final(st->macctx, md_value, &len, sizeof(md_value));
+    else {
+	rc = EVP_DigestFinal_ex(st->mdctx, md_value, &md_len);
+	len = md_len;
+    }
+    if (rc != 1 || dgst_reset(st) != 1)
+	luaL_error(L, "error while computing message digest");
+    lua_pushlstring(L, (const char *)md_value, len);
+    return 1;
+}
+
+static void dgst_free(dgst_state *st) {
+    if (st->mdctx)
+	EVP_MD_CTX_free(st->mdctx);
+    if (st->macctx)
+	EVP_MAC_CTX_free(st->macctx);
+    st->mdctx = NULL;
+    st->macctx = NULL;
+}
 
-    mdctx = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(mdctx, md, NULL);
-    // digests the data in mssg string(s)
-    EVP_DigestUpdate(mdctx, (const void *)mssg, strlen(mssg));
-    // execute hashing function
-    EVP_DigestFinal_ex(mdctx, md_value, &md_len);
-    EVP_MD_CTX_free(mdctx);
-
-/*
-    char c, str[md_len*2], *h = str, lookup[] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
-    int i;
-    for( i=0; i<md_len; i++ ) {
-	c = md_value[i];
-	*h++ = lookup[ (c >> 4) & 0x0F ];
-	*h++ = lookup[ c & 0x0F ];
+// an HMAC context for md, keyed once
+static EVP_MAC_CTX *hmac_new(const EVP_MD *md, const char *key, size_t klen) {
+    EVP_MAC *mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    if (mac == NULL)
+	return NULL;
+    EVP_MAC_CTX *ctx = EVP_MAC_CTX_new(mac);
+    EVP_MAC_free(mac); // the context holds its own reference
+    if (ctx == NULL)
+	return NULL;
+    OSSL_PARAM params[2];
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)EVP_MD_name(md), 0);
+    params[1] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_init(ctx, (const unsigned char *)key, klen, params) != 1) {
+	EVP_MAC_CTX_free(ctx);
+	return NULL;
     }
+    return ctx;
+}
 
-    lua_pushlstring(L, str, md_len*2);
-*/
-    lua_pushlstring(L, (const char *)md_value, md_len);
+// pushes a new state with metatable mt, or nil and an error message
+static int new_state(lua_State *L, const char *mt, const char *dgst, const char *key, size_t klen) {
+    const EVP_MD *md = EVP_get_digestbyname( dgst );
+    if (md == NULL) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "Unknown message digest %s\n", dgst);
+	return 2;
+    }
+
+    dgst_state *st = (dgst_state *)lua_newuserdata(L, sizeof(dgst_state));
+    st->md = md;
+    st->mdctx = NULL;
+    st->macctx = NULL;
+    luaL_setmetatable(L, mt);
+
+    int ok;
+    if (key)
+	ok = (st->macctx = hmac_new(md, key, klen)) != NULL;
+    else
+	ok = (st->mdctx = EVP_MD_CTX_new()) != NULL && dgst_reset(st) == 1;
+    if (!ok) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "Could not initialize message digest %s\n", dgst);
+	return 2;
+    }
     return 1;
 }
 
-
 ///////////////////////////////////
 
 static int digestString(lua_State *L) {
-    const char *message = luaL_checkstring(L, 1);
-    EVP_MD *md = *(EVP_MD **)lua_touserdata(L, lua_upvalueindex(1));
-    return digestData(L, md, message);
+    size_t len;
+    const char *message = luaL_checklstring(L, 1, &len);
+    dgst_state *st = (dgst_state *)lua_touserdata(L, lua_upvalueindex(1));
+    dgst_update(st, message, len);
+    return dgst_final(L, st);
 }
 
+// digest(name) returns a function hashing its argument
 static int getDigest(lua_State *L) {
-    const char *dgst = lua_tostring(L, 1);
+    const char *dgst = luaL_checkstring(L, 1);
+    if (new_state(L, "caap.openssl.digest", dgst, NULL, 0) == 2)
+	return 2;
+    lua_pushcclosure(L, &digestString, 1); // state
+    return 1;
+}
 
-    const EVP_MD *md;
-    const EVP_MD **pmd = (const EVP_MD **)lua_newuserdata(L, sizeof(EVP_MD *));
-    luaL_getmetatable(L, "caap.openssl.digest");
-    lua_setmetatable(L, -2);
+//////
 
-    OpenSSL_add_all_digests();
-    md = EVP_get_digestbyname( dgst );
-    *pmd = md;
-    if (md == NULL) {
-	EVP_cleanup();
-	lua_pushnil(L);
-	lua_pushfstring(L, "Unknown message digest %s\n", dgst);
-	return 2;
+// digester(name [, key]): HMAC if a key is given
+static int new_digester(lua_State *L) {
+    const char *dgst = luaL_checkstring(L, 1);
+    size_t klen = 0;
+    const char *key = luaL_optlstring(L, 2, NULL, &klen);
+    return new_state(L, "caap.openssl.digester", dgst, key, klen);
+}
+
+// digester:update(chunk, ...) returns the digester
+static int digester_update(lua_State *L) {
+    dgst_state *st = checkdigester(L);
+    int i, N = lua_gettop(L);
+    for (i = 2; i <= N; i++) {
+	size_t len;
+	const char *data = luaL_checklstring(L, i, &len);
+	if (dgst_update(st, data, len) != 1)
+	    luaL_error(L, "error while updating message digest");
     }
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int digester_final(lua_State *L) {
+    dgst_state *st = checkdigester(L);
+    return dgst_final(L, st);
+}
 
-    lua_pushcclosure(L, &digestString, 1); // pmd
+static int digester_reset(lua_State *L) {
+    dgst_state *st = checkdigester(L);
+    if (dgst_reset(st) != 1)
+	luaL_error(L, "error while resetting message digest");
+    lua_settop(L, 1);
+    return 1;
+}
+
+// digester:digest(s) hashes s alone, discarding pending updates
+static int digester_digest(lua_State *L) {
+    dgst_state *st = checkdigester(L);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    dgst_reset(st);
+    dgst_update(st, data, len);
+    return dgst_final(L, st);
+}
+
+// digester:digest_many(list) returns the digest of each string in list
+static int digester_many(lua_State *L) {
+    dgst_state *st = checkdigester(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer i, N = luaL_len(L, 2);
+
+    dgst_reset(st);
+    lua_createtable(L, N, 0);
+    for (i = 1; i <= N; i++) {
+	size_t len;
+	lua_rawgeti(L, 2, i);
+	const char *data = lua_tolstring(L, -1, &len);
+	if (data == NULL)
+	    luaL_error(L, "string expected at position %d", (int)i);
+	dgst_update(st, data, len);
+	lua_pop(L, 1);
+	dgst_final(L, st);
+	lua_rawseti(L, -2, i);
+    }
+    return 1;
+}
+
+static int digester_size(lua_State *L) {
+    dgst_state *st = checkdigester(L);
+    lua_pushinteger(L, EVP_MD_size(st->md));
+    return 1;
+}
+
+static int digester_asstr(lua_State *L) {
+    dgst_state *st = checkdigester(L);
+    lua_pushfstring(L, "%s %s", st->macctx ? "HMAC" : "DIGEST", EVP_MD_name(st->md));
     return 1;
 }
 
 //////
 
 static int cleanUp(lua_State *L) {
-    EVP_MD **pmd = luaL_checkudata(L, 1, "caap.openssl.digest");
-    if (*pmd != NULL) {
-	EVP_cleanup();
-	*pmd = NULL;
-    }
+    dgst_state *st = (dgst_state *)lua_touserdata(L, 1);
+    if (st != NULL)
+	dgst_free(st);
     return 0;
 }
 
@@ -81,6 +216,7 @@ static int cleanUp(lua_State *L) {
 
 static const struct luaL_Reg dgst_funcs[] = {
     {"digest", getDigest},
+    {"digester", new_digester},
     {NULL, NULL}
 };
 
@@ -89,15 +225,37 @@ static const struct luaL_Reg dgst_meths[] = {
     {NULL, NULL}
 };
 
+static const struct luaL_Reg digester_meths[] = {
+    {"update", digester_update},
+    {"final", digester_final},
+    {"reset", digester_reset},
+    {"digest", digester_digest},
+    {"digest_many", digester_many},
+    {"size", digester_size},
+    {"__tostring", digester_asstr},
+    {"__gc", cleanUp},
+    {NULL, NULL}
+};
+
 int luaopen_ldgst (lua_State *L) {
+    // global state, once; never torn down while digesters may be alive
+    OpenSSL_add_all_digests();
+
     // DIGEST
     luaL_newmetatable(L, "caap.openssl.digest");
     lua_pushvalue(L, -1);
-    lua_setfield(L, -1, "__index");
+    lua_setfield(L, -2, "__index");
     luaL_setfuncs(L, dgst_meths, 0);
+    lua_pop(L, 1);
+
+    // DIGESTER
+    luaL_newmetatable(L, "caap.openssl.digester");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, digester_meths, 0);
+    lua_pop(L, 1);
 
     // create library
     luaL_newlib(L, dgst_funcs);
     return 1;
 }
-
@@ -6,6 +6,10 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "codec.h"
+
+#define checkstruct(L) (lints_struct *)luaL_checkudata(L, 1, "caap.ints.struct")
+
 ///////////////////////////////////
 static int get_uint16(lua_State *L) {
     const uint8_t *buff = (const uint8_t*)luaL_checkstring(L, 1);
@@ -15,11 +19,10 @@ static int get_uint16(lua_State *L) {
 
 static int put_uint16(lua_State *L) {
     uint16_t val = (uint16_t)luaL_checkinteger(L, 1);
-    uint8_t buff[3];
+    uint8_t buff[2];
     buff[0] = (uint8_t)((val >> 8) & 0xff);
     buff[1] = (uint8_t)(val & 0xff);
-    buff[2] = '\0';
-    lua_pushlstring(L, (const char*)buff, 3);
+    lua_pushlstring(L, (const char*)buff, 2);
     return 1;
 }
 
@@ -38,13 +41,12 @@ static int get_uint32(lua_State *L) {
 
 static int put_uint32(lua_State *L) {
     uint32_t val = (uint32_t)luaL_checknumber(L, 1);
-    uint8_t buff[5];
+    uint8_t buff[4];
     buff[0] = (uint8_t)((val >> 24) & 0xff);
     buff[1] = (uint8_t)((val >> 16) & 0xff);
     buff[2] = (uint8_t)((val >> 8) & 0xff);
     buff[3] = (uint8_t)(val & 0xff);
-    buff[4] = '\0';
-    lua_pushlstring(L, (const char*)buff, 5);
+    lua_pushlstring(L, (const char*)buff, 4);
     return 1;
 }
 
@@ -73,16 +75,50 @@ static int tohex(lua_State *L) {
     const char *y = luaL_checklstring(L, 1, &N);
 
     luaL_Buffer b;
-    luaL_buffinit(L, &b);
-    luaL_buffinitsize(L, &b, 2*N);
+    char *z = luaL_buffinitsize(L, &b, codec_hex_size(N));
+    luaL_pushresultsize(&b, codec_hex_encode((const uint8_t *)y, N, z));
+    return 1;
+}
 
-    int i; char xx[3];
-    for (i=0; i<N;) {
-	sprintf(xx, "%02x", (uint8_t)y[i++]);
-	luaL_addlstring(&b, xx, 2);
+static int fromhex(lua_State *L) {
+    size_t N;
+    const char *y = luaL_checklstring(L, 1, &N);
+
+    luaL_Buffer b;
+    uint8_t *z = (uint8_t *)luaL_buffinitsize(L, &b, codec_unhex_size(N));
+    ptrdiff_t M = codec_hex_decode(y, N, z);
+    if (M == -1) {
+	lua_pushnil(L);
+	lua_pushliteral(L, "ERROR: invalid hex string");
+	return 2;
     }
+    luaL_pushresultsize(&b, M);
+    return 1;
+}
 
-    luaL_pushresult(&b);
+static int str2b64(lua_State *L) {
+    size_t N;
+    const char *y = luaL_checklstring(L, 1, &N);
+
+    luaL_Buffer b;
+    char *z = luaL_buffinitsize(L, &b, codec_b64_size(N));
+    luaL_pushresultsize(&b, codec_b64_encode((const uint8_t *)y, N, z));
+    return 1;
+}
+
+static int b642str(lua_State *L) {
+    size_t N;
+    const char *y = luaL_checklstring(L, 1, &N);
+
+    luaL_Buffer b;
+    uint8_t *z = (uint8_t *)luaL_buffinitsize(L, &b, codec_unb64_size(N));
+    ptrdiff_t M = codec_b64_decode(y, N, z);
+    if (M == -1) {
+	lua_pushnil(L);
+	lua_pushliteral(L, "ERROR: invalid base64 string");
+	return 2;
+    }
+    luaL_pushresultsize(&b, M);
     return 1;
 }
 
@@ -98,6 +134,272 @@ static int str2hex(lua_State *L) {
     return 1;
 }
 
+//////
+// compiled struct formats, a subset of string.pack:
+//   < little endian, > big endian, = native (default)
+//   b/B i8/u8, h/H i16/u16, i/I[n] n-byte integer (default 4), l/L i64/u64
+//   j/J lua integer, f float, d/n double, cN fixed string, xN padding
+// fields have fixed sizes and no alignment
+
+enum field_types {FSIGNED, FUNSIGNED, FFLOAT, FDOUBLE, FSTRING, FPADDING};
+
+typedef struct lints_field {
+    uint8_t type, big;
+    uint32_t size, offset;
+} lints_field;
+
+typedef struct lints_struct {
+    int n; // fields, excluding padding
+    size_t size; // bytes per record
+    lints_field fields[];
+} lints_struct;
+
+static int is_big_endian(void) {
+    const uint16_t x = 1;
+    return *(const uint8_t *)&x == 0;
+}
+
+static uint32_t fmt_size(lua_State *L, const char **fmt, uint32_t df) {
+    if (**fmt < '0' || **fmt > '9')
+	return df;
+    uint32_t k = 0;
+    while (**fmt >= '0' && **fmt <= '9') {
+	k = 10*k + (*(*fmt)++ - '0');
+	if (k > (1 << 24))
+	    luaL_error(L, "size too large in format");
+    }
+    return k;
+}
+
+// fills fields if not NULL; returns number of fields, excluding padding
+static int parse_format(lua_State *L, const char *fmt, lints_field *fields, size_t *size) {
+    int n = 0, big = is_big_endian();
+    size_t ofs = 0;
+    lints_field f;
+    while (*fmt) {
+	char c = *fmt++;
+	f.big = big;
+	switch (c) {
+	    case ' ': case '!': continue;
+	    case '<': big = 0; continue;
+	    case '>': big = 1; continue;
+	    case '=': big = is_big_endian(); continue;
+	    case 'b': f.type = FSIGNED; f.size = 1; break;
+	    case 'B': f.type = FUNSIGNED; f.size = 1; break;
+	    case 'h': f.type = FSIGNED; f.size = 2; break;
+	    case 'H': f.type = FUNSIGNED; f.size = 2; break;
+	    case 'i': f.type = FSIGNED; f.size = fmt_size(L, &fmt, 4); break;
+	    case 'I': f.type = FUNSIGNED; f.size = fmt_size(L, &fmt, 4); break;
+	    case 'l': case 'j': f.type = FSIGNED; f.size = 8; break;
+	    case 'L': case 'J': f.type = FUNSIGNED; f.size = 8; break;
+	    case 'f': f.type = FFLOAT; f.size = 4; break;
+	    case 'd': case 'n': f.type = FDOUBLE; f.size = 8; break;
+	    case 'c': f.type = FSTRING; f.size = fmt_size(L, &fmt, 0); break;
+	    case 'x': f.type = FPADDING; f.size = fmt_size(L, &fmt, 1); break;
+	    default: luaL_error(L, "invalid format option '%c'", c);
+	}
+	if ((f.type == FSIGNED || f.type == FUNSIGNED) && (f.size < 1 || f.size > 8))
+	    luaL_error(L, "integer size (%d) out of limits [1,8]", (int)f.size);
+	if (f.type == FSTRING && f.size == 0)
+	    luaL_error(L, "missing size for format option 'c'");
+	f.offset = ofs;
+	ofs += f.size;
+	if (ofs > 0xffffffff)
+	    luaL_error(L, "format too large");
+	if (f.type == FPADDING)
+	    continue;
+	if (fields)
+	    fields[n] = f;
+	n++;
+    }
+    *size = ofs;
+    return n;
+}
+
+static uint64_t read_uint(const uint8_t *p, lints_field *f) {
+    uint64_t x = 0;
+    uint32_t i;
+    for (i = 0; i < f->size; i++)
+	x = (x << 8) | p[f->big ? i : f->size - 1 - i];
+    return x;
+}
+
+static void write_uint(uint8_t *p, lints_field *f, uint64_t x) {
+    uint32_t i;
+    for (i = 0; i < f->size; i++, x >>= 8)
+	p[f->big ? f->size - 1 - i : i] = (uint8_t)(x & 0xff);
+}
+
+static void push_field(lua_State *L, const uint8_t *rec, lints_field *f) {
+    const uint8_t *p = rec + f->offset;
+    uint64_t x;
+    switch (f->type) {
+	case FSIGNED:
+	    x = read_uint(p, f);
+	    if (f->size < 8 && (x >> (8*f->size - 1)))
+		x |= ~(uint64_t)0 << (8*f->size); // sign extension
+	    lua_pushinteger(L, (lua_Integer)x);
+	    break;
+	case FUNSIGNED:
+	    lua_pushinteger(L, (lua_Integer)read_uint(p, f));
+	    break;
+	case FFLOAT: {
+	    uint32_t u = (uint32_t)read_uint(p, f);
+	    float y;
+	    memcpy(&y, &u, 4);
+	    lua_pushnumber(L, y);
+	    break;
+	}
+	case FDOUBLE: {
+	    x = read_uint(p, f);
+	    double y;
+	    memcpy(&y, &x, 8);
+	    lua_pushnumber(L, y);
+	    break;
+	}
+	default:
+	    lua_pushlstring(L, (const char *)p, f->size);
+    }
+}
+
+static void check_field(lua_State *L, int k, uint8_t *rec, lints_field *f) {
+    uint8_t *p = rec + f->offset;
+    switch (f->type) {
+	case FSIGNED:
+	case FUNSIGNED:
+	    write_uint(p, f, (uint64_t)luaL_checkinteger(L, k));
+	    break;
+	case FFLOAT: {
+	    float y = (float)luaL_checknumber(L, k);
+	    uint32_t u;
+	    memcpy(&u, &y, 4);
+	    write_uint(p, f, u);
+	    break;
+	}
+	case FDOUBLE: {
+	    double y = luaL_checknumber(L, k);
+	    uint64_t x;
+	    memcpy(&x, &y, 8);
+	    write_uint(p, f, x);
+	    break;
+	}
+	default: {
+	    size_t len;
+	    const char *s = luaL_checklstring(L, k, &len);
+	    luaL_argcheck(L, len <= f->size, k, "string longer than given size");
+	    memcpy(p, s, len);
+	    memset(p + len, 0, f->size - len);
+	}
+    }
+}
+
+// lints.struct(fmt [, names]): names, one per field, key the records
+// returned by unpack_many
+static int new_struct(lua_State *L) {
+    const char *fmt = luaL_checkstring(L, 1);
+    size_t size;
+    int n = parse_format(L, fmt, NULL, &size);
+    if (!lua_isnoneornil(L, 2)) {
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luaL_argcheck(L, luaL_len(L, 2) == n, 2, "one name per field expected");
+    }
+
+    lints_struct *st = (lints_struct *)lua_newuserdata(L, sizeof(lints_struct) + n*sizeof(lints_field));
+    st->n = parse_format(L, fmt, st->fields, &st->size);
+    luaL_setmetatable(L, "caap.ints.struct");
+
+    if (lua_istable(L, 2)) {
+	lua_pushvalue(L, 2);
+	lua_setuservalue(L, -2);
+    }
+    return 1;
+}
+
+// struct:pack(...) one value per field
+static int struct_pack(lua_State *L) {
+    lints_struct *st = checkstruct(L);
+    luaL_Buffer b;
+    int i;
+
+    uint8_t *rec = (uint8_t *)luaL_buffinitsize(L, &b, st->size);
+    memset(rec, 0, st->size);
+    for (i = 0; i < st->n; i++)
+	check_field(L, i+2, rec, &st->fields[i]);
+
+    luaL_pushresultsize(&b, st->size);
+    return 1;
+}
+
+static size_t check_offset(lua_State *L, int k, size_t N) {
+    lua_Integer pos = luaL_optinteger(L, k, 1);
+    luaL_argcheck(L, pos >= 1 && (size_t)pos <= N + 1, k, "initial position out of string");
+    return pos - 1;
+}
+
+// struct:unpack(s [, pos]) returns the fields and the position after them
+static int struct_unpack(lua_State *L) {
+    lints_struct *st = checkstruct(L);
+    size_t N;
+    const uint8_t *s = (const uint8_t *)luaL_checklstring(L, 2, &N);
+    size_t M = check_offset(L, 3, N);
+    int i;
+
+    luaL_argcheck(L, N - M >= st->size, 2, "data string too short");
+    luaL_checkstack(L, st->n + 1, "too many results");
+    for (i = 0; i < st->n; i++)
+	push_field(L, s + M, &st->fields[i]);
+
+    lua_pushinteger(L, M + st->size + 1);
+    return st->n + 1;
+}
+
+// struct:unpack_many(s [, count [, pos]]) returns an array of records, as
+// many as fit if count is nil, and the position after the last one
+static int struct_unpack_many(lua_State *L) {
+    lints_struct *st = checkstruct(L);
+    size_t N;
+    const uint8_t *s = (const uint8_t *)luaL_checklstring(L, 2, &N);
+    size_t M = check_offset(L, 4, N);
+    size_t avail = st->size ? (N - M) / st->size : 0;
+    size_t count = luaL_optinteger(L, 3, avail);
+    size_t j;
+    int i;
+
+    luaL_argcheck(L, lua_tointeger(L, 3) >= 0 && count <= avail, 3, "data string too short");
+    lua_settop(L, 4);
+    int named = lua_getuservalue(L, 1) == LUA_TTABLE; // 5: names
+
+    lua_createtable(L, count, 0);
+    for (j = 0; j < count; j++, M += st->size) {
+	lua_createtable(L, named ? 0 : st->n, named ? st->n : 0);
+	for (i = 0; i < st->n; i++) {
+	    if (named)
+		lua_rawgeti(L, 5, i+1);
+	    push_field(L, s + M, &st->fields[i]);
+	    if (named)
+		lua_rawset(L, -3);
+	    else
+		lua_rawseti(L, -2, i+1);
+	}
+	lua_rawseti(L, -2, j+1);
+    }
+
+    lua_pushinteger(L, M + 1);
+    return 2;
+}
+
+static int struct_size(lua_State *L) {
+    lints_struct *st = checkstruct(L);
+    lua_pushinteger(L, st->size);
+    return 1;
+}
+
+static int struct_asstr(lua_State *L) {
+    lints_struct *st = checkstruct(L);
+    lua_pushfstring(L, "INTS struct (%d fields, %d bytes)", st->n, (int)st->size);
+    return 1;
+}
+
 ////////////////////////////////////////////
 
 static const struct luaL_Reg dgst_funcs[] = {
@@ -110,11 +412,34 @@ static const struct luaL_Reg dgst_funcs[] = {
     {"tob64",	tobase64},
     {"getB64",	frombase64},
     {"hex",	tohex},
+    {"unhex",	fromhex},
+    {"b64",	str2b64},
+    {"unb64",	b642str},
     {"phex",	str2hex},
+    {"struct",	new_struct},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg struct_meths[] = {
+    {"pack",	struct_pack},
+    {"unpack",	struct_unpack},
+    {"unpack_many", struct_unpack_many},
+    {"size",	struct_size},
+    {"__len",	struct_size},
+    {"__tostring", struct_asstr},
     {NULL, NULL}
 };
 
 int luaopen_lints (lua_State *L) {
+    codec_init();
+
+    // compiled struct formats
+    luaL_newmetatable(L, "caap.ints.struct");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, struct_meths, 0);
+    lua_pop(L, 1);
+
     // create library
     luaL_newlib(L, dgst_funcs);
     return 1;
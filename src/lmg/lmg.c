@@ -5,25 +5,44 @@
 #include <uuid.h>
 #include <netinet/in.h>
 #include <resolv.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <zlib.h>
+#ifdef LMG_ENABLE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "mpack_buffer.h"
 
 static struct mg_mgr *MGR, MMGR;
 
 static uuid_t *UUID, UID;
 
-#define checktimer(L) (struct mg_timer *)luaL_checkudata(L, 1, "caap.mg.timer")
+#define checktimer(L) (lmg_timer *)luaL_checkudata(L, 1, "caap.mg.timer")
 
-#define newtimer(L) (struct mg_timer *)lua_newuserdata(L, sizeof(struct mg_timer));\
+#define newtimer(L) (lmg_timer *)lua_newuserdata(L, sizeof(lmg_timer));\
     luaL_setmetatable(L, "caap.mg.timer");\
 
 #define checkconn(L) *(struct mg_connection **)luaL_checkudata(L, 1, "caap.mg.connection")
 
+#define checkreq(L) check_request(L)
+
 #define newconn(L) (struct mg_connection **)lua_newuserdata(L, sizeof(struct mg_connection *));\
     luaL_setmetatable(L, "caap.mg.connection");\
 
 typedef struct lmg_udata {
     lua_State *L;
-    uint8_t flags;
+    uint16_t flags;
     char uuid[25];
+    uint64_t t0; // microseconds, first byte of the pending request
+    int route; // route of the pending request, -1 if none
+    uint8_t accept; // encodings accepted by the peer, bit per encoding
+    void *zs; // deflate stream of a chunked response
+    struct lmg_sub *subs; // subscriptions of the connection
+    size_t pending; // of those, holding a coalesced frame
 } lmg_udata;
 
 static void init_uuid(lua_State *L) {
@@ -54,6 +73,15 @@ static void uuid_as_str(lua_State *L, char *uuid) {
 #define CA 8
 #define CERT 16
 #define CERTKEY 32
+#define METRICS 64
+#define OWNED 128
+#define REQUEST 256
+#define COMPRESS 512
+
+// slow-subscriber policies
+#define DROP 0
+#define COALESCE 1
+#define DISCONNECT 2
 
 // EVENTS
 //
@@ -176,7 +204,1158 @@ static void wrapper(lua_State *L, struct mg_connection *c, const char *uuid) {
     *pc = c;
 }
 
-static void set_tls_opts(struct mg_connection *c, uint8_t flags) {
+/*   ******************************   */
+//		REQUEST		      //
+
+// a single request userdatum is reused for every HTTP message; it points
+// into mongoose's recv buffer and is only valid during the callback
+
+static int REQ = LUA_NOREF;
+
+static struct mg_http_message *check_request(lua_State *L) {
+    struct mg_http_message *hm = *(struct mg_http_message **)luaL_checkudata(L, 1, "caap.mg.request");
+    if (hm == NULL)
+	luaL_error(L, "request is only valid within its callback");
+    return hm;
+}
+
+static void request_push(lua_State *L, struct mg_http_message *hm) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, REQ);
+    *(struct mg_http_message **)lua_touserdata(L, -1) = hm;
+}
+
+static void request_done(lua_State *L) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, REQ);
+    *(struct mg_http_message **)lua_touserdata(L, -1) = NULL;
+    lua_pop(L, 1);
+}
+
+static const char *find_bytes(const char *s, size_t n, const char *p, size_t m) {
+    const char *e = s + n;
+    while (m <= (size_t)(e - s)) {
+	const char *q = (const char *)memchr(s, p[0], e - s - m + 1);
+	if (q == NULL)
+	    return NULL;
+	if (memcmp(q, p, m) == 0)
+	    return q;
+	s = q + 1;
+    }
+    return NULL;
+}
+
+// push URL-decoded value, copying raw bytes if no decoding is needed
+static void push_decoded(lua_State *L, const char *p, size_t len) {
+    size_t i;
+    for (i = 0; i < len && p[i] != '%' && p[i] != '+'; i++);
+    if (i == len) {
+	lua_pushlstring(L, p, len);
+	return;
+    }
+    luaL_Buffer b;
+    char *dst = luaL_buffinitsize(L, &b, len+1);
+    int n = mg_url_decode(p, len, dst, len+1, 1);
+    luaL_pushresultsize(&b, n < 0 ? 0 : n);
+    if (n < 0) {
+	lua_pop(L, 1);
+	lua_pushnil(L);
+    }
+}
+
+// look up name in a sep-separated list of name=value pairs
+static int push_pair(lua_State *L, struct mg_str *buf, const char *name, size_t nlen, char sep, int decode) {
+    const char *p = buf->ptr, *e = buf->ptr + buf->len, *s;
+    while (p < e) {
+	while (p < e && (*p == ' ' || *p == sep))
+	    p++;
+	s = (const char *)memchr(p, sep, e - p);
+	if (s == NULL)
+	    s = e;
+	if ((size_t)(s - p) > nlen && p[nlen] == '=' && memcmp(p, name, nlen) == 0) {
+	    p += nlen + 1;
+	    if (decode)
+		push_decoded(L, p, s - p);
+	    else
+		lua_pushlstring(L, p, s - p);
+	    return 1;
+	}
+	p = s;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+static int req_method(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    lua_pushlstring(L, hm->method.ptr, hm->method.len);
+    return 1;
+}
+
+static int req_uri(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    lua_pushlstring(L, hm->uri.ptr, hm->uri.len);
+    return 1;
+}
+
+static int req_query(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    lua_pushlstring(L, hm->query.ptr, hm->query.len);
+    return 1;
+}
+
+static int req_proto(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    lua_pushlstring(L, hm->proto.ptr, hm->proto.len);
+    return 1;
+}
+
+static int req_body(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    lua_pushlstring(L, hm->body.ptr, hm->body.len);
+    return 1;
+}
+
+static int req_len(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    lua_pushinteger(L, hm->body.len);
+    return 1;
+}
+
+static int req_header(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    struct mg_str *v = mg_http_get_header(hm, luaL_checkstring(L, 2));
+    if (v == NULL)
+	lua_pushnil(L);
+    else
+	lua_pushlstring(L, v->ptr, v->len);
+    return 1;
+}
+
+static int next_header(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    lua_Integer i = lua_tointeger(L, lua_upvalueindex(1));
+    if (i >= MG_MAX_HTTP_HEADERS || hm->headers[i].name.len == 0)
+	return 0;
+    lua_pushinteger(L, i+1);
+    lua_replace(L, lua_upvalueindex(1));
+    lua_pushlstring(L, hm->headers[i].name.ptr, hm->headers[i].name.len);
+    lua_pushlstring(L, hm->headers[i].value.ptr, hm->headers[i].value.len);
+    return 2;
+}
+
+static int req_headers(lua_State *L) {
+    checkreq(L);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, next_header, 1); // iter (index)
+    lua_pushvalue(L, 1); // state
+    return 2;
+}
+
+static int req_var(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    size_t nlen;
+    const char *name = luaL_checklstring(L, 2, &nlen);
+    return push_pair(L, &hm->query, name, nlen, '&', 1);
+}
+
+static int req_form(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    size_t nlen;
+    const char *name = luaL_checklstring(L, 2, &nlen);
+    return push_pair(L, &hm->body, name, nlen, '&', 1);
+}
+
+static int req_cookie(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    size_t nlen;
+    const char *name = luaL_checklstring(L, 2, &nlen);
+    struct mg_str *v = mg_http_get_header(hm, "Cookie");
+    if (v == NULL) {
+	lua_pushnil(L);
+	return 1;
+    }
+    return push_pair(L, v, name, nlen, ';', 0);
+}
+
+// parameter of a header value, e.g. boundary in multipart/form-data; boundary=xyz
+static struct mg_str header_param(struct mg_str v, const char *name) {
+    struct mg_str r = MG_NULL_STR;
+    size_t n = strlen(name);
+    const char *p = find_bytes(v.ptr, v.len, name, n), *e = v.ptr + v.len;
+    if (p == NULL || p + n >= e || p[n] != '=')
+	return r;
+    p += n + 1;
+    if (p < e && *p == '"') {
+	p++;
+	const char *q = (const char *)memchr(p, '"', e - p);
+	r.ptr = p;
+	r.len = (q == NULL ? e : q) - p;
+    } else {
+	r.ptr = p;
+	while (p < e && *p != ';' && *p != ' ')
+	    p++;
+	r.len = p - r.ptr;
+    }
+    return r;
+}
+
+static int next_part(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    size_t ofs = lua_tointeger(L, lua_upvalueindex(1));
+    size_t blen;
+    const char *bnd = lua_tolstring(L, lua_upvalueindex(2), &blen); // \r\n--boundary
+    const char *b = hm->body.ptr, *e = b + hm->body.len;
+
+    // first boundary has no leading CRLF
+    const char *p = ofs == 0 ? find_bytes(b, e - b, bnd + 2, blen - 2) : b + ofs;
+    if (p == NULL)
+	return 0;
+    p += ofs == 0 ? blen - 2 : blen;
+    if (p + 2 > e || (p[0] == '-' && p[1] == '-')) // closing boundary
+	return 0;
+    p += 2; // CRLF
+
+    const char *h = find_bytes(p, e - p, "\r\n\r\n", 4);
+    if (h == NULL)
+	return 0;
+    const char *d = h + 4;
+    const char *q = find_bytes(d, e - d, bnd, blen);
+    if (q == NULL)
+	return 0;
+
+    lua_pushinteger(L, q - b);
+    lua_replace(L, lua_upvalueindex(1));
+
+    struct mg_str name = MG_NULL_STR, fname = MG_NULL_STR;
+    while (p < h) { // part headers
+	const char *eol = find_bytes(p, h - p + 2, "\r\n", 2);
+	struct mg_str line = mg_str_n(p, eol - p);
+	if (line.len > 20 && mg_ncasecmp(line.ptr, "Content-Disposition:", 20) == 0) {
+	    name = header_param(line, "name");
+	    fname = header_param(line, "filename");
+	}
+	p = eol + 2;
+    }
+
+    lua_pushlstring(L, name.ptr, name.len);
+    if (fname.ptr != NULL)
+	lua_pushlstring(L, fname.ptr, fname.len);
+    else
+	lua_pushboolean(L, 0);
+    lua_pushlstring(L, d, q - d);
+    return 3;
+}
+
+static int req_parts(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    struct mg_str *ct = mg_http_get_header(hm, "Content-Type");
+    struct mg_str bnd = MG_NULL_STR;
+    if (ct != NULL)
+	bnd = header_param(*ct, "boundary");
+    if (bnd.len == 0)
+	luaL_error(L, "request is not multipart");
+
+    lua_pushinteger(L, 0); // offset
+    lua_pushliteral(L, "\r\n--");
+    lua_pushlstring(L, bnd.ptr, bnd.len);
+    lua_concat(L, 2);
+    lua_pushcclosure(L, next_part, 2); // iter (offset, boundary)
+    lua_pushvalue(L, 1); // state
+    return 2;
+}
+
+// stream the body to a function in chunks, or to a file, without one big copy
+static int req_sink(lua_State *L) {
+    struct mg_http_message *hm = checkreq(L);
+    const char *b = hm->body.ptr;
+    size_t len = hm->body.len;
+
+    if (lua_type(L, 2) == LUA_TSTRING) {
+	const char *path = lua_tostring(L, 2);
+	FILE *f = fopen(path, "wb");
+	if (f == NULL || fwrite(b, 1, len, f) != len) {
+	    if (f != NULL)
+		fclose(f);
+	    lua_pushnil(L);
+	    lua_pushfstring(L, "error writing request body to %s", path);
+	    return 2;
+	}
+	fclose(f);
+    } else {
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	size_t size = luaL_optinteger(L, 3, 65536), k;
+	luaL_argcheck(L, size > 0, 3, "positive chunk size expected");
+	for (k = 0; k < len; k += size) {
+	    lua_pushvalue(L, 2);
+	    lua_pushlstring(L, b + k, len - k < size ? len - k : size);
+	    lua_call(L, 1, 0);
+	}
+    }
+
+    lua_pushinteger(L, len);
+    return 1;
+}
+
+static int req_asstr(lua_State *L) {
+    struct mg_http_message *hm = *(struct mg_http_message **)luaL_checkudata(L, 1, "caap.mg.request");
+    if (hm == NULL)
+	lua_pushliteral(L, "Mongoose Request (expired)");
+    else
+	lua_pushfstring(L, "Mongoose Request (%s)", hm->uri.ptr == NULL ? "" : lua_pushlstring(L, hm->uri.ptr, hm->uri.len));
+    return 1;
+}
+
+/*   ******************************   */
+//	      COMPRESSION	      //
+
+enum { ENC_NONE, ENC_DEFLATE, ENC_GZIP, ENC_BR };
+
+static const char *ENCODINGS[] = {"identity", "deflate", "gzip", "br"};
+
+static struct {
+    int level; // zlib level, brotli quality is capped at 11
+    size_t min; // smaller bodies go out as they are
+    size_t thread; // bodies this large are compressed on the helper thread, 0 never
+} ZOPTS = {6, 256, 0};
+
+// q-value of an Accept-Encoding entry, 1 if not given
+static double accept_q(const char *params, size_t len) {
+    const char *q = find_bytes(params, len, "q=", 2);
+    char num[16];
+    size_t n;
+    if (q == NULL)
+	return 1;
+    q += 2;
+    n = params + len - q;
+    if (n >= sizeof(num))
+	n = sizeof(num) - 1;
+    memcpy(num, q, n);
+    num[n] = '\0';
+    return strtod(num, NULL);
+}
+
+// bitmask of acceptable encodings from the Accept-Encoding header
+static uint8_t accept_encoding(struct mg_http_message *hm) {
+    struct mg_str *v = mg_http_get_header(hm, "Accept-Encoding");
+    struct mg_str k, q;
+    uint8_t mask = 0;
+    int i;
+    if (v == NULL)
+	return 0;
+    struct mg_str s = *v;
+    while (mg_next_comma_entry(&s, &k, &q)) {
+	k = mg_strstrip(k);
+	const char *semi = (const char *)memchr(k.ptr, ';', k.len);
+	struct mg_str name = mg_str_n(k.ptr, semi == NULL ? k.len : (size_t)(semi - k.ptr));
+	name = mg_strstrip(name);
+	if (semi != NULL && accept_q(semi, k.ptr + k.len - semi) <= 0)
+	    continue; // explicitly refused
+	for (i = ENC_DEFLATE; i <= ENC_BR; i++)
+	    if (name.len == strlen(ENCODINGS[i]) && mg_ncasecmp(name.ptr, ENCODINGS[i], name.len) == 0)
+		mask |= 1 << i;
+    }
+    return mask;
+}
+
+static int pick_encoding(uint8_t mask, int stream) {
+#ifdef LMG_ENABLE_BROTLI
+    if (!stream && (mask & (1 << ENC_BR)))
+	return ENC_BR;
+#endif
+    (void)stream;
+    if (mask & (1 << ENC_GZIP))
+	return ENC_GZIP;
+    if (mask & (1 << ENC_DEFLATE))
+	return ENC_DEFLATE;
+    return ENC_NONE;
+}
+
+// compress src into out; returns 0 on success
+static int zcompress(int enc, int level, const char *src, size_t len, struct mg_iobuf *out) {
+    mg_iobuf_init(out, 0);
+#ifdef LMG_ENABLE_BROTLI
+    if (enc == ENC_BR) {
+	size_t n = BrotliEncoderMaxCompressedSize(len);
+	mg_iobuf_resize(out, n);
+	if (out->buf == NULL || !BrotliEncoderCompress(level > 11 ? 11 : level, BROTLI_DEFAULT_WINDOW,
+		BROTLI_MODE_TEXT, len, (const uint8_t *)src, &n, out->buf)) {
+	    mg_iobuf_free(out);
+	    return -1;
+	}
+	out->len = n;
+	return 0;
+    }
+#endif
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, enc == ENC_GZIP ? 15+16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	return -1;
+    mg_iobuf_resize(out, deflateBound(&zs, len));
+    if (out->buf == NULL) {
+	deflateEnd(&zs);
+	return -1;
+    }
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = len;
+    zs.next_out = out->buf;
+    zs.avail_out = out->size;
+    int rc = deflate(&zs, Z_FINISH);
+    out->len = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+	mg_iobuf_free(out);
+	return -1;
+    }
+    return 0;
+}
+
+static void send_reply(struct mg_connection *c, int code, int enc, const char *etag, const void *body, size_t len) {
+    mg_printf(c, "HTTP/1.1 %d OK\r\n", code);
+    if (enc != ENC_NONE)
+	mg_printf(c, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", ENCODINGS[enc]);
+    if (etag != NULL)
+	mg_printf(c, "ETag: \"%s\"\r\n", etag);
+    mg_printf(c, "Content-Length: %lu\r\n\r\n", (unsigned long)len);
+    mg_send(c, body, len);
+}
+
+// compressed bodies keyed by ETag & encoding, CLOCK eviction
+
+#define ZCACHE 64
+
+typedef struct lmg_zentry {
+    char *etag;
+    int enc;
+    uint32_t hash;
+    int used;
+    struct mg_iobuf body;
+} lmg_zentry;
+
+static struct {
+    lmg_zentry entries[ZCACHE];
+    size_t hand;
+    size_t hits, misses;
+} ZCACHED;
+
+static uint32_t etag_hash(const char *etag, int enc) {
+    uint32_t h = 2166136261u ^ enc;
+    while (*etag)
+	h = (h ^ (uint8_t)*etag++) * 16777619u;
+    return h;
+}
+
+static lmg_zentry *zcache_get(const char *etag, int enc) {
+    uint32_t h = etag_hash(etag, enc);
+    size_t i;
+    for (i = 0; i < ZCACHE; i++) {
+	lmg_zentry *e = &ZCACHED.entries[i];
+	if (e->etag != NULL && e->hash == h && e->enc == enc && strcmp(e->etag, etag) == 0) {
+	    e->used = 1;
+	    ZCACHED.hits++;
+	    return e;
+	}
+    }
+    ZCACHED.misses++;
+    return NULL;
+}
+
+// takes ownership of body; replaces an entry with the same key
+static void zcache_put(const char *etag, int enc, struct mg_iobuf *body) {
+    uint32_t h = etag_hash(etag, enc);
+    lmg_zentry *e;
+    size_t i;
+    for (i = 0; i < ZCACHE; i++) {
+	e = &ZCACHED.entries[i];
+	if (e->etag != NULL && e->hash == h && e->enc == enc && strcmp(e->etag, etag) == 0) {
+	    mg_iobuf_free(&e->body);
+	    e->body = *body;
+	    e->used = 1;
+	    return;
+	}
+    }
+    for (;;) {
+	e = &ZCACHED.entries[ZCACHED.hand];
+	ZCACHED.hand = (ZCACHED.hand + 1) % ZCACHE;
+	if (!e->used)
+	    break;
+	e->used = 0;
+    }
+    free(e->etag);
+    mg_iobuf_free(&e->body);
+    e->etag = strdup(etag);
+    if (e->etag == NULL) {
+	mg_iobuf_free(body);
+	return;
+    }
+    e->enc = enc;
+    e->hash = h;
+    e->used = 1;
+    e->body = *body;
+}
+
+static void zcache_free(void) {
+    size_t i;
+    for (i = 0; i < ZCACHE; i++) {
+	free(ZCACHED.entries[i].etag);
+	ZCACHED.entries[i].etag = NULL;
+	mg_iobuf_free(&ZCACHED.entries[i].body);
+    }
+}
+
+// helper thread: compresses large bodies off the event loop; the reply is
+// sent from lmg.poll once done, if the connection is still around
+
+typedef struct lmg_zjob {
+    struct lmg_zjob *next;
+    unsigned long id; // connection id
+    int code, enc, level;
+    char *etag;
+    int failed;
+    struct mg_iobuf data; // body, then compressed body
+} lmg_zjob;
+
+static struct {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    pthread_t th;
+    int running;
+    lmg_zjob *todo, *done;
+} ZPOOL = {.mu = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER};
+
+static void *zworker(void *arg) {
+    pthread_mutex_lock(&ZPOOL.mu);
+    while (ZPOOL.running) {
+	if (ZPOOL.todo == NULL) {
+	    pthread_cond_wait(&ZPOOL.cv, &ZPOOL.mu);
+	    continue;
+	}
+	lmg_zjob *j = ZPOOL.todo;
+	ZPOOL.todo = j->next;
+	pthread_mutex_unlock(&ZPOOL.mu);
+
+	struct mg_iobuf out;
+	j->failed = zcompress(j->enc, j->level, (const char *)j->data.buf, j->data.len, &out);
+	if (!j->failed) {
+	    mg_iobuf_free(&j->data);
+	    j->data = out;
+	}
+
+	pthread_mutex_lock(&ZPOOL.mu);
+	j->next = ZPOOL.done;
+	ZPOOL.done = j;
+    }
+    pthread_mutex_unlock(&ZPOOL.mu);
+    (void)arg;
+    return NULL;
+}
+
+static int zjob_submit(lmg_zjob *j) {
+    pthread_mutex_lock(&ZPOOL.mu);
+    if (!ZPOOL.running) {
+	ZPOOL.running = 1;
+	if (pthread_create(&ZPOOL.th, NULL, zworker, NULL) != 0) {
+	    ZPOOL.running = 0;
+	    pthread_mutex_unlock(&ZPOOL.mu);
+	    return -1;
+	}
+    }
+    lmg_zjob **h = &ZPOOL.todo; // keep submission order
+    while (*h != NULL)
+	h = &(*h)->next;
+    j->next = NULL;
+    *h = j;
+    pthread_cond_signal(&ZPOOL.cv);
+    pthread_mutex_unlock(&ZPOOL.mu);
+    return 0;
+}
+
+static struct mg_connection *find_conn(unsigned long id) {
+    struct mg_connection *c;
+    for (c = MGR->conns; c != NULL; c = c->next)
+	if (c->id == id)
+	    return c;
+    return NULL;
+}
+
+static void zjob_free(lmg_zjob *j) {
+    free(j->etag);
+    mg_iobuf_free(&j->data);
+    free(j);
+}
+
+// send replies of finished jobs, in submission order
+static void zjob_drain(void) {
+    lmg_zjob *j, *list = NULL;
+    pthread_mutex_lock(&ZPOOL.mu);
+    while ((j = ZPOOL.done) != NULL) { // reverse
+	ZPOOL.done = j->next;
+	j->next = list;
+	list = j;
+    }
+    pthread_mutex_unlock(&ZPOOL.mu);
+
+    while ((j = list) != NULL) {
+	list = j->next;
+	struct mg_connection *c = find_conn(j->id);
+	int enc = j->failed ? ENC_NONE : j->enc;
+	if (c != NULL)
+	    send_reply(c, j->code, enc, j->etag, j->data.buf, j->data.len);
+	if (j->etag != NULL && !j->failed) {
+	    zcache_put(j->etag, j->enc, &j->data);
+	    mg_iobuf_init(&j->data, 0);
+	}
+	zjob_free(j);
+    }
+}
+
+static void zpool_stop(void) {
+    lmg_zjob *j;
+    pthread_mutex_lock(&ZPOOL.mu);
+    int running = ZPOOL.running;
+    ZPOOL.running = 0;
+    pthread_cond_signal(&ZPOOL.cv);
+    pthread_mutex_unlock(&ZPOOL.mu);
+    if (running)
+	pthread_join(ZPOOL.th, NULL);
+    while ((j = ZPOOL.todo) != NULL) {
+	ZPOOL.todo = j->next;
+	zjob_free(j);
+    }
+    while ((j = ZPOOL.done) != NULL) {
+	ZPOOL.done = j->next;
+	zjob_free(j);
+    }
+}
+
+static void zstream_free(lmg_udata *pu) {
+    if (pu->zs != NULL) {
+	deflateEnd((z_stream *)pu->zs);
+	free(pu->zs);
+	pu->zs = NULL;
+    }
+}
+
+/*   ******************************   */
+//		METRICS		      //
+
+#define NROUTES 64
+#define NBINS 16 // latency bins, upper bound 2^(i+6) microseconds
+#define ROUTE_SIZE 32
+
+typedef struct lmg_route {
+    char prefix[ROUTE_SIZE];
+    size_t len;
+    uint64_t requests;
+    uint64_t latency; // microseconds
+    uint64_t hist[NBINS];
+} lmg_route;
+
+static struct {
+    uint64_t started; // microseconds
+    uint64_t accepted;
+    uint64_t bytes_in, bytes_out;
+    size_t hwm; // iobuf high-water mark
+    size_t nroutes;
+    lmg_route routes[NROUTES]; // routes[0] collects overflow
+} STATS;
+
+static uint64_t usecs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void stats_reset(void) {
+    memset(&STATS, 0, sizeof(STATS));
+    STATS.started = usecs();
+    strcpy(STATS.routes[0].prefix, "*");
+    STATS.routes[0].len = 1;
+    STATS.nroutes = 1;
+}
+
+// route is the first segment of the URI, e.g. /api/items/3 -> /api
+static int stats_route(struct mg_str *uri) {
+    size_t len = 1, i;
+    while (len < uri->len && uri->ptr[len] != '/' && uri->ptr[len] != '?')
+	len++;
+    if (len >= ROUTE_SIZE)
+	return 0;
+    for (i = 1; i < STATS.nroutes; i++)
+	if (STATS.routes[i].len == len && memcmp(STATS.routes[i].prefix, uri->ptr, len) == 0)
+	    return i;
+    if (STATS.nroutes == NROUTES)
+	return 0;
+    lmg_route *r = &STATS.routes[STATS.nroutes];
+    memcpy(r->prefix, uri->ptr, len);
+    r->prefix[len] = '\0';
+    r->len = len;
+    return STATS.nroutes++;
+}
+
+static void stats_hwm(struct mg_connection *c) {
+    if (c->recv.size > STATS.hwm)
+	STATS.hwm = c->recv.size;
+    if (c->send.size > STATS.hwm)
+	STATS.hwm = c->send.size;
+}
+
+static void stats_done(lmg_udata *pu) {
+    lmg_route *r = &STATS.routes[pu->route];
+    uint64_t dt = usecs() - pu->t0;
+    int k = 0;
+    while (k < NBINS-1 && dt >= (1ULL << (k+6)))
+	k++;
+    r->requests++;
+    r->latency += dt;
+    r->hist[k]++;
+    pu->t0 = 0;
+    pu->route = -1;
+}
+
+static size_t stats_active(void) {
+    struct mg_connection *c;
+    size_t n = 0;
+    for (c = MGR->conns; c != NULL; c = c->next)
+	if (!c->is_listening)
+	    n++;
+    return n;
+}
+
+static void stats_event(struct mg_connection *c, int ev, void *ev_data, lmg_udata *pu) {
+    switch(ev) {
+	case MG_EV_ACCEPT:
+	    STATS.accepted++;
+	    break;
+	case MG_EV_READ:
+	    STATS.bytes_in += ((struct mg_str *)ev_data)->len;
+	    if (pu->t0 == 0 && c->is_accepted)
+		pu->t0 = usecs();
+	    stats_hwm(c);
+	    break;
+	case MG_EV_HTTP_MSG: // delivered before MG_EV_READ of the same chunk
+	    if (c->is_accepted) {
+		if (pu->t0 == 0)
+		    pu->t0 = usecs();
+		pu->route = stats_route(&((struct mg_http_message *)ev_data)->uri);
+	    }
+	    break;
+	case MG_EV_WRITE:
+	    STATS.bytes_out += *(int *)ev_data;
+	    if (c->send.len == 0 && pu->route >= 0)
+		stats_done(pu);
+	    break;
+	case MG_EV_POLL:
+	    stats_hwm(c);
+	    break;
+    }
+}
+
+static void stats_reply(struct mg_connection *c) {
+    struct mg_iobuf io;
+    char line[160];
+    size_t i;
+    int k;
+    uint64_t cnt;
+
+    mg_iobuf_init(&io, 0);
+#define EMIT(...) mg_iobuf_append(&io, line, snprintf(line, sizeof(line), __VA_ARGS__), MG_IO_SIZE)
+    EMIT("lmg_uptime_seconds %.3f\n", (usecs() - STATS.started) / 1e6);
+    EMIT("lmg_accepted_total %llu\n", (unsigned long long)STATS.accepted);
+    EMIT("lmg_active_connections %lu\n", (unsigned long)stats_active());
+    EMIT("lmg_bytes_in_total %llu\n", (unsigned long long)STATS.bytes_in);
+    EMIT("lmg_bytes_out_total %llu\n", (unsigned long long)STATS.bytes_out);
+    EMIT("lmg_iobuf_high_water_bytes %lu\n", (unsigned long)STATS.hwm);
+    for (i = 0; i < STATS.nroutes; i++) {
+	lmg_route *r = &STATS.routes[i];
+	if (r->requests == 0)
+	    continue;
+	EMIT("lmg_requests_total{route=\"%s\"} %llu\n", r->prefix, (unsigned long long)r->requests);
+	for (k = 0, cnt = 0; k < NBINS-1; k++) {
+	    cnt += r->hist[k];
+	    EMIT("lmg_request_latency_us_bucket{route=\"%s\",le=\"%llu\"} %llu\n", r->prefix, 1ULL << (k+6), (unsigned long long)cnt);
+	}
+	EMIT("lmg_request_latency_us_bucket{route=\"%s\",le=\"+Inf\"} %llu\n", r->prefix, (unsigned long long)r->requests);
+	EMIT("lmg_request_latency_us_sum{route=\"%s\"} %llu\n", r->prefix, (unsigned long long)r->latency);
+    }
+#undef EMIT
+
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n", (unsigned long)io.len);
+    mg_send(c, io.buf, io.len);
+    mg_iobuf_free(&io);
+}
+
+/*   ******************************   */
+//	      TIMING WHEEL	      //
+
+// hierarchical timing wheel: level 0 has 1 ms slots, each level above
+// covers the whole level below in one slot; timers cascade down as time
+// approaches their expiration. Insert, cancel & expire are O(1).
+
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 5
+
+typedef struct lmg_timer {
+    struct lmg_timer *next, *prev;
+    unsigned long expire; // milliseconds
+    int mills;
+    int repeat;
+    int ref; // registry reference while armed, keeps userdatum alive
+} lmg_timer;
+
+static struct {
+    lmg_timer slots[TW_LEVELS][TW_SIZE]; // list heads
+    lmg_timer expired; // list of timers due in the current poll
+    unsigned long now;
+    size_t count;
+} WHEEL;
+
+static int BATCH = LUA_NOREF; // handler for timers without function
+
+static void tw_unlink(lmg_timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = t;
+}
+
+static void tw_link(lmg_timer *head, lmg_timer *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void tw_insert(lmg_timer *t) {
+    unsigned long expire = t->expire > WHEEL.now ? t->expire : WHEEL.now + 1;
+    unsigned long delta = expire - WHEEL.now;
+    int level = 0;
+    while (level < TW_LEVELS-1 && delta >= (1UL << (TW_BITS*(level+1))))
+	level++;
+    if (level == TW_LEVELS-1 && delta >= (1UL << (TW_BITS*TW_LEVELS)))
+	expire = WHEEL.now + (1UL << (TW_BITS*TW_LEVELS)) - 1; // re-cascades
+    tw_link(&WHEEL.slots[level][(expire >> (TW_BITS*level)) & TW_MASK], t);
+}
+
+static void tw_cascade(int level) {
+    lmg_timer *head = &WHEEL.slots[level][(WHEEL.now >> (TW_BITS*level)) & TW_MASK];
+    while (head->next != head) {
+	lmg_timer *t = head->next;
+	tw_unlink(t);
+	if (t->expire <= WHEEL.now) // due now, don't push it a tick later
+	    tw_link(&WHEEL.expired, t);
+	else
+	    tw_insert(t);
+    }
+}
+
+static void tw_advance(unsigned long now) {
+    if (WHEEL.count == 0 || now < WHEEL.now) { // idle, or clock went back
+	WHEEL.now = now;
+	return;
+    }
+    while (WHEEL.now < now) {
+	WHEEL.now++;
+	int level;
+	for (level = 1; level < TW_LEVELS; level++) {
+	    if (WHEEL.now & ((1UL << (TW_BITS*level)) - 1))
+		break;
+	    tw_cascade(level);
+	}
+	lmg_timer *head = &WHEEL.slots[0][WHEEL.now & TW_MASK];
+	while (head->next != head) {
+	    lmg_timer *t = head->next;
+	    tw_unlink(t);
+	    tw_link(&WHEEL.expired, t);
+	}
+    }
+}
+
+static void tw_arm(lua_State *L, lmg_timer *t, int idx) {
+    tw_advance(mg_millis()); // WHEEL.now may lag behind when called from a handler
+    if (t->next != t)
+	tw_unlink(t);
+    else
+	WHEEL.count++;
+    if (t->ref == LUA_NOREF) {
+	lua_pushvalue(L, idx);
+	t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    t->expire = WHEEL.now + t->mills;
+    tw_insert(t);
+}
+
+static void tw_disarm(lua_State *L, lmg_timer *t) {
+    if (t->next != t) {
+	tw_unlink(t);
+	WHEEL.count--;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+    t->ref = LUA_NOREF;
+}
+
+static void tw_init(void) {
+    int i, j;
+    for (i = 0; i < TW_LEVELS; i++)
+	for (j = 0; j < TW_SIZE; j++)
+	    WHEEL.slots[i][j].next = WHEEL.slots[i][j].prev = &WHEEL.slots[i][j];
+    WHEEL.expired.next = WHEEL.expired.prev = &WHEEL.expired;
+    WHEEL.now = mg_millis();
+    WHEEL.count = 0;
+}
+
+// logs & pops the error left by a failed handler
+static void tw_error(lua_State *L, const char *who) {
+    const char *msg = lua_tostring(L, -1);
+    LOG(LL_ERROR, ("%s handler: %s", who, msg ? msg : "(error object is not a string)"));
+    lua_pop(L, 1);
+}
+
+// run the handler of every expired timer; timers without a handler function
+// are passed in a single call to the batch handler, as an array of their values
+static void tw_expire(lua_State *L) {
+    int N = lua_gettop(L);
+    int k = 0;
+    if (BATCH != LUA_NOREF)
+	lua_createtable(L, 16, 0); // N+1 batch
+    int top = lua_gettop(L);
+
+    while (WHEEL.expired.next != &WHEEL.expired) {
+	lmg_timer *t = WHEEL.expired.next;
+	tw_unlink(t);
+	WHEEL.count--;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, t->ref); // userdatum
+	if (t->repeat) {
+	    WHEEL.count++;
+	    t->expire += t->mills;
+	    if (t->expire <= WHEEL.now)
+		t->expire = WHEEL.now + t->mills;
+	    tw_insert(t);
+	} else {
+	    luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+	    t->ref = LUA_NOREF;
+	}
+
+	lua_getuservalue(L, -1); // handler or value
+	if (lua_type(L, -1) == LUA_TFUNCTION) {
+	    lua_insert(L, -2); // handler + userdatum
+	    if (lua_pcall(L, 1, 0, 0) != LUA_OK)
+		tw_error(L, "timer");
+	    lua_settop(L, top);
+	} else if (BATCH != LUA_NOREF) {
+	    lua_rawseti(L, N+1, ++k);
+	    lua_pop(L, 1);
+	} else
+	    lua_pop(L, 2);
+    }
+
+    if (k > 0) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, BATCH);
+	lua_pushvalue(L, N+1);
+	if (lua_pcall(L, 1, 0, 0) != LUA_OK)
+	    tw_error(L, "batch");
+    }
+    lua_settop(L, N);
+}
+
+/*   ******************************   */
+//		PUB / SUB	      //
+
+// a websocket frame, header + payload, framed once & shared by subscribers
+typedef struct lmg_frame {
+    size_t refs;
+    size_t hlen; // header length
+    size_t len; // header + payload length
+    unsigned char data[];
+} lmg_frame;
+
+// a subscription is listed both in its topic & in its connection, so that
+// publishing and closing each take time in their own number of entries
+typedef struct lmg_sub {
+    struct mg_connection *c;
+    struct lmg_topic *topic;
+    size_t k; // position in topic->subs
+    struct lmg_sub *next, **prev; // subscriptions of the same connection
+    uint8_t policy;
+    lmg_frame *pending; // latest frame held back from a slow subscriber
+} lmg_sub;
+
+typedef struct lmg_topic {
+    struct lmg_topic *next;
+    lmg_sub **subs;
+    size_t n, size;
+    size_t len;
+    char name[];
+} lmg_topic;
+
+#define NBUCKETS 64
+
+static lmg_topic *TOPICS[NBUCKETS];
+
+static size_t BACKLOG = 1 << 20; // queued bytes before a subscriber is slow
+
+#define conn_udata(c) ((lmg_udata *)(c)->fn_data)
+
+static uint32_t topic_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u; // FNV-1a
+    while (len--)
+	h = (h ^ (uint8_t)*s++) * 16777619u;
+    return h % NBUCKETS;
+}
+
+static lmg_topic *topic_find(const char *name, size_t len, int create) {
+    lmg_topic **h = &TOPICS[topic_hash(name, len)], *t;
+    for (t = *h; t != NULL; t = t->next)
+	if (t->len == len && memcmp(t->name, name, len) == 0)
+	    return t;
+    if (!create)
+	return NULL;
+    t = (lmg_topic *)calloc(1, sizeof(lmg_topic) + len + 1);
+    if (t == NULL)
+	return NULL;
+    memcpy(t->name, name, len);
+    t->len = len;
+    t->next = *h;
+    *h = t;
+    return t;
+}
+
+static void topic_free(lmg_topic *t) {
+    lmg_topic **h = &TOPICS[topic_hash(t->name, t->len)];
+    while (*h != t)
+	h = &(*h)->next;
+    *h = t->next;
+    free(t->subs);
+    free(t);
+}
+
+static lmg_frame *frame_new(const char *buf, size_t len, int op) {
+    unsigned char header[10];
+    size_t hlen;
+    header[0] = (uint8_t)(op | WEBSOCKET_FLAGS_MASK_FIN);
+    if (len < 126) {
+	header[1] = (unsigned char)len;
+	hlen = 2;
+    } else if (len < 65536) {
+	uint16_t tmp = mg_htons((uint16_t)len);
+	header[1] = 126;
+	memcpy(&header[2], &tmp, sizeof(tmp));
+	hlen = 4;
+    } else {
+	uint32_t tmp;
+	header[1] = 127;
+	tmp = mg_htonl((uint32_t)((uint64_t)len >> 32));
+	memcpy(&header[2], &tmp, sizeof(tmp));
+	tmp = mg_htonl((uint32_t)(len & 0xffffffff));
+	memcpy(&header[6], &tmp, sizeof(tmp));
+	hlen = 10;
+    }
+
+    lmg_frame *f = (lmg_frame *)malloc(sizeof(lmg_frame) + hlen + len);
+    if (f == NULL)
+	return NULL;
+    f->refs = 1;
+    f->hlen = hlen;
+    f->len = hlen + len;
+    memcpy(f->data, header, hlen);
+    memcpy(f->data + hlen, buf, len);
+    return f;
+}
+
+static void frame_unref(lmg_frame *f) {
+    if (f != NULL && --f->refs == 0)
+	free(f);
+}
+
+static void frame_write(struct mg_connection *c, lmg_frame *f) {
+    if (c->is_client) // clients must mask, so they cannot share the frame
+	mg_ws_send(c, (const char *)f->data + f->hlen, f->len - f->hlen, f->data[0] & WEBSOCKET_FLAGS_MASK_OP);
+    else
+	mg_send(c, f->data, f->len);
+}
+
+static void sub_hold(lmg_sub *s, lmg_frame *f) {
+    if (s->pending == NULL)
+	conn_udata(s->c)->pending++;
+    else
+	frame_unref(s->pending);
+    f->refs++;
+    s->pending = f;
+}
+
+static void sub_flush(lmg_sub *s) {
+    if (s->pending != NULL && s->c->send.len <= BACKLOG) {
+	frame_write(s->c, s->pending);
+	frame_unref(s->pending);
+	s->pending = NULL;
+	conn_udata(s->c)->pending--;
+    }
+}
+
+// returns 1 if the frame was queued or coalesced for the subscriber
+static int deliver(lmg_sub *s, lmg_frame *f) {
+    struct mg_connection *c = s->c;
+    if (c->is_closing || c->is_draining || !c->is_websocket)
+	return 0;
+
+    if (c->send.len > BACKLOG) {
+	switch(s->policy) {
+	    case COALESCE: sub_hold(s, f); return 1;
+	    case DISCONNECT: c->is_closing = 1; return 0;
+	    default: return 0; // DROP
+	}
+    }
+
+    sub_flush(s); // keep order, older coalesced frame goes first
+    if (s->pending != NULL)
+	sub_hold(s, f);
+    else
+	frame_write(c, f);
+    return 1;
+}
+
+// frees the subscription, and its topic once it has no other
+static void sub_remove(lmg_sub *s) {
+    lmg_topic *t = s->topic;
+    if (s->pending != NULL) {
+	frame_unref(s->pending);
+	conn_udata(s->c)->pending--;
+    }
+    t->subs[s->k] = t->subs[--t->n];
+    t->subs[s->k]->k = s->k;
+    *s->prev = s->next;
+    if (s->next != NULL)
+	s->next->prev = s->prev;
+    free(s);
+    if (t->n == 0)
+	topic_free(t);
+}
+
+static void flush_pending(struct mg_connection *c) {
+    lmg_udata *pu = conn_udata(c);
+    lmg_sub *s;
+    for (s = pu->subs; s != NULL && pu->pending > 0; s = s->next)
+	sub_flush(s);
+}
+
+static void unsubscribe_all(struct mg_connection *c) {
+    lmg_udata *pu = conn_udata(c);
+    while (pu->subs != NULL)
+	sub_remove(pu->subs);
+}
+
+static void free_topics(void) {
+    size_t i;
+    for (i = 0; i < NBUCKETS; i++)
+	while (TOPICS[i] != NULL) {
+	    lmg_topic *t = TOPICS[i];
+	    if (t->n == 0)
+		topic_free(t);
+	    else
+		sub_remove(t->subs[t->n - 1]);
+	}
+}
+
+static void set_tls_opts(struct mg_connection *c, uint16_t flags) {
     struct mg_tls_opts opts = {.ca = NULL, .cert = NULL, .certkey = NULL};
     if (flags & CA)
 	opts.ca = "/etc/ssl/ca.pem";
@@ -189,6 +1368,31 @@ static void set_tls_opts(struct mg_connection *c, uint8_t flags) {
 
 static void ev_handler(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
     lmg_udata *pu = (lmg_udata *)fn_data;
+
+    if (ev == MG_EV_ACCEPT) { // accepted connections get their own copy
+	lmg_udata *cu = (lmg_udata *)malloc(sizeof(lmg_udata));
+	if (cu == NULL) {
+	    c->is_closing = 1;
+	    return;
+	}
+	*cu = *pu;
+	cu->flags |= OWNED;
+	cu->subs = NULL;
+	cu->pending = 0;
+	c->fn_data = (void *)cu;
+	pu = cu;
+    }
+    stats_event(c, ev, ev_data, pu);
+
+    if (ev == MG_EV_HTTP_MSG && (pu->flags & METRICS) &&
+	    mg_vcmp(&((struct mg_http_message *)ev_data)->uri, "/metrics") == 0) {
+	stats_reply(c);
+	return;
+    }
+
+    if (ev == MG_EV_HTTP_MSG && (pu->flags & COMPRESS) && (pu->flags & OWNED))
+	pu->accept = accept_encoding((struct mg_http_message *)ev_data);
+
     lua_State *L = pu->L;
     int N = lua_gettop(L);
     struct mg_str *ss;
@@ -204,6 +1408,8 @@ static void ev_handler(struct mg_connection *c, int ev, void *ev_data, void *fn_
 	case MG_EV_HTTP_MSG:
 	    if (pu->flags & WEBSOCKET)
 		mg_ws_upgrade(c, (struct mg_http_message *)ev_data);
+	    else if (pu->flags & REQUEST)
+		request_push(L, (struct mg_http_message *)ev_data); // +1
 	    else
 		http_msg(L, (struct mg_http_message *)ev_data); // +4
 	    break;
@@ -231,6 +1437,17 @@ static void ev_handler(struct mg_connection *c, int ev, void *ev_data, void *fn_
     }
     lua_pcall(L, (lua_gettop(L)-N-1), 0, 0); // in case of ERROR XXX
     lua_settop(L, N);
+
+    if (ev == MG_EV_HTTP_MSG && (pu->flags & REQUEST))
+	request_done(L);
+
+    if (ev == MG_EV_CLOSE) {
+	unsubscribe_all(c);
+	zstream_free(pu);
+	if (pu->flags & OWNED)
+	    free(pu);
+    } else if (ev == MG_EV_WRITE && pu->pending > 0)
+	flush_pending(c);
 }
 
 /*   ******************************   */
@@ -238,13 +1455,19 @@ static void ev_handler(struct mg_connection *c, int ev, void *ev_data, void *fn_
 static int mgr_connect(lua_State *L) {
     const char *uri = luaL_checkstring(L, 1);
     luaL_checktype(L, 2, LUA_TFUNCTION);
-    const uint8_t flags = luaL_optinteger(L, 3, 0);
+    const uint16_t flags = luaL_optinteger(L, 3, 0);
 
     // CONNECTION METATABLE: push userdata, Lua state & function handler
     luaL_getmetatable(L, "caap.mg.connection"); // +1
     lmg_udata *pu = (lmg_udata *)lua_newuserdata(L, sizeof(lmg_udata)); // Lua state
     pu->L = L;
     pu->flags = 0;
+    pu->t0 = 0;
+    pu->route = -1;
+    pu->accept = 0;
+    pu->zs = NULL;
+    pu->subs = NULL;
+    pu->pending = 0;
     uuid_as_str(L, pu->uuid);
     lua_pushvalue(L, 2); // ev_function 4 handler
     lua_setuservalue(L, -2); // set as uservalue for userdatum
@@ -279,7 +1502,7 @@ static int mgr_connect(lua_State *L) {
 static int mgr_bind(lua_State *L) {
     const char *uri = luaL_checkstring(L, 1);
     luaL_checktype(L, 2, LUA_TFUNCTION);
-    uint8_t flags = luaL_optinteger(L, 3, 0);
+    uint16_t flags = luaL_optinteger(L, 3, 0);
 
     if (mg_url_is_ssl(uri))
 	flags |= SSL;
@@ -288,7 +1511,13 @@ static int mgr_bind(lua_State *L) {
     luaL_getmetatable(L, "caap.mg.connection");
     lmg_udata *pu = (lmg_udata *)lua_newuserdata(L, sizeof(lmg_udata)); // Lua state
     pu->L = L;
-    pu->flags = flags;
+    pu->flags = flags & ~OWNED;
+    pu->t0 = 0;
+    pu->route = -1;
+    pu->accept = 0;
+    pu->zs = NULL;
+    pu->subs = NULL;
+    pu->pending = 0;
     uuid_as_str(L, pu->uuid);
     lua_pushvalue(L, 2); // ev_function 4 handler
     lua_setuservalue(L, -2); // set as uservalue for userdatum
@@ -310,42 +1539,33 @@ static int mgr_bind(lua_State *L) {
 
 /*   ******************************   */
 
-static void timer_handler(void *data) {
-    lmg_udata *pu = (lmg_udata *)data;
-    lua_State *L = pu->L;
-    int N = lua_gettop(L);
-
-    luaL_getmetatable(L, "caap.mg.timer");
-    lua_getfield(L, -1, pu->uuid); // userdatum
-//    lua_rawgetp(L, -1, pu->uuid); // userdatum
-    lua_replace(L, -2); // replace metatable w userdatum
-    lua_getuservalue(L, -1); // handler +1
-    luaL_checktype(L, -1, LUA_TFUNCTION);
-    lua_replace(L, -2); // replace userdatum w handler
-
-    lua_pcall(L, (lua_gettop(L)-N-1), 0, 0); // in case of ERROR XXX
-    lua_settop(L, N);
-}
-
 static int mgr_timer(lua_State *L) {
     int mills = luaL_checkinteger(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
+    luaL_checkany(L, 2); // handler function, or value for the batch handler
     int flags = lua_toboolean(L, 3); // should be repeated?
+    luaL_argcheck(L, mills > 0, 1, "positive milliseconds expected");
+
+    lmg_timer *t = newtimer(L);
+    t->next = t->prev = t;
+    t->mills = mills;
+    t->repeat = flags;
+    t->ref = LUA_NOREF;
+    lua_pushvalue(L, 2);
+    lua_setuservalue(L, -2);
+    tw_arm(L, t, -1);
 
-    struct mg_timer *t = newtimer(L);
-    luaL_getmetatable(L, "caap.mg.timer");
-    lmg_udata *pu = (lmg_udata *)lua_newuserdata(L, sizeof(lmg_udata)); // Lua state
-    pu->L = L;
-    pu->flags = 0;
-    uuid_as_str(L, pu->uuid);
-    lua_pushvalue(L, 2); // timer_function 4 handler
-    lua_setuservalue(L, -2); // set as uservalue for userdatum
-    lua_setfield(L, -2, pu->uuid); // set data into metatable, key is uuid
-//    lua_rawsetp(L, -2, pu->uuid); // set data into metatable, key is uuid
-    lua_pop(L, 1); // pop metatable
-
-    mg_timer_init(t, mills, flags, timer_handler, (void *)pu);
+    return 1;
+}
 
+static int mgr_expired(lua_State *L) {
+    luaL_unref(L, LUA_REGISTRYINDEX, BATCH);
+    BATCH = LUA_NOREF;
+    if (!lua_isnoneornil(L, 1)) {
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_pushvalue(L, 1);
+	BATCH = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_pushboolean(L, 1);
     return 1;
 }
 
@@ -354,12 +1574,138 @@ static int mgr_timer(lua_State *L) {
 static int mgr_poll(lua_State *L) {
     int mills = luaL_checkinteger(L, 1);
     mg_mgr_poll(MGR, mills);
+    zjob_drain();
+    tw_advance(mg_millis());
+    tw_expire(L);
     lua_pushboolean(L, 1);
     return 1;
 }
 
 /*   ******************************   */
 
+static int mgr_publish(lua_State *L) {
+    size_t len, plen;
+    const char *topic = luaL_checklstring(L, 1, &len);
+    const char *msg = luaL_checklstring(L, 2, &plen);
+    int op = luaL_optinteger(L, 3, WEBSOCKET_OP_TEXT);
+
+    lmg_topic *t = topic_find(topic, len, 0);
+    if (t == NULL) {
+	lua_pushinteger(L, 0);
+	return 1;
+    }
+
+    lmg_frame *f = frame_new(msg, plen, op);
+    if (f == NULL)
+	luaL_error(L, "out of memory while framing message for topic %s", topic);
+
+    size_t k;
+    lua_Integer cnt = 0;
+    for (k = 0; k < t->n; k++)
+	cnt += deliver(t->subs[k], f);
+    frame_unref(f);
+
+    lua_pushinteger(L, cnt);
+    return 1;
+}
+
+static int mgr_backlog(lua_State *L) {
+    if (lua_gettop(L) > 0)
+	BACKLOG = luaL_checkinteger(L, 1);
+    lua_pushinteger(L, BACKLOG);
+    return 1;
+}
+
+static void push_field(lua_State *L, const char *k, lua_Number x) {
+    lua_pushnumber(L, x);
+    lua_setfield(L, -2, k);
+}
+
+static int mgr_metrics(lua_State *L) {
+    const int reset = lua_toboolean(L, 1);
+    const double uptime = (usecs() - STATS.started) / 1e6;
+    size_t i;
+    int k;
+
+    lua_newtable(L);
+    push_field(L, "uptime", uptime);
+    push_field(L, "accepted", STATS.accepted);
+    push_field(L, "accept_rate", uptime > 0 ? STATS.accepted / uptime : 0);
+    push_field(L, "active", stats_active());
+    push_field(L, "bytes_in", STATS.bytes_in);
+    push_field(L, "bytes_out", STATS.bytes_out);
+    push_field(L, "hwm", STATS.hwm);
+
+    lua_createtable(L, NBINS, 0); // upper bound of latency bins
+    for (k = 0; k < NBINS-1; k++) {
+	lua_pushinteger(L, 1LL << (k+6));
+	lua_rawseti(L, -2, k+1);
+    }
+    lua_pushnumber(L, HUGE_VAL);
+    lua_rawseti(L, -2, NBINS);
+    lua_setfield(L, -2, "bins");
+
+    lua_createtable(L, 0, STATS.nroutes);
+    for (i = 0; i < STATS.nroutes; i++) {
+	lmg_route *r = &STATS.routes[i];
+	if (r->requests == 0)
+	    continue;
+	lua_createtable(L, 0, 3);
+	push_field(L, "requests", r->requests);
+	push_field(L, "latency", r->latency);
+	lua_createtable(L, NBINS, 0);
+	for (k = 0; k < NBINS; k++) {
+	    lua_pushinteger(L, r->hist[k]);
+	    lua_rawseti(L, -2, k+1);
+	}
+	lua_setfield(L, -2, "histogram");
+	lua_setfield(L, -2, r->prefix);
+    }
+    lua_setfield(L, -2, "routes");
+
+    if (reset) {
+	lmg_route routes[NROUTES];
+	size_t n = STATS.nroutes;
+	memcpy(routes, STATS.routes, sizeof(routes));
+	stats_reset();
+	for (i = 1; i < n; i++) { // keep known routes, clear their counters
+	    memcpy(STATS.routes[i].prefix, routes[i].prefix, ROUTE_SIZE);
+	    STATS.routes[i].len = routes[i].len;
+	}
+	STATS.nroutes = n;
+    }
+
+    return 1;
+}
+
+static int mgr_compression(lua_State *L) {
+    if (lua_istable(L, 1)) {
+	// all validated before any is stored
+	lua_getfield(L, 1, "level");
+	lua_Integer level = luaL_optinteger(L, -1, ZOPTS.level);
+	lua_getfield(L, 1, "min");
+	lua_Integer min = luaL_optinteger(L, -1, ZOPTS.min);
+	lua_getfield(L, 1, "thread");
+	lua_Integer thread = luaL_optinteger(L, -1, ZOPTS.thread);
+	lua_pop(L, 3);
+	luaL_argcheck(L, level >= 0 && level <= 9, 1, "level between 0 and 9 expected");
+	luaL_argcheck(L, min >= 0, 1, "non-negative min expected");
+	luaL_argcheck(L, thread >= 0, 1, "non-negative thread expected");
+	ZOPTS.level = level;
+	ZOPTS.min = min;
+	ZOPTS.thread = thread;
+    }
+    lua_createtable(L, 0, 5);
+    push_field(L, "level", ZOPTS.level);
+    push_field(L, "min", ZOPTS.min);
+    push_field(L, "thread", ZOPTS.thread);
+    push_field(L, "hits", ZCACHED.hits);
+    push_field(L, "misses", ZCACHED.misses);
+    return 1;
+}
+
+/*   ******************************   */
+
 static int next_connection(lua_State *L) {
     const int cnt = lua_tointeger(L, 2); // counter
     struct mg_connection *c = *(struct mg_connection **)lua_touserdata(L, lua_upvalueindex(1)); // connection
@@ -395,6 +1741,9 @@ static int mgr_asstr(lua_State *L) {
 }
 
 static int mgr_gc(lua_State *L) {
+    zpool_stop();
+    zcache_free();
+    free_topics();
     if (MGR != NULL) {
 	mg_mgr_free(MGR);
 	MGR = NULL;
@@ -409,25 +1758,26 @@ static int timer_asstr(lua_State *L) {
     return 1;
 }
 
-static int timer_gc(lua_State *L) {
-    struct mg_timer *t = checktimer(L);
-    if (t != NULL)
-	t = NULL;
-    return 0;
+static int timer_reset(lua_State *L) {
+    lmg_timer *t = checktimer(L);
+    t->mills = luaL_optinteger(L, 2, t->mills);
+    luaL_argcheck(L, t->mills > 0, 2, "positive milliseconds expected");
+    tw_arm(L, t, 1);
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
 static int timer_free(lua_State *L) {
-    struct mg_timer *t = checktimer(L);
-    if (t != NULL) {
-	lmg_udata *pu = (lmg_udata *)t->arg;
-	luaL_getmetatable(L, "caap.mg.timer"); // +1
-	lua_pushnil(L);
-	lua_setfield(L, -2, pu->uuid);
-	lua_pop(L, 1); // -1
-	mg_timer_free(t);
-	t = NULL;
-    }
-    return 0;
+    lmg_timer *t = checktimer(L);
+    tw_disarm(L, t);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int timer_active(lua_State *L) {
+    lmg_timer *t = checktimer(L);
+    lua_pushboolean(L, t->ref != LUA_NOREF);
+    return 1;
 }
 
 /*   ******************************   */
@@ -500,20 +1850,136 @@ static int conn_http_reply(lua_State *L) {
     struct mg_connection *c = checkconn(L);
     const int code = luaL_checkinteger(L, 2);
     size_t len;
-    const char *msg = luaL_checklstring(L, 3, &len);
-    if (len > 0)  {
-	mg_http_reply(c, code, "%s", msg);
-    } else
-	mg_http_reply(c, code, NULL, NULL);
+    const char *msg = luaL_optlstring(L, 3, "", &len);
+    const char *etag = luaL_optstring(L, 4, NULL);
+    lmg_udata *pu = (lmg_udata *)c->fn_data;
+
+    int enc = ENC_NONE;
+    if ((pu->flags & COMPRESS) && len >= ZOPTS.min)
+	enc = pick_encoding(pu->accept, 0);
+
+    if (enc == ENC_NONE) {
+	send_reply(c, code, ENC_NONE, etag, msg, len);
+	lua_pushboolean(L, 1);
+	return 1;
+    }
+
+    lmg_zentry *e = etag == NULL ? NULL : zcache_get(etag, enc);
+    if (e != NULL) {
+	send_reply(c, code, enc, etag, e->body.buf, e->body.len);
+	lua_pushboolean(L, 1);
+	return 1;
+    }
+
+    if (ZOPTS.thread > 0 && len >= ZOPTS.thread) {
+	lmg_zjob *j = (lmg_zjob *)calloc(1, sizeof(lmg_zjob));
+	if (j != NULL) {
+	    j->id = c->id;
+	    j->code = code;
+	    j->enc = enc;
+	    j->level = ZOPTS.level;
+	    j->etag = etag == NULL ? NULL : strdup(etag);
+	    mg_iobuf_init(&j->data, 0);
+	    mg_iobuf_append(&j->data, msg, len, MG_IO_SIZE);
+	    if (j->data.len == len && (etag == NULL || j->etag != NULL) && zjob_submit(j) == 0) {
+		lua_pushboolean(L, 1);
+		return 1;
+	    }
+	    zjob_free(j);
+	}
+    }
+
+    struct mg_iobuf out;
+    if (zcompress(enc, ZOPTS.level, msg, len, &out) != 0) {
+	send_reply(c, code, ENC_NONE, etag, msg, len);
+    } else {
+	send_reply(c, code, enc, etag, out.buf, out.len);
+	if (etag != NULL)
+	    zcache_put(etag, enc, &out);
+	else
+	    mg_iobuf_free(&out);
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// start a chunked response; compressed if negotiated
+static int conn_http_head(lua_State *L) {
+    struct mg_connection *c = checkconn(L);
+    const int code = luaL_checkinteger(L, 2);
+    const char *headers = luaL_optstring(L, 3, "");
+    lmg_udata *pu = (lmg_udata *)c->fn_data;
+
+    int enc = ENC_NONE;
+    zstream_free(pu);
+    if (pu->flags & COMPRESS)
+	enc = pick_encoding(pu->accept, 1);
+    if (enc != ENC_NONE) {
+	z_stream *zs = (z_stream *)calloc(1, sizeof(z_stream));
+	if (zs == NULL || deflateInit2(zs, ZOPTS.level, Z_DEFLATED, enc == ENC_GZIP ? 15+16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	    free(zs);
+	    enc = ENC_NONE;
+	} else
+	    pu->zs = zs;
+    }
+
+    mg_printf(c, "HTTP/1.1 %d OK\r\n%sTransfer-Encoding: chunked\r\n", code, headers);
+    if (enc != ENC_NONE)
+	mg_printf(c, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", ENCODINGS[enc]);
+    mg_send(c, "\r\n", 2);
 
     lua_pushboolean(L, 1);
     return 1;
 }
 
+// send a chunk; an empty or missing chunk ends the response
+static int conn_http_chunk(lua_State *L) {
+    struct mg_connection *c = checkconn(L);
+    size_t len;
+    const char *msg = luaL_optlstring(L, 2, "", &len);
+    lmg_udata *pu = (lmg_udata *)c->fn_data;
+    z_stream *zs = (z_stream *)pu->zs;
+
+    if (zs == NULL) {
+	mg_http_write_chunk(c, msg, len);
+	lua_pushboolean(L, 1);
+	return 1;
+    }
+
+    unsigned char out[16384];
+    int flush = len == 0 ? Z_FINISH : Z_SYNC_FLUSH, rc;
+    zs->next_in = (Bytef *)msg;
+    zs->avail_in = len;
+    do {
+	zs->next_out = out;
+	zs->avail_out = sizeof(out);
+	rc = deflate(zs, flush);
+	if (rc == Z_STREAM_ERROR)
+	    break;
+	if (sizeof(out) - zs->avail_out > 0)
+	    mg_http_write_chunk(c, (const char *)out, sizeof(out) - zs->avail_out);
+    } while (zs->avail_out == 0);
+
+    if (len == 0) {
+	mg_http_write_chunk(c, "", 0);
+	zstream_free(pu);
+    }
+
+    lua_pushboolean(L, rc != Z_STREAM_ERROR);
+    return 1;
+}
+
 static int conn_send(lua_State *L) {
     struct mg_connection *c = checkconn(L);
     size_t len;
-    const char *msg = luaL_checklstring(L, 2, &len);
+    const char *msg;
+    mpack_buffer *b = (mpack_buffer *)luaL_testudata(L, 2, MPACK_BUFFER);
+    if (b != NULL) {
+	msg = b->data ? b->data : "";
+	len = b->len;
+    } else
+	msg = luaL_checklstring(L, 2, &len);
     int op = luaL_optinteger(L, 3, WEBSOCKET_OP_TEXT);
     if (c->is_websocket)
 	mg_ws_send(c, msg, len, op);
@@ -523,6 +1989,76 @@ static int conn_send(lua_State *L) {
     return 1;
 }
 
+static lmg_sub *sub_find(struct mg_connection *c, const char *topic, size_t len) {
+    lmg_sub *s;
+    for (s = conn_udata(c)->subs; s != NULL; s = s->next)
+	if (s->topic->len == len && memcmp(s->topic->name, topic, len) == 0)
+	    return s;
+    return NULL;
+}
+
+static int conn_subscribe(lua_State *L) {
+    struct mg_connection *c = checkconn(L);
+    size_t len;
+    const char *topic = luaL_checklstring(L, 2, &len);
+    const lua_Integer policy = luaL_optinteger(L, 3, DROP);
+    luaL_argcheck(L, policy == DROP || policy == COALESCE || policy == DISCONNECT, 3, "invalid policy");
+
+    lmg_sub *s = sub_find(c, topic, len);
+    if (s != NULL) { // already subscribed, update policy
+	s->policy = policy;
+	lua_pushboolean(L, 1);
+	return 1;
+    }
+
+    lmg_topic *t = topic_find(topic, len, 1);
+    if (t == NULL)
+	luaL_error(L, "out of memory while creating topic %s", topic);
+
+    if (t->n == t->size) {
+	size_t size = t->size ? 2*t->size : 8;
+	lmg_sub **subs = (lmg_sub **)realloc(t->subs, size*sizeof(lmg_sub *));
+	if (subs != NULL) {
+	    t->subs = subs;
+	    t->size = size;
+	}
+    }
+    s = t->n < t->size ? (lmg_sub *)malloc(sizeof(lmg_sub)) : NULL;
+    if (s == NULL) {
+	if (t->n == 0)
+	    topic_free(t);
+	luaL_error(L, "out of memory while subscribing to topic %s", topic);
+    }
+    s->c = c;
+    s->topic = t;
+    s->k = t->n;
+    s->policy = policy;
+    s->pending = NULL;
+    t->subs[t->n++] = s;
+    lmg_udata *pu = conn_udata(c);
+    s->next = pu->subs;
+    s->prev = &pu->subs;
+    if (pu->subs != NULL)
+	pu->subs->prev = &s->next;
+    pu->subs = s;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int conn_unsubscribe(lua_State *L) {
+    struct mg_connection *c = checkconn(L);
+    size_t len;
+    const char *topic = luaL_checklstring(L, 2, &len);
+
+    lmg_sub *s = sub_find(c, topic, len);
+    if (s != NULL)
+	sub_remove(s);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 static int conn_ip_address(lua_State *L) {
     struct mg_connection *c = checkconn(L);
     char ip[100];
@@ -590,6 +2126,13 @@ static void set_ws_ops(lua_State *L) {
     lua_pushinteger(L, CA); lua_setfield(L, -2, "ca");
     lua_pushinteger(L, CERT); lua_setfield(L, -2, "cert");
     lua_pushinteger(L, CERTKEY); lua_setfield(L, -2, "key");
+    lua_pushinteger(L, METRICS); lua_setfield(L, -2, "metrics");
+    lua_pushinteger(L, REQUEST); lua_setfield(L, -2, "request");
+    lua_pushinteger(L, COMPRESS); lua_setfield(L, -2, "compress");
+    // slow subscriber's policies
+    lua_pushinteger(L, DROP); lua_setfield(L, -2, "drop");
+    lua_pushinteger(L, COALESCE); lua_setfield(L, -2, "coalesce");
+    lua_pushinteger(L, DISCONNECT); lua_setfield(L, -2, "disconnect");
     //
     lua_setfield(L, -2, "ops");
 }
@@ -603,6 +2146,10 @@ static void mg_init(lua_State *L) {
     // initialize the Event Manager
     UUID = &UID;
     init_uuid(L);
+    // initialize the timing wheel
+    tw_init();
+    // initialize the metrics
+    stats_reset();
 }
 
 /*   ******************************   */
@@ -619,6 +2166,11 @@ static const struct luaL_Reg mg_funcs[] = {
     {"connect",	   mgr_connect},
     {"peers", 	   mgr_iterator},
     {"timer", 	   mgr_timer},
+    {"expired",	   mgr_expired},
+    {"metrics",	   mgr_metrics},
+    {"compression", mgr_compression},
+    {"publish",	   mgr_publish},
+    {"backlog",	   mgr_backlog},
     {NULL,	   NULL}
 };
 
@@ -626,8 +2178,9 @@ static const struct luaL_Reg mg_funcs[] = {
 
 static const struct luaL_Reg timer_meths[] = {
     {"__tostring",  timer_asstr},
-    {"__gc",	    timer_gc},
     {"remove",      timer_free},
+    {"reset",       timer_reset},
+    {"active",      timer_active},
     {NULL,	    NULL}
 };
 
@@ -635,13 +2188,35 @@ static const struct luaL_Reg timer_meths[] = {
 
 static const struct luaL_Reg conn_meths[] = {
     {"reply",	    conn_http_reply},
+    {"head",	    conn_http_head},
+    {"chunk",	    conn_http_chunk},
     {"send",	    conn_send},
+    {"subscribe",   conn_subscribe},
+    {"unsubscribe", conn_unsubscribe},
     {"ip", 	    conn_ip_address},
     {"__tostring",  conn_asstr},
     {"__gc",	    conn_gc},
     {NULL,	    NULL}
 };
 
+static const struct luaL_Reg req_meths[] = {
+    {"method",	    req_method},
+    {"uri",	    req_uri},
+    {"query",	    req_query},
+    {"proto",	    req_proto},
+    {"body",	    req_body},
+    {"header",	    req_header},
+    {"headers",	    req_headers},
+    {"var",	    req_var},
+    {"form",	    req_form},
+    {"cookie",	    req_cookie},
+    {"parts",	    req_parts},
+    {"sink",	    req_sink},
+    {"__len",	    req_len},
+    {"__tostring",  req_asstr},
+    {NULL,	    NULL}
+};
+
 /*   ******************************   */
 
 int luaopen_lmg (lua_State *L) {
@@ -656,6 +2231,16 @@ int luaopen_lmg (lua_State *L) {
     lua_setfield(L, -2, "__index");
     luaL_setfuncs(L, timer_meths, 0);
 
+    luaL_newmetatable(L, "caap.mg.request");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, req_meths, 0);
+
+    // the one request userdatum, reused by every HTTP message
+    *(struct mg_http_message **)lua_newuserdata(L, sizeof(struct mg_http_message *)) = NULL;
+    luaL_setmetatable(L, "caap.mg.request");
+    REQ = luaL_ref(L, LUA_REGISTRYINDEX);
+
     // initialize the Mongoose library
     mg_init(L);
 
@@ -0,0 +1,173 @@
+-- Encoding benchmark: lmpack vs carlos.json vs a raw length-prefixed
+-- baseline, over flat records, nested documents and numeric arrays.
+--
+-- usage: lua bench.lua [seconds-per-case]
+-- or:    make bench
+--
+-- For each case and codec it reports operations per second, MB/s of
+-- output, bytes produced and KB allocated per operation (GC stopped
+-- while timing, measured with collectgarbage'count').
+
+local mp = require'lmpack'
+
+local clock = os.clock
+local format = string.format
+local concat = table.concat
+local spack = string.pack
+local sunpack = string.unpack
+local mtype = math.type
+
+local SECS = tonumber(arg and arg[1]) or 0.5
+
+---------------------------------
+-- payloads
+---------------------------------
+
+local function record(i)
+    return {id=i, name='customer '..i, rfc='XAXX010101'..(i % 1000), active=(i % 2 == 0),
+	    balance=i * 1.25, items=i % 17, city='Ciudad de Mexico'}
+end
+
+local function records(N)
+    local ret = {}
+    for i=1,N do ret[i] = record(i) end
+    return ret
+end
+
+local function nested(depth, width)
+    if depth == 0 then return record(width) end
+    local ret = {level=depth, tag='node'..depth, children={}}
+    for i=1,width do ret.children[i] = nested(depth-1, width) end
+    return ret
+end
+
+local function numbers(N, float)
+    local ret = {}
+    for i=1,N do ret[i] = float and i / 3 or i * 7 end
+    return ret
+end
+
+local CASES = {
+    {'record',		record(1)},
+    {'records x100',	records(100)},
+    {'records x10000',	records(10000)},
+    {'nested 3x4',	nested(3, 4)},
+    {'nested 6x3',	nested(6, 3)},
+    {'ints x1000',	numbers(1000)},
+    {'floats x100000',	numbers(100000, true)},
+}
+
+---------------------------------
+-- raw length-prefixed baseline
+---------------------------------
+
+-- tag byte followed by the value; strings and tables are length-prefixed
+local function raw_encode(v, out)
+    local tt = type(v)
+    if tt == 'table' then
+	local n = 0
+	for _ in pairs(v) do n = n + 1 end
+	out[#out+1] = spack('<BI4', 5, n)
+	for k,x in pairs(v) do raw_encode(k, out); raw_encode(x, out) end
+    elseif tt == 'string' then out[#out+1] = spack('<Bs4', 4, v)
+    elseif mtype(v) == 'integer' then out[#out+1] = spack('<Bj', 2, v)
+    elseif tt == 'number' then out[#out+1] = spack('<Bn', 3, v)
+    elseif tt == 'boolean' then out[#out+1] = spack('<B', v and 1 or 0)
+    else out[#out+1] = spack('<B', 6) end
+    return out
+end
+
+local function raw_decode(s, pos)
+    local tag; tag, pos = sunpack('<B', s, pos)
+    if tag == 0 or tag == 1 then return tag == 1, pos
+    elseif tag == 2 then return sunpack('<j', s, pos)
+    elseif tag == 3 then return sunpack('<n', s, pos)
+    elseif tag == 4 then return sunpack('<s4', s, pos)
+    elseif tag == 5 then
+	local n, k, v; n, pos = sunpack('<I4', s, pos)
+	local ret = {}
+	for _=1,n do
+	    k, pos = raw_decode(s, pos)
+	    v, pos = raw_decode(s, pos)
+	    ret[k] = v
+	end
+	return ret, pos
+    end
+    return nil, pos
+end
+
+---------------------------------
+-- codecs
+---------------------------------
+
+local BUF = mp.buffer(4096)
+
+local CODECS = {
+    {'lmpack', mp.pack, function(s) return (mp.unpack(s)) end},
+    {'lmpack.buffer', function(v) return BUF:reset():pack(v) end, nil},
+    {'raw', function(v) return concat(raw_encode(v, {})) end, function(s) return (raw_decode(s, 1)) end},
+}
+
+-- carlos.json pulls in carlos.sqlite; it only encodes
+local ok, json = pcall(require, 'carlos.json')
+if ok then
+    CODECS[#CODECS+1] = {'json', json.asJSON, nil}
+else
+    io.stderr:write('carlos.json not available, skipping: ', tostring(json), '\n')
+end
+
+---------------------------------
+-- timing
+---------------------------------
+
+-- uncollected garbage allowed while timing, in KB
+local MAXGARBAGE = 1048576
+
+-- runs f(x) for about SECS seconds; returns ops/sec and KB allocated per op
+local function measure(f, x)
+    local n, batch = 0, 1
+    collectgarbage'collect'
+    collectgarbage'stop'
+    local kb0, t0 = collectgarbage'count', clock()
+    local t = t0
+    while t - t0 < SECS do
+	for _=1,batch do f(x) end
+	n = n + batch
+	t = clock()
+	-- size the next batch from the garbage per op so far, so that it
+	-- cannot run past MAXGARBAGE
+	local used = collectgarbage'count' - kb0
+	local left = MAXGARBAGE - used
+	if left <= 0 then break end
+	batch = batch * 2
+	if used > 0 then batch = math.min(batch, left * n // used) end
+	if batch < 1 then break end
+    end
+    local kb = collectgarbage'count' - kb0
+    collectgarbage'restart'
+    return n / (t - t0), kb / n
+end
+
+print(format('%-16s %-14s %8s %12s %10s %10s %12s %10s',
+	'case', 'codec', 'bytes', 'enc op/s', 'enc MB/s', 'enc KB/op', 'dec op/s', 'dec KB/op'))
+
+for _,case in ipairs(CASES) do
+    local name, v = case[1], case[2]
+    for _,codec in ipairs(CODECS) do
+	local cname, enc, dec = codec[1], codec[2], codec[3]
+	local ok, s = pcall(enc, v)
+	if ok then
+	    local bytes = #s -- buffers have __len
+	    local eops, ekb = measure(enc, v)
+	    local dops, dkb = '-', '-'
+	    if dec then
+		dops, dkb = measure(dec, s)
+		dops, dkb = format('%.0f', dops), format('%.2f', dkb)
+	    end
+	    print(format('%-16s %-14s %8d %12.0f %10.1f %10.2f %12s %10s',
+		name, cname, bytes, eops, eops * bytes / 1048576, ekb, dops, dkb))
+	else
+	    print(format('%-16s %-14s failed: %s', name, cname, tostring(s)))
+	end
+    end
+end
@@ -3,14 +3,68 @@
 
 #include <msgpack.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mpack_buffer.h"
+
+#define MAXDEPTH 32
+#define DEPTHLIMIT 256 // deeper encoding would risk overflowing the C stack
+
+#define EXTTYPES "caap.mpack.ext"
 
 ///////////////////////////////////
 
+// growable byte buffer, doubles its size as needed
+typedef mpack_buffer lmp_buffer;
+
+static lmp_buffer SCRATCH; // reused by every pack call
+
 int addlstring(void *data, const char* buf, size_t len) {
-    luaL_addlstring((luaL_Buffer *)data, buf, len);
+    lmp_buffer *b = (lmp_buffer *)data;
+    if (mpack_buffer_reserve(b, len) == -1)
+	return -1;
+    memcpy(b->data + b->len, buf, len);
+    b->len += len;
     return 0;
 }
 
+// lmpack.buffer userdata, see mpack_buffer.h
+#define BUFFER MPACK_BUFFER
+
+#define checkbuffer(L) (lmp_buffer *)luaL_checkudata(L, 1, BUFFER)
+#define testbuffer(L,k) (lmp_buffer *)luaL_testudata(L, k, BUFFER)
+
+///////////////////////////////////
+
+typedef struct lmp_state {
+    msgpack_packer pk; // writes to buf through pack_write
+    lmp_buffer *buf;
+    int failed; // a write ran out of memory, output is incomplete
+    int bin; // strings as bin instead of str
+    int depth; // maximum nesting
+    int seen; // stack index of tables being encoded, for cycle detection
+    int exts; // stack index of ext types, metatable -> type
+} lmp_state;
+
+static int pack_write(void *data, const char *buf, size_t len) {
+    lmp_state *st = (lmp_state *)data;
+    if (addlstring(st->buf, buf, len) == -1) {
+	st->failed = 1;
+	return -1;
+    }
+    return 0;
+}
+
+// raises if any write failed, so that truncated output is never used
+static void pack_done(lua_State *L, lmp_state *st) {
+    if (st->failed)
+	luaL_error(L, "msgpack: out of memory while packing");
+}
+
+static void encode(lua_State *L, int k, lmp_state *st, int depth);
+
 void addSimple(lua_State *L, int k, int tt, msgpack_packer *pk) {
 
     if (tt == LUA_TNIL)
@@ -49,78 +103,275 @@ void addSimple(lua_State *L, int k, int tt, msgpack_packer *pk) {
 
 }
 
-///////////////////////////////////
+// array if keys are exactly 1..#t, otherwise map; empty tables are maps
+static int is_array(lua_State *L, int k, size_t *N) {
+    size_t n = lua_rawlen(L, k), cnt = 0;
+    int arr = n > 0;
+    lua_pushnil(L);
+    while (lua_next(L, k) != 0) {
+	cnt++;
+	if (arr && !(lua_isinteger(L, -2) && lua_tointeger(L, -2) >= 1 && (size_t)lua_tointeger(L, -2) <= n))
+	    arr = 0;
+	lua_pop(L, 1);
+    }
+    *N = arr && cnt == n ? n : cnt;
+    return arr && cnt == n;
+}
 
-static int pack(lua_State *L) {
-    const int tt = lua_type(L, 1);
+static void encode_array(lua_State *L, int k, lmp_state *st, size_t N, int depth) {
+    size_t i;
+    msgpack_pack_array(&st->pk, N);
+    for (i = 1; i <= N; i++) {
+	lua_rawgeti(L, k, i);
+	encode(L, lua_gettop(L), st, depth);
+	lua_pop(L, 1);
+    }
+}
+
+static void encode_map(lua_State *L, int k, lmp_state *st, size_t N, int depth) {
+    msgpack_pack_map(&st->pk, N);
+    lua_pushnil(L);
+    while (lua_next(L, k) != 0) {
+	int top = lua_gettop(L);
+	encode(L, top-1, st, depth);
+	encode(L, top, st, depth);
+	lua_pop(L, 1);
+    }
+}
 
-    luaL_Buffer b;
-    luaL_buffinit(L, &b);
+static void encode_table(lua_State *L, int k, lmp_state *st, int depth) {
+    if (depth >= st->depth)
+	luaL_error(L, "msgpack: nesting deeper than %d levels", st->depth);
+    luaL_checkstack(L, 4, "msgpack: nesting too deep");
 
-    msgpack_packer pk;
-    msgpack_packer_init(&pk, (void *)&b, &addlstring);
+    lua_pushvalue(L, k);
+    if (lua_rawget(L, st->seen) != LUA_TNIL)
+	luaL_error(L, "msgpack: cycle detected while encoding table");
+    lua_pop(L, 1);
+    lua_pushvalue(L, k);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, st->seen);
 
-    addSimple(L, 1, tt, &pk);
+    size_t N;
+    if (is_array(L, k, &N))
+	encode_array(L, k, st, N, depth+1);
+    else
+	encode_map(L, k, st, N, depth+1);
 
-    luaL_pushresult(&b);
-    return 1;
+    lua_pushvalue(L, k);
+    lua_pushnil(L);
+    lua_rawset(L, st->seen);
 }
 
-static int pack_array(lua_State *L) {
-    luaL_checktype(L, 1, LUA_TTABLE);
-    lua_Integer N = luaL_len(L, 1);
-
-    luaL_Buffer b;
-    luaL_buffinit(L, &b);
+// registered userdata are ext types holding the userdatum's raw bytes
+static void encode_ext(lua_State *L, int k, lmp_state *st) {
+    if (!lua_getmetatable(L, k)) {
+	msgpack_pack_nil(&st->pk);
+	return;
+    }
+    if (lua_rawget(L, st->exts) != LUA_TNUMBER) {
+	lua_pop(L, 1);
+	msgpack_pack_nil(&st->pk);
+	return;
+    }
+    int8_t type = (int8_t)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    size_t len = lua_rawlen(L, k);
+    msgpack_pack_ext(&st->pk, len, type);
+    msgpack_pack_ext_body(&st->pk, lua_touserdata(L, k), len);
+}
 
-    msgpack_packer pk;
-    msgpack_packer_init(&pk, (void *)&b, &addlstring);
+static void encode(lua_State *L, int k, lmp_state *st, int depth) {
+    const int tt = lua_type(L, k);
+    switch(tt) {
+	case LUA_TTABLE: encode_table(L, k, st, depth); break;
+	case LUA_TUSERDATA: encode_ext(L, k, st); break;
+	case LUA_TSTRING:
+	    if (st->bin) {
+		size_t len;
+		const char *ss = lua_tolstring(L, k, &len);
+		msgpack_pack_bin(&st->pk, len);
+		msgpack_pack_bin_body(&st->pk, (const void *)ss, len);
+		break;
+	    } // else fall through
+	case LUA_TNIL:
+	case LUA_TBOOLEAN:
+	case LUA_TNUMBER: addSimple(L, k, tt, &st->pk); break;
+	default: msgpack_pack_nil(&st->pk); break; // functions, threads
+    }
+}
 
-    msgpack_pack_array(&pk, N);
-    int i;
-    for (i=1; i<N+1; i++) {
-	lua_rawgeti(L, 1, i);
-	addSimple(L, -1, lua_type(L, -1), &pk);
-	lua_pop(L, 1);
+// options: {bin=boolean, depth=integer}, depth at most DEPTHLIMIT; pushes
+// seen & ext tables; appends to buffer b, callers reset it if needed
+static void init_state(lua_State *L, int opts, lmp_state *st, lmp_buffer *b) {
+    st->bin = 0;
+    st->depth = MAXDEPTH;
+    if (opts > 0 && lua_istable(L, opts)) {
+	lua_getfield(L, opts, "bin");
+	st->bin = lua_toboolean(L, -1);
+	lua_getfield(L, opts, "depth");
+	lua_Integer depth = luaL_optinteger(L, -1, MAXDEPTH);
+	st->depth = depth < DEPTHLIMIT ? depth : DEPTHLIMIT;
+	lua_pop(L, 2);
     }
+    lua_newtable(L);
+    st->seen = lua_gettop(L);
+    luaL_getmetatable(L, EXTTYPES);
+    st->exts = lua_gettop(L);
+    st->buf = b;
+    st->failed = 0;
+    msgpack_packer_init(&st->pk, (void *)st, &pack_write);
+}
 
-    luaL_pushresult(&b);
+static int push_packed(lua_State *L, lmp_buffer *b) {
+    lua_pushlstring(L, b->data, b->len);
+    if (b->size > (1 << 20)) { // do not keep huge scratch buffers around
+	free(b->data);
+	b->data = NULL;
+	b->len = b->size = 0;
+    }
     return 1;
 }
 
-static int pack_table(lua_State *L) {
-    luaL_checktype(L, 1, LUA_TTABLE);
+///////////////////////////////////
 
-    luaL_Buffer b;
-    luaL_buffinit(L, &b);
+static int pack(lua_State *L) {
+    lmp_state st;
+    luaL_checkany(L, 1);
+    SCRATCH.len = 0;
+    init_state(L, 2, &st, &SCRATCH);
+    encode(L, 1, &st, 0);
+    pack_done(L, &st);
+    return push_packed(L, &SCRATCH);
+}
 
-    msgpack_packer pk;
-    msgpack_packer_init(&pk, (void *)&b, &addlstring);
+static int pack_array(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lmp_state st;
+    SCRATCH.len = 0;
+    init_state(L, 2, &st, &SCRATCH);
+    encode_array(L, 1, &st, luaL_len(L, 1), 1);
+    pack_done(L, &st);
+    return push_packed(L, &SCRATCH);
+}
 
-    int N = 0;
+static int pack_table(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lmp_state st;
+    SCRATCH.len = 0;
+    init_state(L, 2, &st, &SCRATCH);
+    size_t N = 0;
     lua_pushnil(L);
     while (lua_next(L, 1) != 0) {
-	if (lua_type(L, -2) == LUA_TSTRING)
-	    N++;
+	N++;
 	lua_pop(L, 1);
     }
+    encode_map(L, 1, &st, N, 1);
+    pack_done(L, &st);
+    return push_packed(L, &SCRATCH);
+}
 
-    msgpack_pack_map(&pk, N);
-    lua_pushnil(L);
-    while (lua_next(L, 1) != 0) {
-	if (lua_type(L, -2) == LUA_TSTRING) {
-	    addSimple(L, -2, LUA_TSTRING, &pk);
-	    addSimple(L, -1, lua_type(L, -1), &pk);
-	}
-	lua_pop(L, 1);
+///////////////////////////////////
+
+// lmpack.buffer([size]): growable buffer reused across messages
+static int new_buffer(lua_State *L) {
+    lua_Integer size = luaL_optinteger(L, 1, 0);
+    luaL_argcheck(L, size >= 0, 1, "non-negative size expected");
+    lmp_buffer *b = (lmp_buffer *)lua_newuserdata(L, sizeof(lmp_buffer));
+    b->data = NULL;
+    b->len = b->size = 0;
+    luaL_setmetatable(L, BUFFER);
+    if (mpack_buffer_reserve(b, size) == -1)
+	luaL_error(L, "out of memory while allocating buffer");
+    return 1;
+}
+
+static int buffer_reset(lua_State *L) {
+    lmp_buffer *b = checkbuffer(L);
+    b->len = 0;
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int pack_values(lua_State *L) {
+    lmp_buffer *b = (lmp_buffer *)lua_touserdata(L, 1);
+    int i, N = lua_gettop(L);
+    lmp_state st;
+    init_state(L, 0, &st, b);
+    for (i = 2; i <= N; i++)
+	encode(L, i, &st, 0);
+    pack_done(L, &st);
+    return 0;
+}
+
+// buffer:pack(...) appends each value; on error the buffer is left as it was
+static int buffer_pack(lua_State *L) {
+    lmp_buffer *b = checkbuffer(L);
+    size_t len = b->len;
+    lua_pushcfunction(L, pack_values);
+    lua_insert(L, 2);
+    lua_pushvalue(L, 1);
+    lua_insert(L, 3); // buffer, pack_values, buffer, values...
+    if (lua_pcall(L, lua_gettop(L) - 2, 0, 0) != LUA_OK) {
+	b->len = len;
+	return lua_error(L);
     }
+    return 1;
+}
+
+static int buffer_len(lua_State *L) {
+    lmp_buffer *b = checkbuffer(L);
+    lua_pushinteger(L, b->len);
+    return 1;
+}
+
+static int buffer_tostring(lua_State *L) {
+    lmp_buffer *b = checkbuffer(L);
+    lua_pushlstring(L, b->data ? b->data : "", b->len);
+    return 1;
+}
+
+static int buffer_gc(lua_State *L) {
+    lmp_buffer *b = checkbuffer(L);
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+    return 0;
+}
+
+static int buffer_asstr(lua_State *L) {
+    lmp_buffer *b = checkbuffer(L);
+    lua_pushfstring(L, "MSGPACK buffer (%d/%d bytes)", (int)b->len, (int)b->size);
+    return 1;
+}
 
-    luaL_pushresult(&b);
+// lmpack.ext(type, metatable_name): userdata with that metatable are
+// packed as ext type with their raw bytes
+static int ext_type(lua_State *L) {
+    lua_Integer type = luaL_checkinteger(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+    luaL_argcheck(L, type >= 0 && type <= 127, 1, "ext type between 0 and 127 expected");
+    luaL_getmetatable(L, EXTTYPES);
+    if (luaL_getmetatable(L, name) != LUA_TTABLE)
+	luaL_error(L, "unknown metatable %s", name);
+    lua_pushinteger(L, type);
+    lua_rawset(L, -3); // metatable -> type
+    lua_pushinteger(L, type);
+    lua_pushstring(L, name);
+    lua_rawset(L, -3); // type -> name, for unpacking
+    lua_pushboolean(L, 1);
     return 1;
 }
 
 //////
 
+#define checkunpacker(L) (lmp_unpacker *)luaL_checkudata(L, 1, "caap.mpack.unpacker")
+
+typedef struct lmp_unpacker {
+    msgpack_unpacker u;
+    msgpack_unpacked ans;
+} lmp_unpacker;
+
 void getSimple(lua_State *L, msgpack_object o) {
     switch(o.type) {
 	case MSGPACK_OBJECT_NIL: lua_pushnil(L); break;
@@ -130,56 +381,489 @@ void getSimple(lua_State *L, msgpack_object o) {
 	case MSGPACK_OBJECT_FLOAT32:
 	case MSGPACK_OBJECT_FLOAT64: lua_pushnumber(L, o.via.f64); break;
 	case MSGPACK_OBJECT_STR: lua_pushlstring(L, o.via.str.ptr, o.via.str.size); break;
-	default: break;
+	case MSGPACK_OBJECT_BIN: lua_pushlstring(L, o.via.bin.ptr, o.via.bin.size); break;
+	default: lua_pushnil(L); break;
+    }
+}
+
+// registered ext types become userdata again, unknown ones raw strings
+static void getExt(lua_State *L, msgpack_object o) {
+    luaL_getmetatable(L, EXTTYPES);
+    if (lua_rawgeti(L, -1, o.via.ext.type) == LUA_TSTRING) {
+	void *ud = lua_newuserdata(L, o.via.ext.size);
+	memcpy(ud, o.via.ext.ptr, o.via.ext.size);
+	luaL_setmetatable(L, lua_tostring(L, -2));
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+    } else {
+	lua_pop(L, 2);
+	lua_pushlstring(L, o.via.ext.ptr, o.via.ext.size);
+    }
+}
+
+static void getObject(lua_State *L, msgpack_object o) {
+    uint32_t i;
+    switch(o.type) {
+	case MSGPACK_OBJECT_ARRAY:
+	    luaL_checkstack(L, 3, "msgpack: nesting too deep");
+	    lua_createtable(L, o.via.array.size, 0);
+	    for (i = 0; i < o.via.array.size; i++) {
+		getObject(L, o.via.array.ptr[i]);
+		lua_rawseti(L, -2, i+1);
+	    }
+	    break;
+	case MSGPACK_OBJECT_MAP:
+	    luaL_checkstack(L, 3, "msgpack: nesting too deep");
+	    lua_createtable(L, 0, o.via.map.size);
+	    for (i = 0; i < o.via.map.size; i++) {
+		getObject(L, o.via.map.ptr[i].key);
+		if (lua_isnil(L, -1)) { // nil keys are not valid in Lua
+		    lua_pop(L, 1);
+		    continue;
+		}
+		getObject(L, o.via.map.ptr[i].val);
+		lua_rawset(L, -3);
+	    }
+	    break;
+	case MSGPACK_OBJECT_EXT: getExt(L, o); break;
+	default: getSimple(L, o); break;
     }
 }
 
+#define UNPACKED "caap.mpack.unpacked"
+
+// pushes a msgpack_unpacked whose zone __gc frees as well, so that nothing
+// leaks when converting its objects raises; destroying it early is fine
+static msgpack_unpacked *new_unpacked(lua_State *L) {
+    msgpack_unpacked *ans = (msgpack_unpacked *)lua_newuserdata(L, sizeof(msgpack_unpacked));
+    msgpack_unpacked_init( ans );
+    luaL_setmetatable(L, UNPACKED);
+    return ans;
+}
+
+static int unpacked_gc(lua_State *L) {
+    msgpack_unpacked_destroy( (msgpack_unpacked *)lua_touserdata(L, 1) );
+    return 0;
+}
+
+// unpack(msg [, pos]) -> object, position of the next object
 static int unpack(lua_State *L) {
     size_t N;
     const char *msg = luaL_checklstring(L, 1, &N);
+    size_t M = luaL_optinteger(L, 2, 1) - 1;
+    luaL_argcheck(L, M <= N, 2, "position out of range");
 
-    msgpack_unpacked ans;
+    msgpack_unpacked *ans = new_unpacked(L);
     msgpack_unpack_return q;
-    msgpack_unpacked_init( &ans );
 
+    q = msgpack_unpack_next(ans, msg, N, &M);
+
+    if (q == MSGPACK_UNPACK_PARSE_ERROR || q == MSGPACK_UNPACK_CONTINUE) {
+	msgpack_unpacked_destroy( ans );
+	lua_pushnil(L);
+	if (q == MSGPACK_UNPACK_CONTINUE)
+	    lua_pushliteral(L, "ERROR: msgpack unpack incomplete data.\n");
+	else
+	    lua_pushliteral(L, "ERROR: msgpack unpack parse error.\n");
+	return 2;
+    }
+
+    getObject(L, ans->data);
+    lua_pushinteger(L, M+1);
+
+    msgpack_unpacked_destroy( ans );
+    return 2;
+}
+
+// unpack_all(msg) -> array with every object in msg, count
+static int unpack_all(lua_State *L) {
+    size_t N;
+    const char *msg = luaL_checklstring(L, 1, &N);
     size_t M = 0;
-    q = msgpack_unpack_next(&ans, msg, N, &M);
+    lua_Integer k = 0;
+
+    msgpack_unpacked *ans = new_unpacked(L);
+    msgpack_unpack_return q;
+
+    lua_newtable(L);
+    while ((q = msgpack_unpack_next(ans, msg, N, &M)) == MSGPACK_UNPACK_SUCCESS) {
+	getObject(L, ans->data);
+	lua_rawseti(L, -2, ++k);
+    }
+    msgpack_unpacked_destroy( ans );
+
+    if (q == MSGPACK_UNPACK_PARSE_ERROR || (q == MSGPACK_UNPACK_CONTINUE && M < N)) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "ERROR: msgpack unpack error after %d objects.\n", (int)k);
+	return 2;
+    }
+
+    lua_pushinteger(L, k);
+    return 2;
+}
+
+//////
+
+static int new_unpacker(lua_State *L) {
+    size_t size = luaL_optinteger(L, 1, 8192);
+    lmp_unpacker *pu = (lmp_unpacker *)lua_newuserdata(L, sizeof(lmp_unpacker));
+    if (!msgpack_unpacker_init(&pu->u, size)) {
+	lua_pushnil(L);
+	lua_pushliteral(L, "ERROR: msgpack unpacker could not be created.\n");
+	return 2;
+    }
+    msgpack_unpacked_init( &pu->ans );
+    luaL_setmetatable(L, "caap.mpack.unpacker");
+    return 1;
+}
+
+static int unpacker_feed(lua_State *L) {
+    lmp_unpacker *pu = checkunpacker(L);
+    size_t N;
+    const char *chunk = luaL_checklstring(L, 2, &N);
+    if (!msgpack_unpacker_reserve_buffer(&pu->u, N))
+	luaL_error(L, "msgpack: out of memory while buffering %d bytes", (int)N);
+    memcpy(msgpack_unpacker_buffer(&pu->u), chunk, N);
+    msgpack_unpacker_buffer_consumed(&pu->u, N);
+    lua_settop(L, 1);
+    return 1;
+}
+
+// next complete object, or nothing if more data is needed
+static int unpacker_next(lua_State *L) {
+    lmp_unpacker *pu = checkunpacker(L);
+    msgpack_unpack_return q = msgpack_unpacker_next(&pu->u, &pu->ans);
+    switch(q) {
+	case MSGPACK_UNPACK_SUCCESS:
+	    getObject(L, pu->ans.data);
+	    return 1;
+	case MSGPACK_UNPACK_CONTINUE:
+	    return 0;
+	default:
+	    msgpack_unpacker_reset(&pu->u);
+	    lua_pushnil(L);
+	    lua_pushliteral(L, "ERROR: msgpack unpack parse error.\n");
+	    return 2;
+    }
+}
 
-    if (q == MSGPACK_UNPACK_PARSE_ERROR) {
+// feed chunk & return an array with every complete object
+static int unpacker_decode(lua_State *L) {
+    lmp_unpacker *pu = checkunpacker(L);
+    if (!lua_isnoneornil(L, 2))
+	unpacker_feed(L);
+    lua_Integer k = 0;
+    msgpack_unpack_return q;
+    lua_newtable(L);
+    while ((q = msgpack_unpacker_next(&pu->u, &pu->ans)) == MSGPACK_UNPACK_SUCCESS) {
+	getObject(L, pu->ans.data);
+	lua_rawseti(L, -2, ++k);
+    }
+    if (q != MSGPACK_UNPACK_CONTINUE) {
+	msgpack_unpacker_reset(&pu->u);
 	lua_pushnil(L);
 	lua_pushliteral(L, "ERROR: msgpack unpack parse error.\n");
 	return 2;
     }
+    return 1;
+}
 
-    msgpack_object o = ans.data;
-    if (o.type ==  MSGPACK_OBJECT_ARRAY) {
-	lua_newtable(L);
-	int k = 1;
-	if (o.via.array.size != 0) {
-	    msgpack_object *po = o.via.array.ptr;
-	    msgpack_object const *pend = po + o.via.array.size;
-	    for (; po < pend; ++po) {
-		getSimple(L, *po);
-		lua_rawseti(L, -2, k++);
+static int unpacker_iter(lua_State *L) {
+    lua_pushcfunction(L, unpacker_next);
+    lua_pushvalue(L, 1);
+    return 2;
+}
+
+static int unpacker_gc(lua_State *L) {
+    lmp_unpacker *pu = checkunpacker(L);
+    msgpack_unpacked_destroy( &pu->ans );
+    msgpack_unpacker_destroy( &pu->u );
+    return 0;
+}
+
+static int unpacker_asstr(lua_State *L) {
+    lua_pushliteral(L, "MSGPACK unpacker");
+    return 1;
+}
+
+//////
+
+#define checkschema(L) (lmp_schema *)luaL_checkudata(L, 1, "caap.mpack.schema")
+
+enum { H_ANY, H_I8, H_I16, H_I32, H_I64, H_U8, H_U16, H_U32, H_U64, H_F32, H_F64, H_STR, H_BIN };
+
+static const char *const HINTS[] = {"any", "i8", "i16", "i32", "i64", "u8", "u16", "u32", "u64", "f32", "f64", "str", "bin", NULL};
+
+typedef struct lmp_field {
+    uint8_t hint;
+    size_t klen; // name length
+    size_t kofs; // offset of the pre-encoded key in the key bytes
+    size_t kenc; // pre-encoded key length
+} lmp_field;
+
+// fields & pre-encoded keys are stored inline; key strings are kept in the
+// uservalue as an array so that lookups need no hashing of C strings
+typedef struct lmp_schema {
+    int n;
+    lmp_field fields[];
+} lmp_schema;
+
+#define schema_keys(sc) ((char *)&(sc)->fields[(sc)->n])
+
+// lmpack.schema{'clave', 'desc', 'precio1:f64', 'qty:u32', ...}
+static int new_schema(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    const int n = luaL_len(L, 1);
+    luaL_argcheck(L, n > 0, 1, "at least one field expected");
+    int i;
+
+    lmp_buffer keys = {NULL, 0, 0};
+    msgpack_packer pk;
+    msgpack_packer_init(&pk, (void *)&keys, &addlstring);
+
+    lua_createtable(L, n, 0); // key strings
+    lmp_field *fields = (lmp_field *)lua_newuserdata(L, n*sizeof(lmp_field)); // scratch
+    for (i = 0; i < n; i++) {
+	size_t len;
+	lua_rawgeti(L, 1, i+1);
+	const char *name = lua_tolstring(L, -1, &len);
+	if (name == NULL) {
+	    free(keys.data);
+	    luaL_error(L, "field %d: string expected", i+1);
+	}
+	const char *colon = memchr(name, ':', len);
+	int hint = H_ANY, j;
+	if (colon != NULL) {
+	    for (j = 0; HINTS[j] != NULL && strcmp(HINTS[j], colon+1) != 0; j++);
+	    if (HINTS[j] == NULL) {
+		free(keys.data);
+		luaL_error(L, "field %d: unknown type hint %s", i+1, colon+1);
 	    }
+	    hint = j;
+	    len = colon - name;
+	}
+	fields[i].hint = hint;
+	fields[i].klen = len;
+	fields[i].kofs = keys.len;
+	if (msgpack_pack_str(&pk, len) != 0 || msgpack_pack_str_body(&pk, name, len) != 0) {
+	    free(keys.data);
+	    luaL_error(L, "out of memory while creating schema");
 	}
-    } else if (o.type ==  MSGPACK_OBJECT_MAP) {
+	fields[i].kenc = keys.len - fields[i].kofs;
+	lua_pushlstring(L, name, len);
+	lua_rawseti(L, -4, i+1);
+	lua_pop(L, 1);
+    }
+
+    lmp_schema *sc = (lmp_schema *)lua_newuserdata(L, sizeof(lmp_schema) + n*sizeof(lmp_field) + keys.len);
+    sc->n = n;
+    memcpy(sc->fields, fields, n*sizeof(lmp_field));
+    memcpy(schema_keys(sc), keys.data, keys.len);
+    free(keys.data);
+    luaL_setmetatable(L, "caap.mpack.schema");
+    lua_pushvalue(L, -3);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+// whether x is representable under an integer hint
+static int hint_fits(int hint, lua_Integer x) {
+    switch(hint) {
+	case H_I8: return x >= INT8_MIN && x <= INT8_MAX;
+	case H_I16: return x >= INT16_MIN && x <= INT16_MAX;
+	case H_I32: return x >= INT32_MIN && x <= INT32_MAX;
+	case H_I64: return 1;
+	case H_U8: return x >= 0 && x <= UINT8_MAX;
+	case H_U16: return x >= 0 && x <= UINT16_MAX;
+	case H_U32: return x >= 0 && x <= (lua_Integer)UINT32_MAX;
+	default: return x >= 0;
+    }
+}
+
+static void schema_value(lua_State *L, lmp_field *f, lmp_state *st) {
+    msgpack_packer *pk = &st->pk;
+    const int tt = lua_type(L, -1);
+    if (tt == LUA_TNUMBER && f->hint >= H_I8 && f->hint <= H_U64 && lua_isinteger(L, -1)
+	    && hint_fits(f->hint, lua_tointeger(L, -1))) { // else the generic encoder
+	lua_Integer x = lua_tointeger(L, -1);
+	switch(f->hint) {
+	    case H_I8: msgpack_pack_int8(pk, x); return;
+	    case H_I16: msgpack_pack_int16(pk, x); return;
+	    case H_I32: msgpack_pack_int32(pk, x); return;
+	    case H_I64: msgpack_pack_int64(pk, x); return;
+	    case H_U8: msgpack_pack_uint8(pk, x); return;
+	    case H_U16: msgpack_pack_uint16(pk, x); return;
+	    case H_U32: msgpack_pack_uint32(pk, x); return;
+	    default: msgpack_pack_uint64(pk, x); return;
+	}
+    }
+    if (tt == LUA_TNUMBER && f->hint == H_F64) {
+	msgpack_pack_double(pk, lua_tonumber(L, -1));
+	return;
+    }
+    if (tt == LUA_TNUMBER && f->hint == H_F32) {
+	msgpack_pack_float(pk, (float)lua_tonumber(L, -1));
+	return;
+    }
+    if (tt == LUA_TSTRING && (f->hint == H_STR || f->hint == H_BIN)) {
+	size_t len;
+	const char *ss = lua_tolstring(L, -1, &len);
+	if (f->hint == H_STR) {
+	    msgpack_pack_str(pk, len);
+	    msgpack_pack_str_body(pk, (const void *)ss, len);
+	} else {
+	    msgpack_pack_bin(pk, len);
+	    msgpack_pack_bin_body(pk, (const void *)ss, len);
+	}
+	return;
+    }
+    if ((tt == LUA_TTABLE || tt == LUA_TUSERDATA) && st->seen == 0) {
 	lua_newtable(L);
-	if (o.via.array.size != 0) {
-	    msgpack_object_kv *po = o.via.map.ptr;
-	    msgpack_object_kv const *pend = po + o.via.map.size;
-	    for (; po < pend; ++po) {
-		getSimple(L, po->key);
-		getSimple(L, po->val);
-		lua_setfield(L, -3, lua_tostring(L, -2));
-		lua_pop(L, 1); // key
+	luaL_getmetatable(L, EXTTYPES);
+	lua_rotate(L, -3, -1); // seen, exts, value
+	st->seen = lua_gettop(L) - 2;
+	st->exts = lua_gettop(L) - 1;
+    }
+    encode(L, lua_gettop(L), st, 1);
+}
+
+// encodes table 2 with schema sc, at 1, appending to b; on error b is left
+// with a partial message
+static void schema_write(lua_State *L, lmp_schema *sc, lmp_buffer *b) {
+    lua_getuservalue(L, 1); // key strings
+    int keys = lua_gettop(L);
+    const char *kbytes = schema_keys(sc);
+    int i;
+
+    lmp_state st;
+    st.bin = 0;
+    st.depth = MAXDEPTH;
+    st.seen = st.exts = 0; // created on demand
+    st.buf = b;
+    st.failed = 0;
+    msgpack_packer_init(&st.pk, (void *)&st, &pack_write);
+
+    msgpack_pack_map(&st.pk, sc->n);
+    for (i = 0; i < sc->n; i++) {
+	lmp_field *f = &sc->fields[i];
+	pack_write(&st, kbytes + f->kofs, f->kenc);
+	lua_rawgeti(L, keys, i+1);
+	lua_rawget(L, 2);
+	schema_value(L, f, &st);
+	lua_pop(L, 1);
+    }
+    pack_done(L, &st);
+}
+
+// called protected with schema, t & buffer
+static int schema_pack(lua_State *L) {
+    schema_write(L, (lmp_schema *)lua_touserdata(L, 1), (lmp_buffer *)lua_touserdata(L, 3));
+    return 0;
+}
+
+// schema:encode(t [, buffer]) appends to buffer and returns it, otherwise
+// returns a string; on error the buffer is left as it was
+static int schema_encode(lua_State *L) {
+    lmp_schema *sc = checkschema(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lmp_buffer *b = testbuffer(L, 3);
+    lua_settop(L, 3);
+
+    if (b == NULL) {
+	SCRATCH.len = 0;
+	schema_write(L, sc, &SCRATCH);
+	return push_packed(L, &SCRATCH);
+    }
+
+    size_t len = b->len;
+    lua_pushcfunction(L, schema_pack);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
+	b->len = len;
+	return lua_error(L);
+    }
+    return 1;
+}
+
+// decode into a table preallocated with the schema's shape; fields are
+// expected in schema order, others are still accepted
+static int schema_decode(lua_State *L) {
+    lmp_schema *sc = checkschema(L);
+    size_t N;
+    const char *msg = luaL_checklstring(L, 2, &N);
+    size_t M = luaL_optinteger(L, 3, 1) - 1;
+    luaL_argcheck(L, M <= N, 3, "position out of range");
+    lua_settop(L, 3);
+    lua_getuservalue(L, 1); // 4: key strings
+
+    msgpack_unpacked *ans = new_unpacked(L);
+    if (msgpack_unpack_next(ans, msg, N, &M) != MSGPACK_UNPACK_SUCCESS || ans->data.type != MSGPACK_OBJECT_MAP) {
+	msgpack_unpacked_destroy( ans );
+	lua_pushnil(L);
+	lua_pushliteral(L, "ERROR: msgpack unpack, map expected.\n");
+	return 2;
+    }
+
+    msgpack_object_map *map = &ans->data.via.map;
+    lua_createtable(L, 0, sc->n);
+    uint32_t k;
+    int i = 0;
+    for (k = 0; k < map->size; k++) {
+	msgpack_object *key = &map->ptr[k].key;
+	if (key->type == MSGPACK_OBJECT_STR) {
+	    int j = i, found = 0;
+	    do { // expected position first, then the rest
+		lmp_field *f = &sc->fields[j];
+		if (f->klen == key->via.str.size && memcmp(schema_keys(sc) + f->kofs + f->kenc - f->klen, key->via.str.ptr, f->klen) == 0) {
+		    found = 1;
+		    break;
+		}
+		j = (j + 1) % sc->n;
+	    } while (j != i);
+	    if (found) {
+		lua_rawgeti(L, 4, j+1);
+		i = (j + 1) % sc->n;
+		getObject(L, map->ptr[k].val);
+		lua_rawset(L, -3);
+		continue;
 	    }
 	}
-    } else
-	getSimple(L, o);
+	getObject(L, *key);
+	if (lua_isnil(L, -1)) {
+	    lua_pop(L, 1);
+	    continue;
+	}
+	getObject(L, map->ptr[k].val);
+	lua_rawset(L, -3);
+    }
+    msgpack_unpacked_destroy( ans );
 
+    lua_pushinteger(L, M+1);
+    return 2;
+}
 
-    msgpack_unpacked_destroy( &ans );
+static int schema_fields(lua_State *L) {
+    lmp_schema *sc = checkschema(L);
+    int i;
+    lua_createtable(L, sc->n, 0);
+    lua_getuservalue(L, 1);
+    for (i = 0; i < sc->n; i++) {
+	lua_rawgeti(L, -1, i+1);
+	if (sc->fields[i].hint != H_ANY) {
+	    lua_pushfstring(L, "%s:%s", lua_tostring(L, -1), HINTS[sc->fields[i].hint]);
+	    lua_replace(L, -2);
+	}
+	lua_rawseti(L, -3, i+1);
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+static int schema_asstr(lua_State *L) {
+    lmp_schema *sc = checkschema(L);
+    lua_pushfstring(L, "MSGPACK schema (%d fields)", sc->n);
     return 1;
 }
 
@@ -190,10 +874,76 @@ static const struct luaL_Reg dgst_funcs[] = {
     {"array", 	pack_array},
     {"table",	pack_table},
     {"unpack",	unpack},
+    {"unpack_all", unpack_all},
+    {"unpacker", new_unpacker},
+    {"schema",	new_schema},
+    {"ext",	ext_type},
+    {"buffer",	new_buffer},
+    {NULL, 	NULL}
+};
+
+static const struct luaL_Reg buffer_meths[] = {
+    {"reset",	buffer_reset},
+    {"pack",	buffer_pack},
+    {"len",	buffer_len},
+    {"tostring", buffer_tostring},
+    {"__len",	buffer_len},
+    {"__gc",	buffer_gc},
+    {"__tostring", buffer_asstr},
+    {NULL, 	NULL}
+};
+
+static const struct luaL_Reg schema_meths[] = {
+    {"encode",	schema_encode},
+    {"decode",	schema_decode},
+    {"fields",	schema_fields},
+    {"__call",	schema_encode},
+    {"__tostring", schema_asstr},
+    {NULL, 	NULL}
+};
+
+static const struct luaL_Reg unpacker_meths[] = {
+    {"feed",	unpacker_feed},
+    {"next",	unpacker_next},
+    {"decode",	unpacker_decode},
+    {"objects",	unpacker_iter},
+    {"__gc",	unpacker_gc},
+    {"__tostring", unpacker_asstr},
     {NULL, 	NULL}
 };
 
 int luaopen_lmpack (lua_State *L) {
+    // registered ext types
+    luaL_newmetatable(L, EXTTYPES);
+    lua_pop(L, 1);
+
+    // streaming unpacker
+    luaL_newmetatable(L, "caap.mpack.unpacker");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, unpacker_meths, 0);
+    lua_pop(L, 1);
+
+    // results of unpack, unpack_all & schema:decode
+    luaL_newmetatable(L, UNPACKED);
+    lua_pushcfunction(L, unpacked_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // reusable buffers
+    luaL_newmetatable(L, BUFFER);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, buffer_meths, 0);
+    lua_pop(L, 1);
+
+    // compiled schemas
+    luaL_newmetatable(L, "caap.mpack.schema");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, schema_meths, 0);
+    lua_pop(L, 1);
+
     // create library
     luaL_newlib(L, dgst_funcs);
     return 1;
@@ -0,0 +1,37 @@
+#ifndef CAAP_MPACK_BUFFER_H
+#define CAAP_MPACK_BUFFER_H
+
+// lmpack.buffer userdata, shared by lmpack, lmg, lzmq & lsnap.
+//
+// Other modules read its bytes in place, or append to it, without creating
+// a Lua string. data is malloc'd & grown only by mpack_buffer_reserve, and
+// freed by the lmpack __gc, so every module must go through this header.
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#define MPACK_BUFFER "caap.mpack.buffer"
+
+typedef struct mpack_buffer {
+    char *data;
+    size_t len, size;
+} mpack_buffer;
+
+// room for len more bytes, doubling the size as needed; -1 if out of memory
+static inline int mpack_buffer_reserve(mpack_buffer *b, size_t len) {
+    if (len <= b->size - b->len)
+	return 0;
+    if (len > (size_t)-1 / 2 - b->len)
+	return -1;
+    size_t size = b->size ? b->size : 256;
+    while (size < b->len + len)
+	size *= 2;
+    char *data = (char *)realloc(b->data, size);
+    if (data == NULL)
+	return -1;
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+#endif
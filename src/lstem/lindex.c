@@ -0,0 +1,943 @@
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lstem.h"
+
+/* {=====================================================================
+ *    Inverted index
+ *
+ *    Documents are numbered internally from 1 in order of addition, so
+ *    postings only ever grow at the end: each is the delta to the previous
+ *    document followed by the term frequency, both as varints. Removing a
+ *    document marks it dead; compact() drops dead documents & renumbers.
+ * ======================================================================} */
+
+#define checkindex(L) (lindex *)luaL_checkudata(L, 1, "caap.stemmer.index")
+
+#define MAGIC "LSTMIDX1"
+#define NAMEBLOCK 65536
+
+typedef struct idx_term {
+    const char *name; // in a names block or the mapped file
+    uint32_t len, df; // df counts dead documents until compaction
+    uint32_t last; // last document in postings
+    uint32_t tf; // in the document being added
+    uint8_t *post;
+    size_t plen, psize; // psize 0: postings in the mapped file
+} idx_term;
+
+typedef struct idx_doc {
+    int64_t id;
+    uint32_t len; // number of terms
+    uint32_t alive;
+} idx_doc;
+
+typedef struct idx_id {
+    int64_t id;
+    uint32_t doc; // 0 if removed
+    uint32_t used;
+} idx_id;
+
+typedef struct idx_block {
+    struct idx_block *next;
+    size_t top;
+    char data[NAMEBLOCK];
+} idx_block;
+
+// file layout: header, documents, term records, names, postings
+typedef struct idx_header {
+    char magic[8];
+    uint32_t ndocs, nterms;
+    uint64_t total;
+    uint64_t docs_ofs, terms_ofs, names_ofs, post_ofs, size;
+} idx_header;
+
+typedef struct idx_record {
+    uint64_t name_ofs, post_ofs, post_len;
+    uint32_t name_len, df, last, pad;
+} idx_record;
+
+typedef struct idx_hit {
+    uint32_t doc;
+    float score;
+} idx_hit;
+
+typedef struct lindex {
+    lstem_stem *st; // NULL: terms are given, not text
+    stop_set stops;
+    lua_Integer min;
+
+    idx_term *terms;
+    uint32_t nterms, tsize;
+    uint32_t *tmap, tmask; // term hash, index+1 into terms
+    idx_term **sorted; // by name, for prefixes; stale if nsorted != nterms
+    uint32_t nsorted;
+
+    idx_doc *docs; // docs[0] unused
+    uint32_t ndocs, dsize, live;
+    uint64_t total; // terms in live documents
+    idx_id *ids; // external id -> document
+    uint32_t imask, nids;
+
+    idx_block *names;
+    void *map;
+    size_t maplen;
+
+    // terms of the document being added
+    uint32_t *touched, ntouched, tcap;
+    // query: for each word, its number of terms followed by their indices
+    uint32_t *query, qlen, qcap;
+    // per document scratch of a search, valid where stamp == epoch
+    float *score;
+    uint32_t *stamp, *group, *matched, *cand, epoch, ssize;
+    idx_hit *sel;
+} lindex;
+
+/* ================================================== */
+
+static size_t varint_put(uint8_t *p, uint64_t x) {
+    size_t n = 0;
+    while (x >= 0x80) {
+	p[n++] = (uint8_t)(x | 0x80);
+	x >>= 7;
+    }
+    p[n++] = (uint8_t)x;
+    return n;
+}
+
+static const uint8_t *varint_get(const uint8_t *p, const uint8_t *end, uint32_t *x) {
+    uint32_t v = 0;
+    int shift = 0;
+    while (p < end && shift < 35) {
+	uint8_t b = *p++;
+	v |= (uint32_t)(b & 0x7f) << shift;
+	if (!(b & 0x80)) {
+	    *x = v;
+	    return p;
+	}
+	shift += 7;
+    }
+    return NULL;
+}
+
+// room for n more uint32_t at *p; -1 out of memory
+static int u32_reserve(uint32_t **p, uint32_t *cap, uint32_t len, uint32_t n) {
+    if (len + n <= *cap)
+	return 0;
+    uint32_t N = *cap ? 2 * *cap : 64;
+    while (N < len + n)
+	N *= 2;
+    uint32_t *q = realloc(*p, N * sizeof(uint32_t));
+    if (q == NULL)
+	return -1;
+    *p = q;
+    *cap = N;
+    return 0;
+}
+
+static const char *name_copy(lindex *ix, const unsigned char *s, size_t len) {
+    if (ix->names == NULL || ix->names->top + len > NAMEBLOCK) {
+	idx_block *b = malloc(sizeof(idx_block));
+	if (b == NULL)
+	    return NULL;
+	b->next = ix->names;
+	b->top = 0;
+	ix->names = b;
+    }
+    char *p = ix->names->data + ix->names->top;
+    memcpy(p, s, len);
+    ix->names->top += len;
+    return p;
+}
+
+static int tmap_grow(lindex *ix) {
+    uint32_t N = ix->tmap ? 2*(ix->tmask + 1) : 1024, i;
+    uint32_t *tmap = calloc(N, sizeof(uint32_t));
+    if (tmap == NULL)
+	return -1;
+    for (i = 0; i < ix->nterms; i++) {
+	idx_term *t = &ix->terms[i];
+	uint32_t k = fnv1a((const unsigned char *)t->name, t->len) & (N - 1);
+	while (tmap[k])
+	    k = (k + 1) & (N - 1);
+	tmap[k] = i + 1;
+    }
+    free(ix->tmap);
+    ix->tmap = tmap;
+    ix->tmask = N - 1;
+    return 0;
+}
+
+// index of term s, or -1 if absent
+static int64_t term_find(lindex *ix, const unsigned char *s, size_t len) {
+    if (ix->tmap == NULL)
+	return -1;
+    uint32_t k = fnv1a(s, len) & ix->tmask, j;
+    while ((j = ix->tmap[k]) != 0) {
+	idx_term *t = &ix->terms[j-1];
+	if (t->len == len && !memcmp(t->name, s, len))
+	    return j - 1;
+	k = (k + 1) & ix->tmask;
+    }
+    return -1;
+}
+
+// adds a term known to be absent, named by name if given or else by a copy
+// of s; its index or -1 out of memory
+static int64_t term_new(lindex *ix, const unsigned char *s, size_t len, const char *name) {
+    if (len > UINT32_MAX)
+	return -1;
+    if ((ix->tmap == NULL || 2*(ix->nterms + 1) > ix->tmask + 1) && tmap_grow(ix) == -1)
+	return -1;
+    if (ix->nterms == ix->tsize) {
+	uint32_t N = ix->tsize ? 2*ix->tsize : 1024;
+	idx_term *terms = realloc(ix->terms, N * sizeof(idx_term));
+	if (terms == NULL)
+	    return -1;
+	ix->terms = terms;
+	ix->tsize = N;
+    }
+    idx_term *t = &ix->terms[ix->nterms];
+    memset(t, 0, sizeof(idx_term));
+    if ((t->name = name ? name : name_copy(ix, s, len)) == NULL)
+	return -1;
+    t->len = len;
+
+    uint32_t k = fnv1a(s, len) & ix->tmask;
+    while (ix->tmap[k])
+	k = (k + 1) & ix->tmask;
+    ix->tmap[k] = ++ix->nterms;
+    return ix->nterms - 1;
+}
+
+static int term_append(idx_term *t, uint32_t doc, uint32_t tf) {
+    if (t->plen + 10 > t->psize) {
+	size_t N = t->psize ? 2*t->psize : (t->plen < 16 ? 32 : 2*t->plen);
+	uint8_t *post = t->psize ? realloc(t->post, N) : malloc(N);
+	if (post == NULL)
+	    return -1;
+	if (t->psize == 0 && t->plen > 0) // copy on write from the mapped file
+	    memcpy(post, t->post, t->plen);
+	t->post = post;
+	t->psize = N;
+    }
+    t->plen += varint_put(t->post + t->plen, doc - t->last);
+    t->plen += varint_put(t->post + t->plen, tf);
+    t->last = doc;
+    t->df++;
+    return 0;
+}
+
+static idx_id *id_find(lindex *ix, int64_t id, int create) {
+    if (ix->ids != NULL) {
+	uint32_t k = fnv1a((const unsigned char *)&id, sizeof(id)) & ix->imask;
+	while (ix->ids[k].used) {
+	    if (ix->ids[k].id == id)
+		return &ix->ids[k];
+	    k = (k + 1) & ix->imask;
+	}
+    }
+    if (!create)
+	return NULL;
+
+    if (ix->ids == NULL || 2*(ix->nids + 1) > ix->imask + 1) {
+	uint32_t N = ix->ids ? 2*(ix->imask + 1) : 1024, i;
+	idx_id *ids = calloc(N, sizeof(idx_id));
+	if (ids == NULL)
+	    return NULL;
+	for (i = 0; ix->ids && i <= ix->imask; i++) {
+	    if (!ix->ids[i].used)
+		continue;
+	    uint32_t k = fnv1a((const unsigned char *)&ix->ids[i].id, sizeof(int64_t)) & (N - 1);
+	    while (ids[k].used)
+		k = (k + 1) & (N - 1);
+	    ids[k] = ix->ids[i];
+	}
+	free(ix->ids);
+	ix->ids = ids;
+	ix->imask = N - 1;
+    }
+    uint32_t k = fnv1a((const unsigned char *)&id, sizeof(id)) & ix->imask;
+    while (ix->ids[k].used)
+	k = (k + 1) & ix->imask;
+    ix->ids[k].id = id;
+    ix->ids[k].doc = 0;
+    ix->ids[k].used = 1;
+    ix->nids++;
+    return &ix->ids[k];
+}
+
+static int docs_reserve(lindex *ix, uint32_t n) {
+    if (n < ix->dsize)
+	return 0;
+    uint32_t N = ix->dsize ? 2*ix->dsize : 1024;
+    while (N <= n)
+	N *= 2;
+    idx_doc *docs = realloc(ix->docs, N * sizeof(idx_doc));
+    if (docs == NULL)
+	return -1;
+    ix->docs = docs;
+    ix->dsize = N;
+    return 0;
+}
+
+static void doc_remove(lindex *ix, idx_id *e) {
+    idx_doc *d = &ix->docs[e->doc];
+    d->alive = 0;
+    ix->total -= d->len;
+    ix->live--;
+    e->doc = 0;
+}
+
+// counts tf occurrences of term s in the document being added
+static int count_term(lindex *ix, const unsigned char *s, size_t len, uint32_t tf) {
+    int64_t j = term_find(ix, s, len);
+    if (j == -1 && (j = term_new(ix, s, len, NULL)) == -1)
+	return -1;
+    if (ix->terms[j].tf == 0) {
+	if (u32_reserve(&ix->touched, &ix->tcap, ix->ntouched, 1) == -1)
+	    return -1;
+	ix->touched[ix->ntouched++] = (uint32_t)j;
+    }
+    ix->terms[j].tf += tf;
+    return 0;
+}
+
+/* ================================================== */
+
+// lstem.index([stemmer [, opts]]): opts {stop=words, min=characters}
+int new_index(lua_State *L) {
+    lstem_stem *st = lua_isnoneornil(L, 1) ? NULL : checkstem(L, 1);
+    int freq;
+    lua_settop(L, 2);
+
+    lindex *ix = (lindex *)lua_newuserdata(L, sizeof(lindex)); // 3
+    memset(ix, 0, sizeof(lindex));
+    luaL_setmetatable(L, "caap.stemmer.index");
+    ix->st = st;
+
+    // anchors the stemmer & stop words
+    lua_createtable(L, 2, 0); // 4
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, 4, 1);
+    text_opts(L, 2, &freq, &ix->min); // 5
+    if (stop_build(L, 5, &ix->stops) == -1)
+	luaL_error(L, "Out-of-memory error creating index");
+    lua_rawseti(L, 4, 2);
+    lua_setuservalue(L, 3);
+
+    return 1;
+}
+
+// index:add(id, text) or index:add(id, terms), terms either an array of
+// terms or a table of term -> count; replaces a document with the same id
+// and returns its length in terms
+static int index_add(lua_State *L) {
+    lindex *ix = checkindex(L);
+    int64_t id = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, lua_type(L, 3) == LUA_TTABLE || (ix->st && lua_type(L, 3) == LUA_TSTRING), 3,
+	    ix->st ? "text or table of terms expected" : "table of terms expected");
+    lua_settop(L, 3);
+
+    idx_id *e = id_find(ix, id, 1);
+    if (e == NULL || docs_reserve(ix, ix->ndocs + 1) == -1)
+	luaL_error(L, "Out-of-memory error adding document");
+    if (e->doc)
+	doc_remove(ix, e);
+
+    int err = 0;
+    ix->ntouched = 0;
+    if (lua_type(L, 3) == LUA_TSTRING) {
+	size_t len, pos = 0, k, chars;
+	const char *s = lua_tolstring(L, 3, &len);
+	unsigned char tok[MAXTOKEN + 4];
+	while (!err && (k = next_token(ix->st->enc, s, len, &pos, tok, &chars)) > 0) {
+	    if ((lua_Integer)chars < ix->min || stop_has(&ix->stops, tok, k))
+		continue;
+	    int m;
+	    const sb_symbol *stem = stem_word(ix->st, tok, (int)k, &m);
+	    err = stem == NULL || count_term(ix, stem, m, 1) == -1;
+	}
+    } else {
+	lua_pushnil(L);
+	while (lua_next(L, 3) != 0) {
+	    size_t len;
+	    if (!err && lua_type(L, -2) == LUA_TSTRING && lua_isinteger(L, -1) && lua_tointeger(L, -1) > 0) {
+		const char *s = lua_tolstring(L, -2, &len);
+		err = count_term(ix, (const unsigned char *)s, len, (uint32_t)lua_tointeger(L, -1)) == -1;
+	    } else if (!err && lua_type(L, -1) == LUA_TSTRING) {
+		const char *s = lua_tolstring(L, -1, &len);
+		err = count_term(ix, (const unsigned char *)s, len, 1) == -1;
+	    }
+	    lua_pop(L, 1);
+	}
+    }
+
+    uint32_t doc = ++ix->ndocs, dl = 0, i;
+    for (i = 0; i < ix->ntouched; i++) {
+	idx_term *t = &ix->terms[ix->touched[i]];
+	if (!err)
+	    err = term_append(t, doc, t->tf) == -1;
+	dl += t->tf;
+	t->tf = 0;
+    }
+    // on failure the postings appended so far belong to a dead document
+    ix->docs[doc].id = id;
+    ix->docs[doc].len = dl;
+    ix->docs[doc].alive = !err;
+    if (err)
+	luaL_error(L, "Out-of-memory error adding document");
+    ix->total += dl;
+    ix->live++;
+    e->doc = doc;
+
+    lua_pushinteger(L, dl);
+    return 1;
+}
+
+// index:remove(id) returns whether the document was in the index
+static int index_remove(lua_State *L) {
+    lindex *ix = checkindex(L);
+    int64_t id = luaL_checkinteger(L, 2);
+    idx_id *e = id_find(ix, id, 0);
+    int found = e != NULL && e->doc != 0;
+    if (found)
+	doc_remove(ix, e);
+    lua_pushboolean(L, found);
+    return 1;
+}
+
+// drops dead documents, renumbering the rest; -1 out of memory
+static int compact(lindex *ix) {
+    uint32_t *remap = malloc((ix->ndocs + 1) * sizeof(uint32_t));
+    uint32_t i, n = 0;
+    if (remap == NULL)
+	return -1;
+    remap[0] = 0;
+    for (i = 1; i <= ix->ndocs; i++) {
+	remap[i] = ix->docs[i].alive ? ++n : 0;
+	if (remap[i])
+	    ix->docs[n] = ix->docs[i];
+    }
+
+    for (i = 0; i < ix->nterms; i++) {
+	idx_term *t = &ix->terms[i];
+	const uint8_t *p = t->post, *end = t->post + t->plen;
+	uint8_t *out = malloc(t->plen + 1); // renumbered deltas never grow
+	size_t len = 0;
+	uint32_t doc = 0, last = 0, df = 0, d, tf;
+	if (out == NULL) {
+	    free(remap);
+	    return -1;
+	}
+	while (p < end && (p = varint_get(p, end, &d)) && (p = varint_get(p, end, &tf))) {
+	    doc += d;
+	    if (doc > ix->ndocs || !remap[doc])
+		continue;
+	    len += varint_put(out + len, remap[doc] - last);
+	    len += varint_put(out + len, tf);
+	    last = remap[doc];
+	    df++;
+	}
+	if (t->psize)
+	    free(t->post);
+	t->post = out;
+	t->plen = len;
+	t->psize = t->plen + 1;
+	t->last = last;
+	t->df = df;
+    }
+
+    for (i = 0; ix->ids && i <= ix->imask; i++)
+	if (ix->ids[i].used)
+	    ix->ids[i].doc = remap[ix->ids[i].doc];
+
+    free(remap);
+    ix->ndocs = n;
+    if (ix->stamp) // stamps refer to the old numbers
+	memset(ix->stamp, 0, ix->ssize * sizeof(uint32_t));
+    return 0;
+}
+
+// index:compact() drops removed documents
+static int index_compact(lua_State *L) {
+    lindex *ix = checkindex(L);
+    if (compact(ix) == -1)
+	luaL_error(L, "Out-of-memory error compacting index");
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* ================================================== */
+
+static int hit_cmp(const void *a, const void *b) {
+    const idx_hit *x = a, *y = b;
+    if (x->score != y->score)
+	return x->score < y->score ? 1 : -1;
+    return (x->doc > y->doc) - (x->doc < y->doc);
+}
+
+static int name_cmp(const void *a, const void *b) {
+    const idx_term *x = *(idx_term * const *)a, *y = *(idx_term * const *)b;
+    size_t n = x->len < y->len ? x->len : y->len;
+    int c = memcmp(x->name, y->name, n);
+    return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+// appends to the last group every term starting with s but skip
+static int add_prefix(lindex *ix, const unsigned char *s, size_t len, uint32_t head, int64_t skip) {
+    uint32_t i;
+    if (ix->nsorted != ix->nterms || ix->sorted == NULL) {
+	idx_term **sorted = realloc(ix->sorted, (ix->nterms + 1) * sizeof(idx_term *));
+	if (sorted == NULL)
+	    return -1;
+	for (i = 0; i < ix->nterms; i++)
+	    sorted[i] = &ix->terms[i];
+	qsort(sorted, ix->nterms, sizeof(idx_term *), name_cmp);
+	ix->sorted = sorted;
+	ix->nsorted = ix->nterms;
+    }
+
+    uint32_t lo = 0, hi = ix->nsorted;
+    while (lo < hi) { // first term >= s
+	uint32_t mid = (lo + hi) / 2;
+	idx_term *t = ix->sorted[mid];
+	size_t n = t->len < len ? t->len : len;
+	int c = memcmp(t->name, s, n);
+	if (c < 0 || (c == 0 && t->len < len))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    for (i = lo; i < ix->nsorted; i++) {
+	idx_term *t = ix->sorted[i];
+	uint32_t j = t - ix->terms;
+	if (t->len < len || memcmp(t->name, s, len))
+	    break;
+	if (j == skip)
+	    continue;
+	if (u32_reserve(&ix->query, &ix->qcap, ix->qlen, 1) == -1)
+	    return -1;
+	ix->query[ix->qlen++] = j;
+	ix->query[head]++;
+    }
+    return 0;
+}
+
+// starts a group for word s; stem is its term, if in the index
+static int add_word(lindex *ix, const unsigned char *stem, size_t len, uint32_t *head, int64_t *j) {
+    if (u32_reserve(&ix->query, &ix->qcap, ix->qlen, 2) == -1)
+	return -1;
+    *head = ix->qlen;
+    *j = term_find(ix, stem, len);
+    ix->query[ix->qlen++] = 0;
+    if (*j >= 0) {
+	ix->query[ix->qlen++] = (uint32_t)*j;
+	ix->query[*head]++;
+    }
+    return 0;
+}
+
+static int scratch_reserve(lindex *ix) {
+    if (ix->ndocs < ix->ssize)
+	return 0;
+    uint32_t N = ix->ssize ? ix->ssize : 1024;
+    while (N <= ix->ndocs)
+	N *= 2;
+    float *score = realloc(ix->score, N * sizeof(float));
+    if (score) ix->score = score;
+    uint32_t *stamp = realloc(ix->stamp, N * sizeof(uint32_t));
+    if (stamp) ix->stamp = stamp;
+    uint32_t *group = realloc(ix->group, N * sizeof(uint32_t));
+    if (group) ix->group = group;
+    uint32_t *matched = realloc(ix->matched, N * sizeof(uint32_t));
+    if (matched) ix->matched = matched;
+    uint32_t *cand = realloc(ix->cand, N * sizeof(uint32_t));
+    if (cand) ix->cand = cand;
+    idx_hit *sel = realloc(ix->sel, N * sizeof(idx_hit));
+    if (sel) ix->sel = sel;
+    if (!score || !stamp || !group || !matched || !cand || !sel)
+	return -1;
+    memset(ix->stamp + ix->ssize, 0, (N - ix->ssize) * sizeof(uint32_t));
+    ix->ssize = N;
+    return 0;
+}
+
+// index:search(query [, opts]) query is text, or an array of terms;
+// opts {mode='and'|'or', prefix=boolean, limit=integer, k1=number, b=number}
+// with prefix the last word also matches every term starting with it;
+// returns arrays of ids & BM25 scores, best first
+static int index_search(lua_State *L) {
+    lindex *ix = checkindex(L);
+    luaL_argcheck(L, lua_type(L, 2) == LUA_TTABLE || (ix->st && lua_type(L, 2) == LUA_TSTRING), 2,
+	    ix->st ? "text or array of terms expected" : "array of terms expected");
+    lua_settop(L, 3);
+
+    int and = 1, prefix = 0, err = 0;
+    lua_Integer limit = 20;
+    double k1 = 1.2, b = 0.75;
+    if (lua_istable(L, 3)) {
+	lua_getfield(L, 3, "mode");
+	and = strcmp(luaL_optstring(L, -1, "and"), "or") != 0;
+	lua_getfield(L, 3, "prefix");
+	prefix = lua_toboolean(L, -1);
+	lua_getfield(L, 3, "limit");
+	limit = luaL_optinteger(L, -1, 20);
+	lua_getfield(L, 3, "k1");
+	k1 = luaL_optnumber(L, -1, 1.2);
+	lua_getfield(L, 3, "b");
+	b = luaL_optnumber(L, -1, 0.75);
+	lua_pop(L, 5);
+    }
+
+    // words to groups of terms; a document matches a word if it has any
+    uint32_t ngroups = 0, head = 0;
+    int64_t j = -1;
+    unsigned char last[MAXTOKEN + 4];
+    size_t lastlen = 0;
+    ix->qlen = 0;
+    if (lua_type(L, 2) == LUA_TSTRING) {
+	size_t len, pos = 0, k, chars;
+	const char *s = lua_tolstring(L, 2, &len);
+	unsigned char tok[MAXTOKEN + 4];
+	while (!err && (k = next_token(ix->st->enc, s, len, &pos, tok, &chars)) > 0) {
+	    if ((lua_Integer)chars < ix->min || stop_has(&ix->stops, tok, k))
+		continue;
+	    int m;
+	    const sb_symbol *stem = stem_word(ix->st, tok, (int)k, &m);
+	    err = stem == NULL || add_word(ix, stem, m, &head, &j) == -1;
+	    memcpy(last, tok, k);
+	    lastlen = k;
+	    ngroups++;
+	}
+	if (!err && prefix && ngroups > 0)
+	    err = add_prefix(ix, last, lastlen, head, j) == -1;
+    } else {
+	lua_Integer i, N = luaL_len(L, 2);
+	const char *w = NULL;
+	for (i = 1; !err && i <= N; i++) {
+	    size_t len;
+	    lua_rawgeti(L, 2, i);
+	    if (lua_type(L, -1) == LUA_TSTRING) {
+		w = lua_tolstring(L, -1, &len);
+		err = add_word(ix, (const unsigned char *)w, len, &head, &j) == -1;
+		lastlen = len;
+		ngroups++;
+	    }
+	    lua_pop(L, 1); // w is still anchored in the query
+	}
+	if (!err && prefix && ngroups > 0)
+	    err = add_prefix(ix, (const unsigned char *)w, lastlen, head, j) == -1;
+    }
+    if (err || scratch_reserve(ix) == -1)
+	luaL_error(L, "Out-of-memory error searching index");
+
+    // BM25 over the postings of every term in each group
+    if (++ix->epoch == 0) {
+	memset(ix->stamp, 0, ix->ssize * sizeof(uint32_t));
+	ix->epoch = 1;
+    }
+    double N = ix->live, avgdl = ix->live ? (double)ix->total / ix->live : 1;
+    uint32_t q = 0, g = 0, ncand = 0, nsel = 0, i;
+    while (q < ix->qlen) {
+	uint32_t n = ix->query[q++], k;
+	g++;
+	for (k = 0; k < n; k++) {
+	    idx_term *t = &ix->terms[ix->query[q++]];
+	    double idf = log(1 + (N - t->df + 0.5) / (t->df + 0.5));
+	    const uint8_t *p = t->post, *end = t->post + t->plen;
+	    uint32_t d, tf, doc = 0;
+	    while (p < end && (p = varint_get(p, end, &d)) && (p = varint_get(p, end, &tf))) {
+		doc += d;
+		if (doc > ix->ndocs || !ix->docs[doc].alive)
+		    continue;
+		if (ix->stamp[doc] != ix->epoch) {
+		    ix->stamp[doc] = ix->epoch;
+		    ix->score[doc] = 0;
+		    ix->group[doc] = 0;
+		    ix->matched[doc] = 0;
+		    ix->cand[ncand++] = doc;
+		}
+		if (ix->group[doc] != g) {
+		    ix->group[doc] = g;
+		    ix->matched[doc]++;
+		}
+		double dl = ix->docs[doc].len;
+		ix->score[doc] += idf * tf * (k1 + 1) / (tf + k1 * (1 - b + b * dl / avgdl));
+	    }
+	}
+    }
+
+    for (i = 0; i < ncand; i++) {
+	uint32_t doc = ix->cand[i];
+	if (and && ix->matched[doc] != ngroups)
+	    continue;
+	ix->sel[nsel].doc = doc;
+	ix->sel[nsel++].score = ix->score[doc];
+    }
+    qsort(ix->sel, nsel, sizeof(idx_hit), hit_cmp);
+    if (limit >= 0 && (lua_Integer)nsel > limit)
+	nsel = limit;
+
+    lua_createtable(L, nsel, 0);
+    lua_createtable(L, nsel, 0);
+    for (i = 0; i < nsel; i++) {
+	lua_pushinteger(L, ix->docs[ix->sel[i].doc].id);
+	lua_rawseti(L, -3, i+1);
+	lua_pushnumber(L, ix->sel[i].score);
+	lua_rawseti(L, -2, i+1);
+    }
+    return 2;
+}
+
+/* ================================================== */
+
+// index:save(path) compacts the index & writes it in a mappable layout; the
+// file is written aside & renamed into place, since a loaded index may still
+// read its names from the old file
+static int index_save(lua_State *L) {
+    lindex *ix = checkindex(L);
+    const char *path = luaL_checkstring(L, 2);
+    const char *tmp = lua_pushfstring(L, "%s.tmp", path);
+    uint32_t i;
+
+    if (compact(ix) == -1)
+	luaL_error(L, "Out-of-memory error compacting index");
+
+    idx_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, 8);
+    h.ndocs = ix->ndocs;
+    h.nterms = ix->nterms;
+    h.total = ix->total;
+    h.docs_ofs = sizeof(idx_header);
+    h.terms_ofs = h.docs_ofs + (uint64_t)ix->ndocs * sizeof(idx_doc);
+    h.names_ofs = h.terms_ofs + (uint64_t)ix->nterms * sizeof(idx_record);
+    h.post_ofs = h.names_ofs;
+    for (i = 0; i < ix->nterms; i++)
+	h.post_ofs += ix->terms[i].len;
+    h.size = h.post_ofs;
+    for (i = 0; i < ix->nterms; i++)
+	h.size += ix->terms[i].plen;
+
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "ERROR: cannot open %s for writing", tmp);
+	return 2;
+    }
+
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    if (ix->ndocs > 0)
+	ok = ok && fwrite(ix->docs + 1, sizeof(idx_doc), ix->ndocs, f) == ix->ndocs;
+    uint64_t nofs = h.names_ofs, pofs = h.post_ofs;
+    for (i = 0; ok && i < ix->nterms; i++) {
+	idx_term *t = &ix->terms[i];
+	idx_record r = {nofs, pofs, t->plen, t->len, t->df, t->last, 0};
+	ok = fwrite(&r, sizeof(r), 1, f) == 1;
+	nofs += t->len;
+	pofs += t->plen;
+    }
+    for (i = 0; ok && i < ix->nterms; i++)
+	ok = fwrite(ix->terms[i].name, 1, ix->terms[i].len, f) == ix->terms[i].len;
+    for (i = 0; ok && i < ix->nterms; i++)
+	ok = fwrite(ix->terms[i].post, 1, ix->terms[i].plen, f) == ix->terms[i].plen;
+    ok = (fclose(f) == 0) && ok;
+    ok = ok && rename(tmp, path) == 0;
+
+    if (!ok) {
+	remove(tmp);
+	lua_pushnil(L);
+	lua_pushfstring(L, "ERROR: cannot write %s", path);
+	return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// lstem.load_index(path [, stemmer [, opts]]) maps a saved index; names &
+// postings are read in place until modified
+int load_index(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    lua_settop(L, 3);
+    lua_pushcfunction(L, new_index);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_call(L, 2, 1);
+    lindex *ix = (lindex *)lua_touserdata(L, -1);
+    const char *err = NULL;
+    uint32_t i;
+
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+	if (fd != -1)
+	    close(fd);
+	lua_pushnil(L);
+	lua_pushfstring(L, "ERROR: cannot open %s", path);
+	return 2;
+    }
+    if ((size_t)sb.st_size < sizeof(idx_header)) {
+	close(fd);
+	lua_pushnil(L);
+	lua_pushfstring(L, "ERROR: %s is not an index", path);
+	return 2;
+    }
+    void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "ERROR: cannot map %s", path);
+	return 2;
+    }
+    ix->map = map;
+    ix->maplen = sb.st_size;
+
+    const char *base = map;
+    idx_header h;
+    memcpy(&h, base, sizeof(h));
+    if (memcmp(h.magic, MAGIC, 8) || h.size != (uint64_t)sb.st_size
+	    || h.docs_ofs != sizeof(idx_header)
+	    || h.terms_ofs != h.docs_ofs + (uint64_t)h.ndocs * sizeof(idx_doc)
+	    || h.names_ofs != h.terms_ofs + (uint64_t)h.nterms * sizeof(idx_record)
+	    || h.post_ofs < h.names_ofs || h.size < h.post_ofs)
+	err = "ERROR: %s is not an index";
+
+    if (!err && docs_reserve(ix, h.ndocs + 1) == -1)
+	err = "Out-of-memory error loading %s";
+    for (i = 0; !err && i < h.ndocs; i++) {
+	idx_doc *d = &ix->docs[i+1];
+	memcpy(d, base + h.docs_ofs + (uint64_t)i * sizeof(idx_doc), sizeof(idx_doc));
+	idx_id *e = id_find(ix, d->id, 1);
+	if (e == NULL)
+	    err = "Out-of-memory error loading %s";
+	else if (e->doc || !d->alive)
+	    err = "ERROR: %s is corrupt";
+	else {
+	    e->doc = i + 1;
+	    ix->ndocs = i + 1;
+	    ix->live++;
+	}
+    }
+    ix->total = h.total;
+
+    for (i = 0; !err && i < h.nterms; i++) {
+	idx_record r;
+	memcpy(&r, base + h.terms_ofs + (uint64_t)i * sizeof(idx_record), sizeof(r));
+	if (r.name_ofs < h.names_ofs || r.name_ofs > h.post_ofs || r.name_len > h.post_ofs - r.name_ofs
+		|| r.post_ofs < h.post_ofs || r.post_ofs > h.size || r.post_len > h.size - r.post_ofs
+		|| r.last > h.ndocs) {
+	    err = "ERROR: %s is corrupt";
+	    break;
+	}
+	const char *name = base + r.name_ofs;
+	if (term_find(ix, (const unsigned char *)name, r.name_len) != -1) {
+	    err = "ERROR: %s is corrupt";
+	    break;
+	}
+	int64_t j = term_new(ix, (const unsigned char *)name, r.name_len, name);
+	if (j == -1) {
+	    err = "Out-of-memory error loading %s";
+	    break;
+	}
+	idx_term *t = &ix->terms[j];
+	t->df = r.df;
+	t->last = r.last;
+	t->post = (uint8_t *)base + r.post_ofs;
+	t->plen = r.post_len;
+	t->psize = 0;
+    }
+
+    if (err) {
+	lua_pushnil(L);
+	lua_pushfstring(L, err, path);
+	return 2;
+    }
+    return 1;
+}
+
+/* ================================================== */
+
+static int index_len(lua_State *L) {
+    lindex *ix = checkindex(L);
+    lua_pushinteger(L, ix->live);
+    return 1;
+}
+
+static int index_stats(lua_State *L) {
+    lindex *ix = checkindex(L);
+    size_t bytes = 0;
+    uint32_t i;
+    for (i = 0; i < ix->nterms; i++)
+	bytes += ix->terms[i].plen;
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, ix->live);
+    lua_setfield(L, -2, "docs");
+    lua_pushinteger(L, ix->ndocs - ix->live);
+    lua_setfield(L, -2, "dead");
+    lua_pushinteger(L, ix->nterms);
+    lua_setfield(L, -2, "terms");
+    lua_pushinteger(L, ix->total);
+    lua_setfield(L, -2, "tokens");
+    lua_pushinteger(L, bytes);
+    lua_setfield(L, -2, "postings");
+    return 1;
+}
+
+static int index_gc(lua_State *L) {
+    lindex *ix = checkindex(L);
+    uint32_t i;
+    for (i = 0; i < ix->nterms; i++)
+	if (ix->terms[i].psize)
+	    free(ix->terms[i].post);
+    while (ix->names) {
+	idx_block *b = ix->names;
+	ix->names = b->next;
+	free(b);
+    }
+    free(ix->terms); free(ix->tmap); free(ix->docs); free(ix->ids);
+    free(ix->sorted); free(ix->touched); free(ix->query);
+    free(ix->score); free(ix->stamp); free(ix->group); free(ix->matched); free(ix->cand); free(ix->sel);
+    free(ix->stops.slots);
+    if (ix->map)
+	munmap(ix->map, ix->maplen);
+    memset(ix, 0, sizeof(lindex));
+    return 0;
+}
+
+static int index_asstr(lua_State *L) {
+    lindex *ix = checkindex(L);
+    lua_pushfstring(L, "STEM index (%d documents, %d terms)", (int)ix->live, (int)ix->nterms);
+    return 1;
+}
+
+static const struct luaL_Reg index_meths[] = {
+    {"add", index_add},
+    {"remove", index_remove},
+    {"search", index_search},
+    {"compact", index_compact},
+    {"save", index_save},
+    {"stats", index_stats},
+    {"__len", index_len},
+    {"__gc", index_gc},
+    {"__tostring", index_asstr},
+    {NULL, NULL}
+};
+
+void lindex_open(lua_State *L) {
+    luaL_newmetatable(L, "caap.stemmer.index");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, index_meths, 0);
+    lua_pop(L, 1);
+}
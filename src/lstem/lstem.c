@@ -2,15 +2,307 @@
 #include <lauxlib.h>
 
 #include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 
-#include "include/libstemmer.h"
+#include "lstem.h"
 
 /* {=====================================================================
  *    Auxiliary
  * ======================================================================} */
 
-#define checkstem(L,i) *(struct sb_stemmer **)luaL_checkudata(L, i, "caap.stemmer.stem")
-#define newstem(L) (struct sb_stemmer **)lua_newuserdata(L, sizeof(struct sb_stemmer *)); luaL_getmetatable(L, "caap.stemmer.stem"); lua_setmetatable(L, -2)
+// reads one code point, invalid sequences are read as a single byte
+static size_t utf8_next(const unsigned char *s, size_t len, uint32_t *cp) {
+    unsigned char c = s[0];
+    size_t n, i;
+    if (c < 0x80) { *cp = c; return 1; }
+    else if ((c & 0xe0) == 0xc0) { n = 2; *cp = c & 0x1f; }
+    else if ((c & 0xf0) == 0xe0) { n = 3; *cp = c & 0x0f; }
+    else if ((c & 0xf8) == 0xf0) { n = 4; *cp = c & 0x07; }
+    else { *cp = 0xfffd; return 1; }
+    if (n > len) { *cp = 0xfffd; return 1; }
+    for (i = 1; i < n; i++) {
+	if ((s[i] & 0xc0) != 0x80) { *cp = 0xfffd; return 1; }
+	*cp = (*cp << 6) | (s[i] & 0x3f);
+    }
+    return n;
+}
+
+static size_t utf8_put(uint32_t cp, unsigned char *out) {
+    if (cp < 0x80) { out[0] = cp; return 1; }
+    if (cp < 0x800) { out[0] = 0xc0 | (cp >> 6); out[1] = 0x80 | (cp & 0x3f); return 2; }
+    if (cp < 0x10000) {
+	out[0] = 0xe0 | (cp >> 12); out[1] = 0x80 | ((cp >> 6) & 0x3f); out[2] = 0x80 | (cp & 0x3f);
+	return 3;
+    }
+    out[0] = 0xf0 | (cp >> 18); out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f); out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+// letters & digits; beyond ASCII everything but Latin-1 symbols, general
+// punctuation and the replacement character is taken as a letter
+static int utf8_isword(uint32_t cp) {
+    if (cp < 0x80)
+	return (cp >= '0' && cp <= '9') || ((cp | 0x20) >= 'a' && (cp | 0x20) <= 'z');
+    if (cp < 0xc0 || cp == 0xd7 || cp == 0xf7)
+	return 0;
+    if ((cp >= 0x2000 && cp <= 0x2bff) || (cp >= 0x3000 && cp <= 0x303f) || cp == 0xfeff || cp == 0xfffd)
+	return 0;
+    return 1;
+}
+
+// Latin, Greek & Cyrillic; other scripts are left as they are
+static uint32_t utf8_lower(uint32_t cp) {
+    if (cp < 0x80)
+	return (cp >= 'A' && cp <= 'Z') ? cp + 32 : cp;
+    if (cp >= 0xc0 && cp <= 0xde && cp != 0xd7)
+	return cp + 32;
+    if (cp == 0x178) // Y with diaeresis, lower case is in Latin-1
+	return 0xff;
+    if (cp >= 0x100 && cp <= 0x17f && cp != 0x130 && cp != 0x131 && cp != 0x138 && cp != 0x149 && cp != 0x17f) {
+	if ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17e))
+	    return (cp & 1) ? cp + 1 : cp; // odd upper case
+	return (cp & 1) ? cp : cp + 1;
+    }
+    if ((cp >= 0x391 && cp <= 0x3a9 && cp != 0x3a2) || (cp >= 0x410 && cp <= 0x42f))
+	return cp + 32;
+    if (cp >= 0x400 && cp <= 0x40f)
+	return cp + 80;
+    return cp;
+}
+
+// ISO_8859_2 letters in 0xa1-0xaf (upper case) and 0xb1-0xbf (lower case)
+// by low nibble, the rest of those rows are accents and symbols
+#define LATIN2_LETTERS 0xde6a
+
+static int byte_isword(int enc, unsigned char c) {
+    if (c < 0x80)
+	return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+    if (enc == KOI8_R)
+	return c >= 0xc0 || c == 0xa3 || c == 0xb3;
+    if (enc == ISO_8859_2) {
+	if (c >= 0xa0 && c < 0xc0)
+	    return (LATIN2_LETTERS >> (c & 15)) & 1;
+	if (c == 0xff) // dot above
+	    return 0;
+    }
+    return c >= 0xc0 && c != 0xd7 && c != 0xf7;
+}
+
+static unsigned char byte_lower(int enc, unsigned char c) {
+    if (c < 0x80)
+	return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+    if (enc == KOI8_R)
+	return c >= 0xe0 ? c - 32 : (c == 0xb3 ? 0xa3 : c);
+    if (enc == ISO_8859_2 && c >= 0xa0 && c < 0xb0 && ((LATIN2_LETTERS >> (c & 15)) & 1))
+	return c + 16;
+    return (c >= 0xc0 && c <= 0xde && c != 0xd7) ? c + 32 : c;
+}
+
+// next lowercased token from s[*pos...] into tok, returns its length in
+// bytes, 0 at the end of s; chars counts its characters
+size_t next_token(int enc, const char *s, size_t len, size_t *pos, unsigned char *tok, size_t *chars) {
+    const unsigned char *u = (const unsigned char *)s;
+    size_t i = *pos, n, k;
+    uint32_t cp;
+
+    while (i < len) {
+	// skip separators
+	if (enc == UTF_8) {
+	    while (i < len) {
+		n = utf8_next(u + i, len - i, &cp);
+		if (utf8_isword(cp))
+		    break;
+		i += n;
+	    }
+	} else
+	    while (i < len && !byte_isword(enc, u[i]))
+		i++;
+
+	k = 0; *chars = 0;
+	while (i < len) {
+	    if (enc == UTF_8) {
+		n = utf8_next(u + i, len - i, &cp);
+		if (!utf8_isword(cp))
+		    break;
+		if (k + 4 <= MAXTOKEN)
+		    k += utf8_put(utf8_lower(cp), tok + k);
+		else
+		    k = MAXTOKEN + 1;
+		i += n;
+	    } else {
+		if (!byte_isword(enc, u[i]))
+		    break;
+		if (k < MAXTOKEN)
+		    tok[k] = byte_lower(enc, u[i]);
+		k++;
+		i++;
+	    }
+	    (*chars)++;
+	}
+
+	if (k > 0 && k <= MAXTOKEN) {
+	    *pos = i;
+	    return k;
+	}
+    }
+    *pos = i;
+    return 0;
+}
+
+/* ================================================== */
+
+uint32_t fnv1a(const unsigned char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    while (len--)
+	h = (h ^ *s++) * 16777619u;
+    return h;
+}
+
+static void cache_free(stem_cache *c) {
+    if (c == NULL)
+	return;
+    free(c->slots);
+    free(c->arena);
+    free(c);
+}
+
+static stem_cache *cache_new(uint32_t cap) {
+    stem_cache *c = (stem_cache *)calloc(1, sizeof(stem_cache));
+    if (c == NULL)
+	return NULL;
+    uint32_t N = 16;
+    while (N < 2*cap)
+	N *= 2;
+    c->slots = (stem_slot *)calloc(N, sizeof(stem_slot));
+    c->size = (size_t)cap * 24; // average word & stem
+    c->arena = (char *)malloc(c->size);
+    if (c->slots == NULL || c->arena == NULL) {
+	cache_free(c);
+	return NULL;
+    }
+    c->mask = N - 1;
+    c->cap = cap;
+    return c;
+}
+
+// linear probing deletion by backward shift, no tombstones
+static void cache_delete(stem_cache *c, uint32_t i) {
+    uint32_t j = i, k;
+    c->slots[i].used = 0;
+    for (;;) {
+	j = (j + 1) & c->mask;
+	if (!c->slots[j].used)
+	    return;
+	k = c->slots[j].hash & c->mask;
+	if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+	    continue;
+	c->slots[i] = c->slots[j];
+	c->slots[j].used = 0;
+	i = j;
+    }
+}
+
+static void cache_evict(stem_cache *c) {
+    for (;;) {
+	uint32_t i = c->hand;
+	stem_slot *s = &c->slots[i];
+	c->hand = (i + 1) & c->mask;
+	if (!s->used)
+	    continue;
+	if (s->ref) {
+	    s->ref = 0;
+	    continue;
+	}
+	cache_delete(c, i);
+	c->n--;
+	c->evictions++;
+	return;
+    }
+}
+
+// room for len more bytes, copying live strings into a new arena if needed
+static int cache_reserve(stem_cache *c, size_t len) {
+    if (c->top + len <= c->size)
+	return 0;
+    size_t live = len, size = c->size;
+    uint32_t i;
+    for (i = 0; i <= c->mask; i++)
+	if (c->slots[i].used)
+	    live += c->slots[i].klen + c->slots[i].vlen;
+    while (size < 2*live)
+	size *= 2;
+    char *arena = (char *)malloc(size), *p = arena;
+    if (arena == NULL)
+	return -1;
+    for (i = 0; i <= c->mask; i++) {
+	stem_slot *s = &c->slots[i];
+	if (!s->used)
+	    continue;
+	memcpy(p, c->arena + s->ofs, s->klen + s->vlen);
+	s->ofs = p - arena;
+	p += s->klen + s->vlen;
+    }
+    free(c->arena);
+    c->arena = arena;
+    c->size = size;
+    c->top = p - arena;
+    return 0;
+}
+
+static void cache_insert(stem_cache *c, uint32_t h, const sb_symbol *w, int klen, const sb_symbol *v, int vlen) {
+    if (c->n >= c->cap)
+	cache_evict(c);
+    if (cache_reserve(c, klen + vlen) == -1)
+	return; // not cached
+    uint32_t i = h & c->mask;
+    while (c->slots[i].used)
+	i = (i + 1) & c->mask;
+    stem_slot *s = &c->slots[i];
+    s->hash = h;
+    s->ofs = c->top;
+    s->klen = klen;
+    s->vlen = vlen;
+    s->ref = 0;
+    s->used = 1;
+    memcpy(c->arena + c->top, w, klen);
+    memcpy(c->arena + c->top + klen, v, vlen);
+    c->top += klen + vlen;
+    c->n++;
+}
+
+// stem of w, through the cache if enabled; NULL when out of memory
+const sb_symbol *stem_word(lstem_stem *st, const sb_symbol *w, int len, int *out) {
+    stem_cache *c = st->cache;
+    uint32_t h = 0;
+
+    if (c != NULL && len <= MAXTOKEN) {
+	h = fnv1a(w, len);
+	uint32_t i = h & c->mask;
+	while (c->slots[i].used) {
+	    stem_slot *s = &c->slots[i];
+	    if (s->hash == h && s->klen == len && !memcmp(c->arena + s->ofs, w, len)) {
+		s->ref = 1;
+		c->hits++;
+		*out = s->vlen;
+		return (const sb_symbol *)c->arena + s->ofs + s->klen;
+	    }
+	    i = (i + 1) & c->mask;
+	}
+	c->misses++;
+    }
+
+    const sb_symbol *ans = sb_stemmer_stem(st->stemmer, w, len);
+    if (ans == NULL)
+	return NULL;
+    *out = sb_stemmer_length(st->stemmer);
+    if (c != NULL && len <= MAXTOKEN && *out <= MAXTOKEN)
+	cache_insert(c, h, w, len, ans, *out);
+    return ans;
+}
 
 /* ================================================== */
 
@@ -28,41 +320,384 @@ static int algos(lua_State *L) {
 }
 
 static int newStemmer(lua_State *L) {
-    const char *algo = lua_tostring(L, 1);
+    const char *algo = luaL_checkstring(L, 1);
     const char *enc = lua_tostring(L, 2);
 
-    struct sb_stemmer **stemmer = newstem(L);
-    *stemmer = sb_stemmer_new(algo, enc);
-    if (*stemmer == NULL)
-	luaL_error(L, "Error creating stemmer for %s with %s encoding.\n", algo, enc);
+    lstem_stem *st = newstem(L);
+    st->enc = UTF_8;
+    if (enc && !strcmp(enc, "ISO_8859_1")) st->enc = ISO_8859_1;
+    if (enc && !strcmp(enc, "ISO_8859_2")) st->enc = ISO_8859_2;
+    if (enc && !strcmp(enc, "KOI8_R")) st->enc = KOI8_R;
+    st->cache = NULL;
+    st->stemmer = NULL;
+    luaL_argcheck(L, strlen(algo) < sizeof(st->algo), 1, "unknown algorithm");
+    luaL_argcheck(L, enc == NULL || strlen(enc) < sizeof(st->encname), 2, "unknown encoding");
+    strcpy(st->algo, algo);
+    strcpy(st->encname, enc ? enc : "UTF_8");
+    st->stemmer = sb_stemmer_new(algo, enc);
+    if (st->stemmer == NULL)
+	luaL_error(L, "Error creating stemmer for %s with %s encoding.\n", algo, enc ? enc : "UTF_8");
 
     return 1;
 }
 
-// XXX
-
 static int stemming(lua_State *L) {
-    struct sb_stemmer *stemmer = checkstem(L, 1);
-    const char *wrd = lua_tostring(L, 2);
+    lstem_stem *st = checkstem(L, 1);
+    size_t size;
+    const char *wrd = luaL_checklstring(L, 2, &size);
 
-    int size = (int)strlen(wrd);
-
-    const sb_symbol *ans;
-    ans = sb_stemmer_stem(stemmer, (const sb_symbol *)wrd, size);
+    int n;
+    const sb_symbol *ans = stem_word(st, (const sb_symbol *)wrd, (int)size, &n);
     if (ans == NULL) {
 	lua_pushnil(L);
 	lua_pushfstring(L, "Out-of-memory error stemming word: %s\n", wrd);
+	return 2;
     }
-    lua_pushlstring(L, (char *)ans, (size_t)sb_stemmer_length(stemmer));
+    lua_pushlstring(L, (char *)ans, (size_t)n);
 
     return 1;
 }
 
+// reads opts {stop, freq, min} at k; pushes the stop words as a set, or nil
+void text_opts(lua_State *L, int k, int *freq, lua_Integer *min) {
+    *freq = 0;
+    *min = 1;
+    lua_pushnil(L);
+    if (!lua_istable(L, k))
+	return;
+    lua_getfield(L, k, "freq");
+    *freq = lua_toboolean(L, -1);
+    lua_getfield(L, k, "min");
+    *min = luaL_optinteger(L, -1, 1);
+    lua_pop(L, 2);
+    if (lua_getfield(L, k, "stop") == LUA_TTABLE) {
+	if (lua_rawgeti(L, -1, 1) != LUA_TNIL) { // list, as a set
+	    lua_Integer i, N = luaL_len(L, -2);
+	    lua_createtable(L, 0, N);
+	    for (i = 1; i <= N; i++) {
+		lua_rawgeti(L, -3, i);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -3);
+	    }
+	    lua_replace(L, -4);
+	    lua_pop(L, 2);
+	} else {
+	    lua_pop(L, 1);
+	    lua_replace(L, -2);
+	}
+    } else
+	lua_pop(L, 1);
+}
+
+// stemmer:stem_text(str [, opts]) tokenises, lowercases & stems str;
+// opts: {stop=set or list of words, freq=boolean, min=characters}
+// returns an array of stems or, with freq, a table of stem -> count
+static int stem_text(lua_State *L) {
+    lstem_stem *st = checkstem(L, 1);
+    size_t len;
+    const char *s = luaL_checklstring(L, 2, &len);
+    int freq;
+    lua_Integer min;
+
+    lua_settop(L, 3);
+    text_opts(L, 3, &freq, &min); // 4: stop words
+    int stops = lua_istable(L, 4);
+
+    unsigned char tok[MAXTOKEN + 4];
+    size_t pos = 0, k, chars;
+    lua_Integer n = 0;
+
+    lua_newtable(L); // 5: result
+    while ((k = next_token(st->enc, s, len, &pos, tok, &chars)) > 0) {
+	if ((lua_Integer)chars < min)
+	    continue;
+	if (stops) {
+	    lua_pushlstring(L, (const char *)tok, k);
+	    int stop = lua_rawget(L, 4) != LUA_TNIL;
+	    lua_pop(L, 1);
+	    if (stop)
+		continue;
+	}
+
+	int m;
+	const sb_symbol *ans = stem_word(st, tok, (int)k, &m);
+	if (ans == NULL)
+	    luaL_error(L, "Out-of-memory error stemming text");
+	lua_pushlstring(L, (const char *)ans, (size_t)m);
+
+	if (freq) {
+	    lua_pushvalue(L, -1);
+	    lua_Integer c = lua_rawget(L, 5) == LUA_TNUMBER ? lua_tointeger(L, -1) : 0;
+	    lua_pop(L, 1);
+	    lua_pushinteger(L, c + 1);
+	    lua_rawset(L, 5);
+	} else
+	    lua_rawseti(L, 5, ++n);
+    }
+
+    return 1;
+}
+
+/* ================================================== */
+
+typedef struct stem_job {
+    int enc;
+    lua_Integer min;
+    stop_set stops;
+    size_t N, next; // documents, next one to take
+    const char **docs;
+    size_t *lens;
+    size_t *ofs, *end; // of each result in its worker's arena
+    int *who; // worker of each document
+    int failed;
+} stem_job;
+
+// each worker owns a stemmer & cache; results are appended to its arena
+// as a sequence of stems, each prefixed by its length in one byte
+typedef struct stem_worker {
+    stem_job *job;
+    int id;
+    lstem_stem st;
+    unsigned char *out;
+    size_t len, size;
+    pthread_t thread;
+} stem_worker;
+
+int stop_has(stop_set *ss, const unsigned char *tok, size_t k) {
+    if (ss->slots == NULL)
+	return 0;
+    uint32_t i = fnv1a(tok, k) & ss->mask;
+    while (ss->slots[i].s != NULL) {
+	if (ss->slots[i].len == k && !memcmp(ss->slots[i].s, tok, k))
+	    return 1;
+	i = (i + 1) & ss->mask;
+    }
+    return 0;
+}
+
+// from the set at index k, string keys only
+int stop_build(lua_State *L, int k, stop_set *ss) {
+    uint32_t N = 16;
+    ss->slots = NULL;
+    if (!lua_istable(L, k))
+	return 0;
+    lua_pushnil(L);
+    while (lua_next(L, k) != 0) {
+	N++;
+	lua_pop(L, 1);
+    }
+    while (N & (N - 1))
+	N++;
+    N *= 2;
+    ss->slots = calloc(N, sizeof(*ss->slots));
+    if (ss->slots == NULL)
+	return -1;
+    ss->mask = N - 1;
+    lua_pushnil(L);
+    while (lua_next(L, k) != 0) {
+	lua_pop(L, 1);
+	if (lua_type(L, -1) != LUA_TSTRING)
+	    continue;
+	size_t len;
+	const char *w = lua_tolstring(L, -1, &len);
+	uint32_t i = fnv1a((const unsigned char *)w, len) & ss->mask;
+	while (ss->slots[i].s != NULL)
+	    i = (i + 1) & ss->mask;
+	ss->slots[i].s = w;
+	ss->slots[i].len = len;
+    }
+    return 0;
+}
+
+static int worker_add(stem_worker *w, const sb_symbol *stem, int len) {
+    if (w->len + len + 1 > w->size) {
+	size_t size = w->size ? w->size : 4096;
+	while (size < w->len + len + 1)
+	    size *= 2;
+	unsigned char *out = realloc(w->out, size);
+	if (out == NULL)
+	    return -1;
+	w->out = out;
+	w->size = size;
+    }
+    w->out[w->len++] = (unsigned char)len;
+    memcpy(w->out + w->len, stem, len);
+    w->len += len;
+    return 0;
+}
+
+static void *stem_worker_run(void *arg) {
+    stem_worker *w = (stem_worker *)arg;
+    stem_job *job = w->job;
+    unsigned char tok[MAXTOKEN + 4];
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->N) {
+	size_t pos = 0, k, chars;
+	job->who[i] = w->id;
+	job->ofs[i] = w->len;
+	while ((k = next_token(job->enc, job->docs[i], job->lens[i], &pos, tok, &chars)) > 0) {
+	    if ((lua_Integer)chars < job->min || stop_has(&job->stops, tok, k))
+		continue;
+	    int m;
+	    const sb_symbol *ans = stem_word(&w->st, tok, (int)k, &m);
+	    if (ans == NULL || m > MAXTOKEN || worker_add(w, ans, m) == -1) {
+		__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	    }
+	}
+	job->end[i] = w->len;
+    }
+    return NULL;
+}
+
+// stemmer:stem_many(docs [, threads [, opts]]) stem_text over an array of
+// documents on a pool of threads, each with its own stemmer; returns the
+// results in document order
+static int stem_many(lua_State *L) {
+    lstem_stem *st = checkstem(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer threads = luaL_optinteger(L, 3, sysconf(_SC_NPROCESSORS_ONLN));
+    luaL_argcheck(L, threads >= 1 && threads <= 256, 3, "number of threads out of range");
+    int freq;
+    size_t i, N = luaL_len(L, 2);
+    const char *err = NULL;
+
+    lua_settop(L, 4);
+    stem_job job;
+    memset(&job, 0, sizeof(job));
+    text_opts(L, 4, &freq, &job.min); // 5: stop words
+    job.enc = st->enc;
+    job.N = N;
+    if ((lua_Integer)N < threads)
+	threads = N > 0 ? N : 1;
+
+    stem_worker *ws = calloc(threads, sizeof(stem_worker));
+    job.docs = malloc((N + 1) * sizeof(const char *));
+    job.lens = malloc((N + 1) * sizeof(size_t));
+    job.ofs = malloc((N + 1) * sizeof(size_t));
+    job.end = malloc((N + 1) * sizeof(size_t));
+    job.who = malloc((N + 1) * sizeof(int));
+    if (!ws || !job.docs || !job.lens || !job.ofs || !job.end || !job.who || stop_build(L, 5, &job.stops) == -1) {
+	err = "Out-of-memory error stemming documents";
+	goto cleanup;
+    }
+
+    // strings stay anchored in docs while the workers read them; numbers
+    // are rejected since their converted strings would not be anchored
+    for (i = 0; i < N; i++) {
+	int type = lua_rawgeti(L, 2, i+1);
+	job.docs[i] = type == LUA_TSTRING ? lua_tolstring(L, -1, &job.lens[i]) : NULL;
+	lua_pop(L, 1);
+	if (job.docs[i] == NULL) {
+	    err = "array of strings expected";
+	    goto cleanup;
+	}
+    }
+
+    lua_Integer t;
+    for (t = 0; t < threads; t++) {
+	stem_worker *w = &ws[t];
+	w->job = &job;
+	w->id = t;
+	w->st.enc = st->enc;
+	w->st.stemmer = sb_stemmer_new(st->algo, st->encname);
+	if (w->st.stemmer == NULL || (st->cache && (w->st.cache = cache_new(st->cache->cap)) == NULL)) {
+	    err = "Out-of-memory error creating stemmers";
+	    goto cleanup;
+	}
+    }
+
+    int started = 1;
+    for (t = 1; t < threads; t++, started++)
+	if (pthread_create(&ws[t].thread, NULL, stem_worker_run, &ws[t]) != 0)
+	    break;
+    stem_worker_run(&ws[0]);
+    for (t = 1; t < started; t++)
+	pthread_join(ws[t].thread, NULL);
+
+    if (job.failed) {
+	err = "Out-of-memory error stemming documents";
+	goto cleanup;
+    }
+
+    lua_createtable(L, N, 0); // 6: results
+    for (i = 0; i < N; i++) {
+	stem_worker *w = &ws[job.who[i]];
+	const unsigned char *p = w->out + job.ofs[i], *q = w->out + job.end[i];
+	lua_Integer n = 0;
+	lua_newtable(L);
+	while (p < q) {
+	    lua_pushlstring(L, (const char *)p + 1, *p);
+	    p += *p + 1;
+	    if (freq) {
+		lua_pushvalue(L, -1);
+		lua_Integer c = lua_rawget(L, -3) == LUA_TNUMBER ? lua_tointeger(L, -1) : 0;
+		lua_pop(L, 1);
+		lua_pushinteger(L, c + 1);
+		lua_rawset(L, -3);
+	    } else
+		lua_rawseti(L, -2, ++n);
+	}
+	lua_rawseti(L, 6, i+1);
+    }
+
+cleanup:
+    if (ws) {
+	for (t = 0; t < threads; t++) {
+	    if (ws[t].st.stemmer)
+		sb_stemmer_delete(ws[t].st.stemmer);
+	    cache_free(ws[t].st.cache);
+	    free(ws[t].out);
+	}
+	free(ws);
+    }
+    free(job.docs); free(job.lens); free(job.ofs); free(job.end); free(job.who);
+    free(job.stops.slots);
+    if (err)
+	luaL_error(L, "%s", err);
+    return 1;
+}
+
+// stemmer:cache(entries) memoises up to entries stems, 0 disables it
+static int set_cache(lua_State *L) {
+    lstem_stem *st = checkstem(L, 1);
+    lua_Integer cap = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, cap >= 0 && cap <= (1 << 28), 2, "cache size out of range");
+
+    cache_free(st->cache);
+    st->cache = NULL;
+    if (cap > 0 && (st->cache = cache_new(cap)) == NULL)
+	luaL_error(L, "Out-of-memory error creating stem cache");
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int cache_stats(lua_State *L) {
+    lstem_stem *st = checkstem(L, 1);
+    stem_cache *c = st->cache;
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, c ? c->hits : 0);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, c ? c->misses : 0);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, c ? c->evictions : 0);
+    lua_setfield(L, -2, "evictions");
+    lua_pushinteger(L, c ? c->n : 0);
+    lua_setfield(L, -2, "entries");
+    lua_pushinteger(L, c ? c->cap : 0);
+    lua_setfield(L, -2, "capacity");
+    return 1;
+}
+
 static int deleteStem(lua_State *L) {
-    struct sb_stemmer *stemmer = checkstem(L, 1);
-    if (stemmer != NULL) {
-	sb_stemmer_delete(stemmer);
-	stemmer = NULL;
+    lstem_stem *st = checkstem(L, 1);
+    cache_free(st->cache);
+    st->cache = NULL;
+    if (st->stemmer != NULL) {
+	sb_stemmer_delete(st->stemmer);
+	st->stemmer = NULL;
     }
     return 0;
 }
@@ -80,6 +715,8 @@ static const struct luaL_Reg stem_funs[] = {
     /* probability dists */
     {"valid", algos},
     {"stemmer", newStemmer},
+    {"index", new_index},
+    {"load_index", load_index},
     {NULL, NULL}
 };
 
@@ -88,6 +725,10 @@ static const struct luaL_Reg stem_meths[] = {
     {"__gc", deleteStem},
     {"__tostring", printStem},
     {"stem", stemming},
+    {"stem_text", stem_text},
+    {"stem_many", stem_many},
+    {"cache", set_cache},
+    {"cache_stats", cache_stats},
     {NULL, NULL}
 };
 
@@ -97,6 +738,10 @@ int luaopen_lstem (lua_State *L) {
     lua_pushvalue(L, -1);
     lua_setfield(L, -1, "__index");
     luaL_setfuncs(L, stem_meths, 0);
+    lua_pop(L, 1);
+
+    // inverted index
+    lindex_open(L);
 
     // create library
     luaL_newlib(L, stem_funs);
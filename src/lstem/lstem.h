@@ -0,0 +1,67 @@
+#ifndef LSTEM_H
+#define LSTEM_H
+
+// shared by lstem.c & lindex.c
+
+#include <lua.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "include/libstemmer.h"
+
+#define checkstem(L,i) (lstem_stem *)luaL_checkudata(L, i, "caap.stemmer.stem")
+#define newstem(L) (lstem_stem *)lua_newuserdata(L, sizeof(lstem_stem)); luaL_getmetatable(L, "caap.stemmer.stem"); lua_setmetatable(L, -2)
+
+#define MAXTOKEN 255 // longer tokens are not words, they are skipped
+
+enum encodings {UTF_8, ISO_8859_1, ISO_8859_2, KOI8_R};
+
+// memo of word -> stem: open addressing over slots, strings in an arena,
+// CLOCK eviction once cap entries are held
+typedef struct stem_slot {
+    uint32_t hash, ofs; // ofs into the arena: word followed by its stem
+    uint8_t klen, vlen, ref, used;
+} stem_slot;
+
+typedef struct stem_cache {
+    stem_slot *slots;
+    uint32_t mask, n, cap, hand;
+    char *arena;
+    size_t top, size;
+    uint64_t hits, misses, evictions;
+} stem_cache;
+
+typedef struct lstem_stem {
+    struct sb_stemmer *stemmer;
+    int enc;
+    stem_cache *cache; // NULL if disabled
+    char algo[32], encname[16]; // to create more stemmers alike
+} lstem_stem;
+
+// stop words shared read-only by the workers, strings owned by Lua
+typedef struct stop_set {
+    uint32_t mask;
+    struct { const char *s; size_t len; } *slots;
+} stop_set;
+
+// next lowercased token of s from *pos into tok; its length, 0 at the end
+size_t next_token(int enc, const char *s, size_t len, size_t *pos, unsigned char *tok, size_t *chars);
+
+uint32_t fnv1a(const unsigned char *s, size_t len);
+
+// stem of w, through the cache if enabled; NULL when out of memory
+const sb_symbol *stem_word(lstem_stem *st, const sb_symbol *w, int len, int *out);
+
+// reads opts {stop, freq, min} at k; pushes the stop words as a set, or nil
+void text_opts(lua_State *L, int k, int *freq, lua_Integer *min);
+
+int stop_has(stop_set *ss, const unsigned char *tok, size_t k);
+int stop_build(lua_State *L, int k, stop_set *ss);
+
+// inverted index, lindex.c
+int new_index(lua_State *L);
+int load_index(lua_State *L);
+void lindex_open(lua_State *L);
+
+#endif
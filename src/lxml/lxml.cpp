@@ -1,11 +1,55 @@
 #include "tinyxml2.h"
+#include "xmlpull.h"
 
 #include <lua.hpp>
 
+#include <new>
+#include <cstdio>
+#include <atomic>
+#include <thread>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define checkreader(L) (lxml_reader *)luaL_checkudata(L, 1, "caap.xml.reader")
+#define checkselector(L,i) (xml_selector *)luaL_checkudata(L, i, "caap.xml.selector")
+#define checkdocument(L) (lxml_document *)luaL_checkudata(L, 1, "caap.xml.document")
+
+using tinyxml2::XMLDocument;
+using tinyxml2::XMLElement;
+using tinyxml2::XMLNode;
+
+static const char *const events[] = {NULL, "start", "attr", "text", "end", NULL};
+
+typedef struct lxml_reader {
+    xml_pull x;
+    xml_select sel;
+    std::vector<const xml_selector *> sels; // of the running select
+    std::string value;
+} lxml_reader;
+
+// parsed in place from a mapped file, or from a copy of a string into a
+// buffer the document keeps; its pools & buffer are reused by every load
+typedef struct lxml_document {
+    XMLDocument doc;
+    char *map;
+    size_t maplen;
+    unsigned gen; // counts loads, a handle of an older one is stale
+} lxml_document;
+
+// light handle of an element, its uservalue is the document
+typedef struct lxml_element {
+    const XMLElement *e;
+    lxml_document *d;
+    unsigned gen;
+} lxml_element;
+
 
 static int parseDoc(lua_State *L) {
     const char* fname = luaL_checkstring(L, 1);
@@ -20,26 +64,799 @@ static int parseDoc(lua_State *L) {
 
     lua_newtable(L);
     int i = 1;
-    const int K = doc.LastChildElement(tag)->GetLineNum();
-    tinyxml2::XMLElement* ele = doc.FirstChildElement(tag);
-
-    do {
+    for (tinyxml2::XMLElement* ele = doc.FirstChildElement(tag); ele; ele = ele->NextSiblingElement(tag)) {
 	lua_pushstring(L, ele->Value());
-	lua_rawseti(L, -1, i++);
-	ele = doc.NextSiblingElement(tag);
-    } while (ele->GetLineNum() != K);
+	lua_rawseti(L, -2, i++);
+    }
+
+    return 1;
+}
+
+//////////////////////////////
+
+static xml_selector *new_selector(lua_State *L, int i, bool all) {
+    size_t len;
+    const char *path = luaL_checklstring(L, i, &len);
+    xml_selector *s = (xml_selector *)lua_newuserdata(L, sizeof(xml_selector));
+    new (s) xml_selector();
+    luaL_setmetatable(L, "caap.xml.selector");
+    s->all = all;
+    const char *err = s->compile(path, len);
+    if (err)
+	luaL_error(L, "invalid selector '%s': %s", path, err);
+    return s;
+}
+
+// select(path [, all]) compiles a selector, see xmlpull.h; with all,
+// extract_many gives every value selected instead of the first
+static int compile_selector(lua_State *L) {
+    new_selector(L, 1, lua_toboolean(L, 2));
+    return 1;
+}
+
+// selector at i, compiling it in place if it is a string
+static const xml_selector *toselector(lua_State *L, int i) {
+    if (lua_type(L, i) != LUA_TSTRING)
+	return checkselector(L, i);
+    const xml_selector *s = new_selector(L, i, false);
+    lua_replace(L, i);
+    return s;
+}
+
+static int selector_gc(lua_State *L) {
+    xml_selector *s = checkselector(L, 1);
+    s->~xml_selector();
+    return 0;
+}
+
+static int selector_asstr(lua_State *L) {
+    xml_selector *s = checkselector(L, 1);
+    luaL_Buffer B;
+    luaL_buffinit(L, &B);
+    luaL_addstring(&B, "XML selector ");
+    if (!s->anchored)
+	luaL_addstring(&B, "//");
+    for (size_t i = 0; i < s->steps.size(); i++) {
+	if (i > 0)
+	    luaL_addchar(&B, '/');
+	luaL_addlstring(&B, s->steps[i].data(), s->steps[i].size());
+    }
+    if (!s->attr.empty()) {
+	luaL_addchar(&B, '@');
+	luaL_addlstring(&B, s->attr.data(), s->attr.size());
+    }
+    luaL_pushresult(&B);
+    return 1;
+}
+
+//////////////////////////////
+
+static lxml_reader *new_reader(lua_State *L) {
+    lxml_reader *r = (lxml_reader *)lua_newuserdata(L, sizeof(lxml_reader));
+    new (r) lxml_reader();
+    luaL_setmetatable(L, "caap.xml.reader");
+    return r;
+}
+
+// open(fname) streams a file
+static int open_reader(lua_State *L) {
+    const char *fname = luaL_checkstring(L, 1);
+    lxml_reader *r = new_reader(L);
+    if (!r->x.open(fname)) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "Error trying to open document: %s\n", fname);
+	return 2;
+    }
+    return 1;
+}
+
+// reader(xml) streams a string, which it keeps
+static int string_reader(lua_State *L) {
+    size_t len;
+    const char *xml = luaL_checklstring(L, 1, &len);
+    lxml_reader *r = new_reader(L);
+    r->x.open(xml, len);
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+// reader:next() returns the next event & its data: 'start', name;
+// 'attr', name, value for each attribute of the element just started;
+// 'text', text; 'end', name. Returns nil at the end, or nil and a message
+static int reader_next(lua_State *L) {
+    lxml_reader *r = checkreader(L);
+    int ev = r->x.next();
+    switch (ev) {
+    case XML_EOF:
+	return 0;
+    case XML_ERROR:
+	lua_pushnil(L);
+	lua_pushfstring(L, "Error parsing document: %s", r->x.error.c_str());
+	return 2;
+    case XML_TEXT:
+	lua_pushstring(L, events[ev]);
+	lua_pushlstring(L, r->x.value.data(), r->x.value.size());
+	return 2;
+    case XML_ATTR:
+	lua_pushstring(L, events[ev]);
+	lua_pushlstring(L, r->x.name.data(), r->x.name.size());
+	lua_pushlstring(L, r->x.value.data(), r->x.value.size());
+	return 3;
+    default:
+	lua_pushstring(L, events[ev]);
+	lua_pushlstring(L, r->x.name.data(), r->x.name.size());
+	return 2;
+    }
+}
+
+static int events_iter(lua_State *L) {
+    lxml_reader *r = checkreader(L);
+    int n = reader_next(L);
+    if (n == 2 && lua_isnil(L, -2))
+	luaL_error(L, "%s", r->x.error.c_str());
+    return n;
+}
+
+// for ev, name, value in reader:events() do ... end, raising on errors
+static int reader_events(lua_State *L) {
+    checkreader(L);
+    lua_pushcfunction(L, events_iter);
+    lua_pushvalue(L, 1);
+    return 2;
+}
+
+static int select_iter(lua_State *L) {
+    lxml_reader *r = checkreader(L);
+    size_t k;
+    int rc = r->sel.next(r->x, r->sels.data(), r->sels.size(), &k, r->value);
+    if (rc == XML_EOF)
+	return 0;
+    if (rc == XML_ERROR)
+	luaL_error(L, "Error parsing document: %s", r->x.error.c_str());
+    lua_pushlstring(L, r->value.data(), r->value.size());
+    lua_pushinteger(L, k + 1);
+    return 2;
+}
+
+// for value, k in reader:select(sel, ...) do ... end yields the values
+// of the elements & attributes selected, k the position of their selector;
+// selectors are compiled or given as paths
+static int reader_select(lua_State *L) {
+    lxml_reader *r = checkreader(L);
+    int i, N = lua_gettop(L);
+    luaL_argcheck(L, N > 1, 2, "selector expected");
+
+    lua_createtable(L, N - 1, 0); // anchors selectors
+    r->sels.clear();
+    for (i = 2; i <= N; i++) {
+	r->sels.push_back(toselector(L, i));
+	lua_pushvalue(L, i);
+	lua_rawseti(L, -2, i - 1);
+    }
+    lua_pushcclosure(L, select_iter, 1);
+    r->sel.reset();
+    lua_pushvalue(L, 1);
+    return 2;
+}
+
+static int reader_depth(lua_State *L) {
+    lxml_reader *r = checkreader(L);
+    lua_pushinteger(L, r->x.depth());
+    return 1;
+}
+
+// reader:path() names the open elements, as in a/b/c
+static int reader_path(lua_State *L) {
+    lxml_reader *r = checkreader(L);
+    lua_pushlstring(L, r->x.path.data(), r->x.path.size());
+    return 1;
+}
+
+static int reader_close(lua_State *L) {
+    lxml_reader *r = checkreader(L);
+    r->x.close();
+    return 0;
+}
+
+static int reader_gc(lua_State *L) {
+    lxml_reader *r = checkreader(L);
+    r->~lxml_reader();
+    return 0;
+}
+
+static int reader_asstr(lua_State *L) {
+    lxml_reader *r = checkreader(L);
+    lua_pushfstring(L, "XML reader (depth %d)", r->x.depth());
+    return 1;
+}
+
+//////////////////////////////
+
+static void doc_unmap(lxml_document *d) {
+    d->doc.Clear();
+    d->gen++;
+    if (d->map)
+	munmap(d->map, d->maplen);
+    d->map = NULL;
+    d->maplen = 0;
+}
+
+// text of e, that of its descendants included
+static void element_text(const XMLElement *e, std::string &out) {
+    for (const XMLNode *n = e->FirstChild(); n; n = n->NextSibling()) {
+	if (n->ToText())
+	    out += n->Value();
+	else if (n->ToElement())
+	    element_text(n->ToElement(), out);
+    }
+}
+
+// the values selected by s under e in document order, up to max
+static void dom_select(const XMLElement *e, const xml_selector *s, std::vector<const XMLElement *> &path, std::vector<std::string> &out, size_t max) {
+    for (; e && out.size() < max; e = e->NextSiblingElement()) {
+	path.push_back(e);
+	if (s->match(path.size(), [&path](size_t i, size_t *len) { *len = strlen(path[i]->Name()); return path[i]->Name(); })) {
+	    if (s->attr.empty()) {
+		out.push_back(std::string());
+		element_text(e, out.back());
+	    } else {
+		const char *v = e->Attribute(s->attr.c_str());
+		if (v)
+		    out.push_back(v);
+	    }
+	}
+	// an anchored selector needs go no deeper than its steps
+	if (!s->anchored || path.size() < s->steps.size())
+	    dom_select(e->FirstChildElement(), s, path, out, max);
+	path.pop_back();
+    }
+}
+
+static int push_element(lua_State *L, int doc, lxml_document *d, const XMLElement *e) {
+    if (e == NULL) {
+	lua_pushnil(L);
+	return 1;
+    }
+    lxml_element *h = (lxml_element *)lua_newuserdata(L, sizeof(lxml_element));
+    h->e = e;
+    h->d = d;
+    h->gen = d->gen;
+    luaL_setmetatable(L, "caap.xml.element");
+    lua_pushvalue(L, doc);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+static const XMLElement *checkelement(lua_State *L, int i) {
+    lxml_element *h = (lxml_element *)luaL_checkudata(L, i, "caap.xml.element");
+    if (h->gen != h->d->gen)
+	luaL_error(L, "stale element, its document was reloaded");
+    return h->e;
+}
+
+// pushes the document of the element at 1 & returns it
+static lxml_document *element_doc(lua_State *L) {
+    lua_getuservalue(L, 1);
+    return (lxml_document *)lua_touserdata(L, -1);
+}
+
+static int doc_result(lua_State *L, lxml_document *d, const char *what) {
+    if (d->doc.Error()) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "Error trying to parse document: %s (%s)\n", what, d->doc.ErrorStr());
+	return 2;
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+//////
+
+// document() is empty until loaded, and is meant to be reused
+static int new_document(lua_State *L) {
+    lxml_document *d = (lxml_document *)lua_newuserdata(L, sizeof(lxml_document));
+    new (d) lxml_document();
+    d->map = NULL;
+    d->maplen = 0;
+    d->gen = 0;
+    luaL_setmetatable(L, "caap.xml.document");
+    return 1;
+}
+
+// maps fname & parses it in place; returns what failed, if not the parse
+static const char *doc_open(lxml_document *d, const char *fname) {
+    struct stat sb;
+    doc_unmap(d);
+
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1 || fstat(fd, &sb) == -1 || sb.st_size == 0) {
+	if (fd != -1)
+	    close(fd);
+	return "open";
+    }
+
+    size_t len = sb.st_size;
+    long page = sysconf(_SC_PAGESIZE);
+    // private & writable: tinyxml2 terminates its strings in place
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return "map";
+
+    if (len % page) { // the rest of the last page is zeroed
+	d->map = (char *)map;
+	d->maplen = len;
+	d->doc.ParseInSitu(d->map, len);
+    } else { // no room for the terminator, copied instead
+	d->doc.Parse((const char *)map, len);
+	munmap(map, len);
+    }
+    return NULL;
+}
+
+// document:load(fname) maps the file and parses it in place; returns the
+// document, or nil and a message
+static int doc_load(lua_State *L) {
+    lxml_document *d = checkdocument(L);
+    const char *fname = luaL_checkstring(L, 2);
+    const char *err = doc_open(d, fname);
+    if (err) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "Error trying to %s document: %s\n", err, fname);
+	return 2;
+    }
+    return doc_result(L, d, fname);
+}
 
+// document:parse(xml) copies xml into the document's buffer, reused by
+// every parse, since a Lua string cannot be parsed in place
+static int doc_parse(lua_State *L) {
+    lxml_document *d = checkdocument(L);
+    size_t len;
+    const char *xml = luaL_checklstring(L, 2, &len);
+    doc_unmap(d);
+    d->doc.Parse(xml, len);
+    return doc_result(L, d, "string");
+}
+
+static int doc_root(lua_State *L) {
+    lxml_document *d = checkdocument(L);
+    return push_element(L, 1, d, d->doc.RootElement());
+}
+
+// document:select(sel) returns the array of values selected, see select
+static int doc_select(lua_State *L) {
+    lxml_document *d = checkdocument(L);
+    const xml_selector *s = toselector(L, 2);
+    std::vector<const XMLElement *> path;
+    std::vector<std::string> values;
+
+    dom_select(d->doc.RootElement(), s, path, values, (size_t)-1);
+    lua_createtable(L, values.size(), 0);
+    for (size_t i = 0; i < values.size(); i++) {
+	lua_pushlstring(L, values[i].data(), values[i].size());
+	lua_rawseti(L, -2, i+1);
+    }
     return 1;
 }
 
+static int doc_clear(lua_State *L) {
+    lxml_document *d = checkdocument(L);
+    doc_unmap(d);
+    return 0;
+}
+
+static int doc_gc(lua_State *L) {
+    lxml_document *d = checkdocument(L);
+    doc_unmap(d);
+    d->~lxml_document();
+    return 0;
+}
+
+static int doc_asstr(lua_State *L) {
+    lxml_document *d = checkdocument(L);
+    const XMLElement *e = d->doc.RootElement();
+    lua_pushfstring(L, "XML document <%s>", e ? e->Name() : "");
+    return 1;
+}
+
+//////
+
+static int element_name(lua_State *L) {
+    const XMLElement *e = checkelement(L, 1);
+    lua_pushstring(L, e->Name());
+    return 1;
+}
+
+// element:text() returns its text, that of descendants included
+static int element_gettext(lua_State *L) {
+    const XMLElement *e = checkelement(L, 1);
+    const XMLNode *n = e->FirstChild();
+    if (n && n->ToText() && n->NextSibling() == NULL) // the usual case
+	lua_pushstring(L, n->Value());
+    else {
+	std::string text;
+	element_text(e, text);
+	lua_pushlstring(L, text.data(), text.size());
+    }
+    return 1;
+}
+
+// element:attr(name) returns the value or nil
+static int element_attr(lua_State *L) {
+    const XMLElement *e = checkelement(L, 1);
+    const char *v = e->Attribute(luaL_checkstring(L, 2));
+    if (v == NULL)
+	return 0;
+    lua_pushstring(L, v);
+    return 1;
+}
+
+// element:attrs() returns a table of name -> value
+static int element_attrs(lua_State *L) {
+    const XMLElement *e = checkelement(L, 1);
+    lua_newtable(L);
+    for (const tinyxml2::XMLAttribute *a = e->FirstAttribute(); a; a = a->Next()) {
+	lua_pushstring(L, a->Value());
+	lua_setfield(L, -2, a->Name());
+    }
+    return 1;
+}
+
+// element:child([name]) returns the first child element, nil if none
+static int element_child(lua_State *L) {
+    const XMLElement *e = checkelement(L, 1);
+    const char *name = luaL_optstring(L, 2, NULL);
+    lxml_document *d = element_doc(L);
+    return push_element(L, lua_gettop(L), d, e->FirstChildElement(name));
+}
+
+// element:next([name]) returns the next sibling element, nil if none
+static int element_next(lua_State *L) {
+    const XMLElement *e = checkelement(L, 1);
+    const char *name = luaL_optstring(L, 2, NULL);
+    lxml_document *d = element_doc(L);
+    return push_element(L, lua_gettop(L), d, e->NextSiblingElement(name));
+}
+
+static int element_parent(lua_State *L) {
+    const XMLElement *e = checkelement(L, 1);
+    lxml_document *d = element_doc(L);
+    const XMLNode *p = e->Parent();
+    return push_element(L, lua_gettop(L), d, p ? p->ToElement() : NULL);
+}
+
+static int children_iter(lua_State *L) {
+    const XMLElement *e = (const XMLElement *)lua_touserdata(L, lua_upvalueindex(3));
+    if (e == NULL)
+	return 0;
+    lxml_document *d = (lxml_document *)lua_touserdata(L, lua_upvalueindex(1));
+    if (d->gen != (unsigned)lua_tointeger(L, lua_upvalueindex(4)))
+	luaL_error(L, "stale element, its document was reloaded");
+    const char *name = lua_tostring(L, lua_upvalueindex(2));
+    lua_pushlightuserdata(L, (void *)e->NextSiblingElement(name));
+    lua_replace(L, lua_upvalueindex(3));
+    return push_element(L, lua_upvalueindex(1), d, e);
+}
+
+// for child in element:children([name]) do ... end
+static int element_children(lua_State *L) {
+    const XMLElement *e = checkelement(L, 1);
+    const char *name = luaL_optstring(L, 2, NULL);
+    lxml_document *d = element_doc(L); // 1
+    lua_pushvalue(L, 2); // 2
+    lua_pushlightuserdata(L, (void *)e->FirstChildElement(name)); // 3
+    lua_pushinteger(L, d->gen); // 4
+    lua_pushcclosure(L, children_iter, 4);
+    return 1;
+}
+
+static int element_eq(lua_State *L) {
+    lua_pushboolean(L, checkelement(L, 1) == checkelement(L, 2));
+    return 1;
+}
+
+static int element_asstr(lua_State *L) {
+    const XMLElement *e = checkelement(L, 1);
+    lua_pushfstring(L, "XML element <%s>", e->Name());
+    return 1;
+}
+
+//////////////////////////////
+
+#define BATCH 64 // files per thread between calls to the sink
+
+// values of one file, for each selector
+typedef struct xml_row {
+    std::vector<std::vector<std::string> > values;
+    const char *error; // what failed, NULL if parsed
+} xml_row;
+
+// parses paths[first...first+n) on up to threads workers, each reusing
+// its own document
+static void extract_batch(const std::vector<const char *> &paths, size_t first, size_t n,
+	const std::vector<const xml_selector *> &sels, std::vector<lxml_document *> &docs, std::vector<xml_row> &rows) {
+    std::atomic<size_t> next(0);
+    auto work = [&](size_t w) {
+	lxml_document *d = docs[w];
+	std::vector<const XMLElement *> path;
+	size_t i;
+	while ((i = next++) < n) {
+	    xml_row &row = rows[i];
+	    try {
+		row.values.resize(sels.size());
+		row.error = doc_open(d, paths[first + i]);
+		if (row.error == NULL && d->doc.Error())
+		    row.error = "parse";
+		for (size_t k = 0; row.error == NULL && k < sels.size(); k++) {
+		    row.values[k].clear();
+		    dom_select(d->doc.RootElement(), sels[k], path, row.values[k], sels[k]->all ? (size_t)-1 : 1);
+		}
+	    } catch (const std::bad_alloc &) {
+		row.error = "allocate memory for";
+	    }
+	}
+	doc_unmap(d);
+    };
+    std::vector<std::thread> pool;
+    try {
+	pool.reserve(docs.size());
+	for (size_t w = 1; w < docs.size() && w < n; w++)
+	    pool.emplace_back(work, w);
+    } catch (const std::exception &) {
+	// fewer workers: those started, and this thread, share the batch
+    }
+    work(0);
+    for (auto &t : pool)
+	t.join();
+}
+
+static void push_row(lua_State *L, const std::vector<const xml_selector *> &sels, xml_row &row) {
+    lua_createtable(L, sels.size(), 0);
+    for (size_t k = 0; k < sels.size(); k++) {
+	std::vector<std::string> &v = row.values[k];
+	if (sels[k]->all) {
+	    lua_createtable(L, v.size(), 0);
+	    for (size_t j = 0; j < v.size(); j++) {
+		lua_pushlstring(L, v[j].data(), v[j].size());
+		lua_rawseti(L, -2, j+1);
+	    }
+	    lua_rawseti(L, -2, k+1);
+	} else if (v.size() > 0) {
+	    lua_pushlstring(L, v[0].data(), v[0].size());
+	    lua_rawseti(L, -2, k+1);
+	}
+    }
+}
+
+// results of a batch, handed to push_batch
+typedef struct xml_batch {
+    const std::vector<const char *> *paths;
+    const std::vector<const xml_selector *> *sels;
+    std::vector<xml_row> *rows;
+    size_t first, n, count;
+} xml_batch;
+
+// called protected with batch, sink or nil, errors & rows, so that no
+// error raised here skips the destructors of extract_many
+static int push_batch(lua_State *L) {
+    xml_batch *b = (xml_batch *)lua_touserdata(L, 1);
+    bool sink = !lua_isnil(L, 2);
+    for (size_t i = 0; i < b->n; i++) {
+	xml_row &row = (*b->rows)[i];
+	size_t pos = b->first + i;
+	if (row.error) {
+	    lua_pushfstring(L, "Error trying to %s document: %s\n", row.error, (*b->paths)[pos]);
+	    lua_rawseti(L, 3, pos + 1);
+	} else if (sink) {
+	    lua_pushvalue(L, 2);
+	    push_row(L, *b->sels, row);
+	    lua_call(L, 1, 2);
+	    if (lua_toboolean(L, -2))
+		b->count++;
+	    else { // rejected, as lsql does with nil & a message
+		const char *msg = lua_tostring(L, -1);
+		lua_pushfstring(L, "Error trying to store document: %s: %s\n", (*b->paths)[pos], msg ? msg : "rejected by sink");
+		lua_rawseti(L, 3, pos + 1);
+	    }
+	    lua_pop(L, 2);
+	} else {
+	    push_row(L, *b->sels, row);
+	    lua_rawseti(L, 4, pos + 1);
+	}
+    }
+    return 0;
+}
+
+// extract_many(paths, selectors [, threads [, sink]]) parses the files in
+// paths on a pool of threads & returns rows aligned with paths, each with
+// the value of every selector, nil if not found, or an array of values for
+// selectors compiled with all; errors maps the position of each file that
+// failed to its message. A sink, such as that of an lsql connection, is
+// called with every row in order instead, and the count of rows it accepted
+// is returned; rows it rejects by returning false or nil and a message are
+// listed in errors as well
+static int extract_many(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int hw = std::thread::hardware_concurrency();
+    if (hw < 1)
+	hw = 1;
+    lua_Integer threads = luaL_optinteger(L, 3, hw);
+    bool sink = !lua_isnoneornil(L, 4);
+    if (sink)
+	luaL_checktype(L, 4, LUA_TFUNCTION);
+    lua_settop(L, 4);
+
+    // every Lua error up to the block below is raised before any C++ object exists
+    size_t i, N = luaL_len(L, 1), K = luaL_len(L, 2);
+    if (threads > 4 * hw)
+	threads = 4 * hw;
+    if (threads > (lua_Integer)N)
+	threads = N;
+    if (threads < 1)
+	threads = 1;
+    for (i = 1; i <= N; i++) {
+	int t = lua_rawgeti(L, 1, i);
+	lua_pop(L, 1);
+	if (t != LUA_TSTRING)
+	    luaL_error(L, "path expected at position %d", (int)i);
+    }
+    lua_createtable(L, K, 0); // 5: selectors, compiled
+    for (i = 1; i <= K; i++) {
+	lua_rawgeti(L, 2, i);
+	toselector(L, lua_gettop(L));
+	lua_rawseti(L, 5, i);
+    }
+    lua_newtable(L); // 6: errors
+    lua_createtable(L, sink ? 0 : N, 0); // 7: rows
+    luaL_checkstack(L, 8, NULL);
+
+    int rc = LUA_OK;
+    char failure[128] = "";
+    size_t count = 0;
+    { // C++ state, gone before any error is raised
+	std::vector<const char *> paths;
+	std::vector<const xml_selector *> sels;
+	std::vector<lxml_document *> docs;
+	std::vector<xml_row> rows;
+	try {
+	    for (i = 1; i <= N; i++) {
+		lua_rawgeti(L, 1, i);
+		paths.push_back(lua_tostring(L, -1)); // anchored in paths
+		lua_pop(L, 1);
+	    }
+	    for (i = 1; i <= K; i++) {
+		lua_rawgeti(L, 5, i);
+		sels.push_back((const xml_selector *)lua_touserdata(L, -1));
+		lua_pop(L, 1);
+	    }
+	    for (int w = 0; w < threads; w++) {
+		lxml_document *d = new lxml_document();
+		d->map = NULL;
+		d->maplen = 0;
+		d->gen = 0;
+		docs.push_back(d);
+	    }
+	    size_t batch = BATCH * threads;
+	    for (size_t first = 0; first < N && rc == LUA_OK; first += batch) {
+		xml_batch b = {&paths, &sels, &rows, first, N - first < batch ? N - first : batch, 0};
+		rows.resize(b.n);
+		extract_batch(paths, first, b.n, sels, docs, rows);
+		lua_pushcfunction(L, push_batch);
+		lua_pushlightuserdata(L, &b);
+		if (sink)
+		    lua_pushvalue(L, 4);
+		else
+		    lua_pushnil(L);
+		lua_pushvalue(L, 6);
+		lua_pushvalue(L, 7);
+		rc = lua_pcall(L, 4, 0, 0);
+		count += b.count;
+	    }
+	} catch (const std::exception &e) {
+	    snprintf(failure, sizeof(failure), "extract_many: %s", e.what());
+	}
+	for (size_t w = 0; w < docs.size(); w++)
+	    delete docs[w];
+    }
+    if (failure[0])
+	luaL_error(L, "%s", failure);
+    if (rc != LUA_OK) // from the sink or out of memory
+	return lua_error(L);
+
+    if (sink)
+	lua_pushinteger(L, count);
+    else
+	lua_pushvalue(L, 7);
+    lua_pushvalue(L, 6);
+    return 2;
+}
+
+//////////////////////////////
 
 static const struct luaL_Reg xml_funcs[] = {
   {"parse", parseDoc},
+  {"open", open_reader},
+  {"reader", string_reader},
+  {"select", compile_selector},
+  {"document", new_document},
+  {"extract_many", extract_many},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg reader_meths[] = {
+  {"next", reader_next},
+  {"events", reader_events},
+  {"select", reader_select},
+  {"depth", reader_depth},
+  {"path", reader_path},
+  {"close", reader_close},
+  {"__gc", reader_gc},
+  {"__tostring", reader_asstr},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg document_meths[] = {
+  {"load", doc_load},
+  {"parse", doc_parse},
+  {"root", doc_root},
+  {"select", doc_select},
+  {"clear", doc_clear},
+  {"__gc", doc_gc},
+  {"__tostring", doc_asstr},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg element_meths[] = {
+  {"name", element_name},
+  {"text", element_gettext},
+  {"attr", element_attr},
+  {"attrs", element_attrs},
+  {"child", element_child},
+  {"next", element_next},
+  {"parent", element_parent},
+  {"children", element_children},
+  {"__eq", element_eq},
+  {"__tostring", element_asstr},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg selector_meths[] = {
+  {"__gc", selector_gc},
+  {"__tostring", selector_asstr},
   {NULL, NULL}
 };
 
 
 int luaopen_lxml (lua_State *L) {
+  // streaming reader & selectors
+  luaL_newmetatable(L, "caap.xml.reader");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, reader_meths, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "caap.xml.selector");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, selector_meths, 0);
+  lua_pop(L, 1);
+
+  // reusable documents & their elements
+  luaL_newmetatable(L, "caap.xml.document");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, document_meths, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "caap.xml.element");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, element_meths, 0);
+  lua_pop(L, 1);
+
   // create the library
   luaL_newlib(L, xml_funcs);
   return 1;
@@ -51,4 +868,3 @@ int luaopen_lxml (lua_State *L) {
 }
 #endif
 
-
@@ -1999,6 +1999,8 @@ XMLDocument::XMLDocument( bool processEntities, Whitespace whitespaceMode ) :
     _errorStr(),
     _errorLineNum( 0 ),
     _charBuffer( 0 ),
+    _ownBuffer( 0 ),
+    _ownSize( 0 ),
     _parseCurLineNum( 0 ),
     _unlinked(),
     _elementPool(),
@@ -2014,6 +2016,19 @@ XMLDocument::XMLDocument( bool processEntities, Whitespace whitespaceMode ) :
 XMLDocument::~XMLDocument()
 {
     Clear();
+    delete [] _ownBuffer;
+}
+
+
+// caap: the buffer of the previous parse is reused when large enough
+char* XMLDocument::CharBuffer( size_t size )
+{
+    if ( size > _ownSize ) {
+        delete [] _ownBuffer;
+        _ownBuffer = new char[size];
+        _ownSize = size;
+    }
+    return _ownBuffer;
 }
 
 
@@ -2042,7 +2057,6 @@ void XMLDocument::Clear()
 #endif
     ClearError();
 
-    delete [] _charBuffer;
     _charBuffer = 0;
 
 #if 0
@@ -2217,7 +2231,7 @@ XMLError XMLDocument::LoadFile( FILE* fp )
 
     const size_t size = filelength;
     TIXMLASSERT( _charBuffer == 0 );
-    _charBuffer = new char[size+1];
+    _charBuffer = CharBuffer( size+1 );
     size_t read = fread( _charBuffer, 1, size, fp );
     if ( read != size ) {
         SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
@@ -2267,10 +2281,30 @@ XMLError XMLDocument::Parse( const char* p, size_t len )
         len = strlen( p );
     }
     TIXMLASSERT( _charBuffer == 0 );
-    _charBuffer = new char[ len+1 ];
+    _charBuffer = CharBuffer( len+1 );
     memcpy( _charBuffer, p, len );
     _charBuffer[len] = 0;
 
+    return ParseBuffer();
+}
+
+
+XMLError XMLDocument::ParseInSitu( char* p, size_t len )
+{
+    Clear();
+
+    if ( len == 0 || !p || !*p ) {
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
+        return _errorID;
+    }
+    TIXMLASSERT( p[len] == 0 );
+    _charBuffer = p;
+    return ParseBuffer();
+}
+
+
+XMLError XMLDocument::ParseBuffer()
+{
     Parse();
     if ( Error() ) {
         // clean up now essentially dangling memory.
@@ -1668,6 +1668,13 @@ public:
     */
     XMLError Parse( const char* xml, size_t nBytes=(size_t)(-1) );
 
+    /**
+    	Parse the writable buffer 'xml' of 'nBytes' in place, without a
+    	copy; xml[nBytes] must be 0 and the buffer must outlive the nodes,
+    	until the next Clear() or parse. (caap: added to parse mapped files)
+    */
+    XMLError ParseInSitu( char* xml, size_t nBytes );
+
     /**
     	Load an XML file from disk.
     	Returns XML_SUCCESS (0) on success, or
@@ -1858,6 +1865,8 @@ private:
     mutable StrPair	_errorStr;
     int             _errorLineNum;
     char*			_charBuffer;
+    char*			_ownBuffer;		// caap: kept across parses, reused when large enough
+    size_t			_ownSize;
     int				_parseCurLineNum;
 	// Memory tracking does add some overhead.
 	// However, the code assumes that you don't
@@ -1875,6 +1884,8 @@ private:
 	static const char* _errorNames[XML_ERROR_COUNT];
 
     void Parse();
+    XMLError ParseBuffer();
+    char* CharBuffer( size_t size );
 
     void SetError( XMLError error, int lineNum, const char* format, ... );
 
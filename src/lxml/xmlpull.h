@@ -0,0 +1,501 @@
+#ifndef XMLPULL_H
+#define XMLPULL_H
+
+// Streaming pull parser & path selectors, independent of Lua.
+//
+// A file is read in chunks and a string is read in place, so memory is
+// bounded by the largest token plus the path to the current element.
+// Entities are decoded; comments, processing instructions & DOCTYPE are
+// skipped, and whitespace-only text is not reported.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+enum xml_events {XML_EOF, XML_START, XML_ATTR, XML_TEXT, XML_END, XML_ERROR};
+
+#define XML_CHUNK 65536
+
+struct xml_attr {
+    std::string name, value;
+};
+
+struct xml_pull {
+    FILE *f; // NULL when reading a string
+    const char *src; // string being read
+    size_t srclen;
+    std::string buf; // unread data of f is buf[pos...]
+    size_t pos, chunk;
+
+    std::string path; // names of the open elements, separated by '/'
+    std::vector<size_t> marks; // start of each name in path
+    std::vector<xml_attr> attrs; // of the last start tag
+    size_t nattrs, next_attr; // attrs in use, next to report
+    bool empty; // last start tag was self-closing, its end is due
+
+    std::string name, value; // of the current event
+    std::string error;
+
+    xml_pull() : f(NULL), src(NULL), srclen(0), pos(0), chunk(XML_CHUNK), nattrs(0), next_attr(0), empty(false) {}
+    ~xml_pull() { close(); }
+
+    bool open(const char *fname) {
+	close();
+	f = fopen(fname, "rb");
+	return f != NULL;
+    }
+
+    void open(const char *s, size_t len) {
+	close();
+	src = s;
+	srclen = len;
+    }
+
+    void close() {
+	if (f)
+	    fclose(f);
+	f = NULL;
+	src = NULL;
+	srclen = pos = 0;
+	buf.clear();
+	path.clear();
+	marks.clear();
+	nattrs = next_attr = 0;
+	empty = false;
+	error.clear();
+    }
+
+    int depth() const { return (int)marks.size(); }
+
+    // name of the open element at level i, from 0
+    const char *level(size_t i, size_t *len) const {
+	size_t end = i + 1 < marks.size() ? marks[i+1] - 1 : path.size();
+	*len = end - marks[i];
+	return path.data() + marks[i];
+    }
+
+    // value of attribute k of the current element, NULL if absent
+    const std::string *attr(const std::string &k) const {
+	for (size_t i = 0; i < nattrs; i++)
+	    if (attrs[i].name == k)
+		return &attrs[i].value;
+	return NULL;
+    }
+
+    // next event; name & value hold its data
+    int next() {
+	if (!error.empty())
+	    return XML_ERROR;
+	if (next_attr < nattrs) {
+	    name = attrs[next_attr].name;
+	    value = attrs[next_attr++].value;
+	    return XML_ATTR;
+	}
+	if (empty) {
+	    empty = false;
+	    return pop();
+	}
+
+	for (;;) {
+	    if (!fill(1))
+		return marks.empty() ? XML_EOF : fail("unexpected end of document");
+	    const char *p = data();
+	    if (*p != '<') {
+		size_t n = find(0, "<", 1);
+		if (n == npos) {
+		    if (!marks.empty())
+			return fail("unexpected end of document");
+		    n = avail();
+		}
+		bool blank = true; // text outside the root is ignored too
+		p = data();
+		for (size_t i = 0; i < n && blank; i++)
+		    blank = p[i] == ' ' || p[i] == '\t' || p[i] == '\n' || p[i] == '\r';
+		blank = blank || marks.empty();
+		if (!blank)
+		    decode(p, n, value);
+		skip(n);
+		if (blank)
+		    continue;
+		return XML_TEXT;
+	    }
+
+	    fill(9);
+	    if (starts("<?"))
+		drop(2, "?>", "unterminated processing instruction");
+	    else if (starts("<!--"))
+		drop(4, "-->", "unterminated comment");
+	    else if (starts("<![CDATA[")) {
+		size_t n = find(9, "]]>", 3);
+		if (n == npos)
+		    return fail("unterminated CDATA section");
+		value.assign(data() + 9, n - 9);
+		skip(n + 3);
+		return XML_TEXT;
+	    } else if (starts("<!")) {
+		size_t n = tag_end(2, true);
+		if (n == npos)
+		    return fail("unterminated declaration");
+		skip(n + 1);
+	    } else if (starts("</")) {
+		size_t n = find(2, ">", 1);
+		if (n == npos)
+		    return fail("unterminated end tag");
+		p = data();
+		size_t k = 2, e = n;
+		while (e > k && is_space(p[e-1]))
+		    e--;
+		size_t len, top = marks.size();
+		const char *open = top ? level(top - 1, &len) : NULL;
+		if (open == NULL || len != e - k || memcmp(open, p + k, len)) {
+		    error = "mismatched end tag </" + std::string(p + k, e - k) + ">";
+		    return XML_ERROR;
+		}
+		skip(n + 1);
+		return pop();
+	    } else
+		return start_tag();
+	    if (!error.empty())
+		return XML_ERROR;
+	}
+    }
+
+  private:
+    static const size_t npos = (size_t)-1;
+
+    const char *data() const { return f ? buf.data() + pos : src + pos; }
+    size_t avail() const { return f ? buf.size() - pos : srclen - pos; }
+    void skip(size_t n) { pos += n; }
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+    bool starts(const char *s) const {
+	size_t n = strlen(s);
+	return avail() >= n && !memcmp(data(), s, n);
+    }
+
+    // reads more of the file; false at its end
+    bool more() {
+	if (f == NULL)
+	    return false;
+	if (pos > 0) {
+	    buf.erase(0, pos);
+	    pos = 0;
+	}
+	size_t n = buf.size();
+	buf.resize(n + chunk);
+	size_t k = fread(&buf[n], 1, chunk, f);
+	buf.resize(n + k);
+	return k > 0;
+    }
+
+    // at least n bytes available, if the input has them
+    bool fill(size_t n) {
+	while (avail() < n)
+	    if (!more())
+		return false;
+	return true;
+    }
+
+    // offset of s from data() + from, reading as needed
+    size_t find(size_t from, const char *s, size_t n) {
+	for (;;) {
+	    if (avail() >= from + n) {
+		const char *p = (const char *)memmem(data() + from, avail() - from, s, n);
+		if (p)
+		    return p - data();
+		from = avail() - n + 1;
+	    }
+	    if (!more())
+		return npos;
+	}
+    }
+
+    // offset of the '>' closing a tag, ignoring those in quoted values;
+    // decl also skips bracketed internal subsets
+    size_t tag_end(size_t from, bool decl) {
+	char quote = 0;
+	int nest = 0;
+	for (size_t i = from;; i++) {
+	    if (i >= avail() && !more())
+		return npos;
+	    char c = data()[i];
+	    if (quote)
+		quote = c == quote ? 0 : quote;
+	    else if (c == '"' || c == '\'')
+		quote = c;
+	    else if (decl && c == '[')
+		nest++;
+	    else if (decl && c == ']')
+		nest--;
+	    else if (c == '>' && nest <= 0)
+		return i;
+	}
+    }
+
+    void drop(size_t from, const char *end, const char *msg) {
+	size_t n = find(from, end, strlen(end));
+	if (n == npos)
+	    error = msg;
+	else
+	    skip(n + strlen(end));
+    }
+
+    int fail(const char *msg) {
+	error = msg;
+	return XML_ERROR;
+    }
+
+    int pop() {
+	size_t len;
+	const char *s = level(marks.size() - 1, &len);
+	name.assign(s, len);
+	path.resize(marks.back() ? marks.back() - 1 : 0);
+	marks.pop_back();
+	return XML_END;
+    }
+
+    int start_tag() {
+	size_t n = tag_end(1, false);
+	if (n == npos)
+	    return fail("unterminated start tag");
+	const char *p = data(), *e = p + n;
+	if (e[-1] == '/' && n > 1) {
+	    empty = true;
+	    e--;
+	}
+
+	const char *s = ++p;
+	while (p < e && !is_space(*p))
+	    p++;
+	if (p == s)
+	    return fail("missing element name");
+	name.assign(s, p - s);
+
+	nattrs = next_attr = 0;
+	for (;;) {
+	    while (p < e && is_space(*p))
+		p++;
+	    if (p == e)
+		break;
+	    s = p;
+	    while (p < e && *p != '=' && !is_space(*p))
+		p++;
+	    const char *ke = p;
+	    while (p < e && is_space(*p))
+		p++;
+	    if (p == e || *p != '=')
+		return fail("malformed attribute");
+	    p++;
+	    while (p < e && is_space(*p))
+		p++;
+	    if (p == e || (*p != '"' && *p != '\''))
+		return fail("unquoted attribute value");
+	    char q = *p++;
+	    const char *v = p;
+	    while (p < e && *p != q)
+		p++;
+	    if (p == e)
+		return fail("malformed attribute");
+	    if (nattrs == attrs.size())
+		attrs.push_back(xml_attr());
+	    attrs[nattrs].name.assign(s, ke - s);
+	    decode(v, p - v, attrs[nattrs++].value);
+	    p++;
+	}
+
+	marks.push_back(marks.empty() ? 0 : path.size() + 1);
+	if (marks.size() > 1)
+	    path += '/';
+	path += name;
+	skip(n + 1);
+	return XML_START;
+    }
+
+    static void put_utf8(std::string &out, uint32_t cp) {
+	if (cp < 0x80)
+	    out += (char)cp;
+	else if (cp < 0x800) {
+	    out += (char)(0xc0 | (cp >> 6));
+	    out += (char)(0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+	    out += (char)(0xe0 | (cp >> 12));
+	    out += (char)(0x80 | ((cp >> 6) & 0x3f));
+	    out += (char)(0x80 | (cp & 0x3f));
+	} else {
+	    out += (char)(0xf0 | (cp >> 18));
+	    out += (char)(0x80 | ((cp >> 12) & 0x3f));
+	    out += (char)(0x80 | ((cp >> 6) & 0x3f));
+	    out += (char)(0x80 | (cp & 0x3f));
+	}
+    }
+
+  public:
+    // s with its entities replaced; unknown entities are kept as they are
+    static void decode(const char *s, size_t n, std::string &out) {
+	const char *e = s + n, *amp;
+	out.clear();
+	while ((amp = (const char *)memchr(s, '&', e - s)) != NULL) {
+	    out.append(s, amp - s);
+	    const char *semi = (const char *)memchr(amp, ';', e - amp);
+	    size_t k = semi ? semi - amp - 1 : 0;
+	    const char *ent = amp + 1;
+	    s = semi ? semi + 1 : amp + 1;
+	    if (k == 2 && !memcmp(ent, "lt", 2)) out += '<';
+	    else if (k == 2 && !memcmp(ent, "gt", 2)) out += '>';
+	    else if (k == 3 && !memcmp(ent, "amp", 3)) out += '&';
+	    else if (k == 4 && !memcmp(ent, "quot", 4)) out += '"';
+	    else if (k == 4 && !memcmp(ent, "apos", 4)) out += '\'';
+	    else if (k > 1 && k < 10 && ent[0] == '#') {
+		char num[12];
+		memcpy(num, ent + 1, k - 1);
+		num[k-1] = 0;
+		char *end;
+		unsigned long cp = num[0] == 'x' ? strtoul(num + 1, &end, 16) : strtoul(num, &end, 10);
+		if (*end == 0 && cp > 0 && cp < 0x110000)
+		    put_utf8(out, (uint32_t)cp);
+		else
+		    out.append(amp, s - amp);
+	    } else {
+		out += '&';
+		s = amp + 1;
+	    }
+	}
+	out.append(s, e - s);
+    }
+};
+
+/* ================================================== */
+
+// a/b/c names the element c within b within the root a, a/b/c@k its
+// attribute k; "//" in front matches the path at any depth, and "*" any
+// single name. An element selects its text, that of descendants included.
+struct xml_selector {
+    std::vector<std::string> steps;
+    std::string attr; // empty for text
+    bool anchored;
+    bool all; // every value selected, else the first, when extracting
+
+    xml_selector() : anchored(true), all(false) {}
+
+    // compiles s, or returns the reason it is not a selector
+    const char *compile(const char *s, size_t len) {
+	const char *e = s + len, *at = (const char *)memchr(s, '@', len);
+	steps.clear();
+	attr.clear();
+	anchored = true;
+	if (len >= 2 && s[0] == '/' && s[1] == '/') {
+	    anchored = false;
+	    s += 2;
+	} else if (len >= 1 && s[0] == '/')
+	    s++;
+	if (at) {
+	    attr.assign(at + 1, e - at - 1);
+	    if (attr.empty() || attr.find_first_of("/@") != std::string::npos)
+		return "bad attribute name";
+	    e = at;
+	}
+	while (s < e) {
+	    const char *p = (const char *)memchr(s, '/', e - s);
+	    if (p == NULL)
+		p = e;
+	    if (p == s)
+		return "empty step";
+	    steps.push_back(std::string(s, p - s));
+	    s = p < e ? p + 1 : p;
+	    if (p + 1 == e)
+		return "empty step";
+	}
+	return steps.empty() ? "empty path" : NULL;
+    }
+
+    // whether an element at depth d is selected, level(i, &len) naming its
+    // ancestors from the root at 0
+    template <class F> bool match(size_t d, F level) const {
+	size_t n = steps.size(), i;
+	if (d < n || (anchored && d != n))
+	    return false;
+	for (i = 0; i < n; i++) {
+	    const std::string &s = steps[n - 1 - i];
+	    size_t len;
+	    const char *name = level(d - 1 - i, &len);
+	    if (!(s.size() == 1 && s[0] == '*') && (s.size() != len || memcmp(s.data(), name, len)))
+		return false;
+	}
+	return true;
+    }
+
+    // whether the element just opened in x is selected
+    bool match(const xml_pull &x) const {
+	return match(x.marks.size(), [&x](size_t i, size_t *len) { return x.level(i, len); });
+    }
+};
+
+// evaluates selectors over the events of a pull parser, producing every
+// selected value with the index of its selector
+struct xml_select {
+    struct capture {
+	size_t sel;
+	int depth;
+	std::string text;
+    };
+    std::vector<capture> open; // elements whose text is being read
+    std::vector<std::pair<size_t, std::string> > ready;
+    size_t head;
+
+    xml_select() : head(0) {}
+
+    void reset() {
+	open.clear();
+	ready.clear();
+	head = 0;
+    }
+
+    // next value into k & value: XML_TEXT, or XML_EOF or XML_ERROR
+    int next(xml_pull &x, const xml_selector *const *sels, size_t n, size_t *k, std::string &value) {
+	while (head == ready.size()) {
+	    ready.clear();
+	    head = 0;
+	    int ev = x.next();
+	    size_t i;
+	    switch (ev) {
+	    case XML_EOF:
+	    case XML_ERROR:
+		return ev;
+	    case XML_START:
+		x.next_attr = x.nattrs; // read here, not as events
+		for (i = 0; i < n; i++) {
+		    if (!sels[i]->match(x))
+			continue;
+		    if (sels[i]->attr.empty()) {
+			capture c = {i, x.depth(), std::string()};
+			open.push_back(c);
+		    } else {
+			const std::string *v = x.attr(sels[i]->attr);
+			if (v)
+			    ready.push_back(std::make_pair(i, *v));
+		    }
+		}
+		break;
+	    case XML_TEXT:
+		for (i = 0; i < open.size(); i++)
+		    open[i].text += x.value;
+		break;
+	    case XML_END:
+		while (!open.empty() && open.back().depth > x.depth()) {
+		    ready.push_back(std::make_pair(open.back().sel, std::string()));
+		    ready.back().second.swap(open.back().text);
+		    open.pop_back();
+		}
+		break;
+	    }
+	}
+	*k = ready[head].first;
+	value.swap(ready[head++].second);
+	return XML_TEXT;
+    }
+};
+
+#endif
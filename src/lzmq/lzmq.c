@@ -8,6 +8,8 @@
 #include <zmq.h>
 #include <errno.h>
 
+#include "mpack_buffer.h"
+
 #define randof(num) (int)((float)(num)*rand()/(RAND_MAX+1.0))
 
 static void *CTX;
@@ -266,6 +268,11 @@ static int send_msg(lua_State *L, void *skt, int idx, int flags) {
     size_t len = 0;
     zmq_msg_t msg;
 
+    // buffers are reused by the caller, so their bytes are copied
+    mpack_buffer *b = (mpack_buffer *)luaL_testudata(L, idx, MPACK_BUFFER);
+    if (b != NULL)
+	return zmq_send( skt, b->data, b->len, flags );
+
     const char *data = luaL_checklstring(L, idx, &len);
 
     int rc = zmq_msg_init_data( &msg, (void *)data, len, NULL, NULL );
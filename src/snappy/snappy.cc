@@ -2,33 +2,609 @@
 #include <snappy.h>
 
 #include <string>
+#include <new>
+#include <vector>
+#include <thread>
+#include <atomic>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "mpack_buffer.h"
+
+#define checkencoder(L) (lsnap_encoder *)luaL_checkudata(L, 1, "caap.snappy.encoder")
+#define checkdecoder(L) (lsnap_decoder *)luaL_checkudata(L, 1, "caap.snappy.decoder")
+
+// framing format, see snappy's framing_format.txt
+#define MAXCHUNK 65536
+#define STREAMID "\xff\x06\x00\x00sNaPpY"
+
+// parallel block container: header, index & independent compressed blocks
+#define BLOCKMAGIC "sNpB"
+#define BLOCKHDR 20 // magic, u32 block size, u32 count, u64 total length
+#define BLOCKIDX 16 // u64 offset from the start of the data, u32 length, u32 masked crc
+#define MAXEXPAND 22 // snappy output per input byte: a 3-byte copy yields at most 64
+
+enum chunk_types {COMPRESSED = 0x00, UNCOMPRESSED = 0x01, PADDING = 0xfe, IDENTIFIER = 0xff};
+
+typedef struct lsnap_encoder {
+    int started; // stream identifier already emitted
+    std::string pending; // less than MAXCHUNK bytes
+} lsnap_encoder;
+
+typedef struct lsnap_decoder {
+    int started;
+    std::string pending; // incomplete chunk
+} lsnap_decoder;
+
+//////////////////////////////
+
+// CRC-32C (Castagnoli), reflected, byte-wise table
+static uint32_t CRCTABLE[256];
+
+static void crc32c_init() {
+    uint32_t i, k, c;
+    for (i = 0; i < 256; i++) {
+	c = i;
+	for (k = 0; k < 8; k++)
+	    c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+	CRCTABLE[i] = c;
+    }
+}
+
+static uint32_t crc32c(const char *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t c = 0xFFFFFFFF;
+    while (len--)
+	c = CRCTABLE[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+static uint32_t masked_crc(const char *data, size_t len) {
+    uint32_t c = crc32c(data, len);
+    return ((c >> 15) | (c << 17)) + 0xa282ead8;
+}
+
+static void put_le(char *p, uint32_t x, int n) {
+    int i;
+    for (i = 0; i < n; i++, x >>= 8)
+	p[i] = (char)(x & 0xff);
+}
+
+static uint32_t get_le(const char *p, int n) {
+    uint32_t x = 0;
+    int i;
+    for (i = n-1; i >= 0; i--)
+	x = (x << 8) | (uint8_t)p[i];
+    return x;
+}
+
+// string or lmpack.buffer
+static const char *checkbytes(lua_State *L, int k, size_t *len) {
+    mpack_buffer *b = (mpack_buffer *)luaL_testudata(L, k, MPACK_BUFFER);
+    if (b != NULL) {
+	*len = b->len;
+	return b->data ? b->data : "";
+    }
+    return luaL_checklstring(L, k, len);
+}
+
+// appends one frame (header, checksum & data) for a chunk of at most MAXCHUNK bytes
+static void add_chunk(luaL_Buffer *B, const char *data, size_t len) {
+    char *out = luaL_prepbuffsize(B, 8 + snappy::MaxCompressedLength(len));
+    size_t N;
+    snappy::RawCompress(data, len, out + 8, &N);
+    if (N >= len) { // incompressible
+	out[0] = UNCOMPRESSED;
+	memcpy(out + 8, data, len);
+	N = len;
+    } else
+	out[0] = COMPRESSED;
+    put_le(out + 1, N + 4, 3);
+    put_le(out + 4, masked_crc(data, len), 4);
+    luaL_addsize(B, N + 8);
+}
 
 //////////////////////////////
 
 static int compress(lua_State *L) {
-    const char* input = luaL_checkstring(L, 1);
-    std::string output;
+    size_t len;
+    const char *input = checkbytes(L, 1, &len);
+    luaL_Buffer b;
+
+    char *output = luaL_buffinitsize(L, &b, snappy::MaxCompressedLength(len));
+    size_t N;
+    snappy::RawCompress(input, len, output, &N);
+
+    luaL_pushresultsize(&b, N);
+    return 1;
+}
+
+static int uncompress(lua_State *L) {
+    size_t len, N;
+    const char *input = luaL_checklstring(L, 1, &len);
+    luaL_Buffer b;
+
+    // validated before allocating, the length header alone can claim ~4GB
+    if (!snappy::GetUncompressedLength(input, len, &N) || !snappy::IsValidCompressedBuffer(input, len)) {
+	lua_pushnil(L);
+	lua_pushliteral(L, "ERROR: invalid compressed data");
+	return 2;
+    }
+
+    char *output = luaL_buffinitsize(L, &b, N);
+    if (!snappy::RawUncompress(input, len, output)) {
+	lua_pushnil(L);
+	lua_pushliteral(L, "ERROR: corrupt compressed data");
+	return 2;
+    }
+
+    luaL_pushresultsize(&b, N);
+    return 1;
+}
+
+// compress_into(buffer, data): appends compressed data to an lmpack.buffer,
+// returns the number of bytes written
+static int compress_into(lua_State *L) {
+    mpack_buffer *b = (mpack_buffer *)luaL_checkudata(L, 1, MPACK_BUFFER);
+    size_t len;
+    const char *input = checkbytes(L, 2, &len);
+
+    if (mpack_buffer_reserve(b, snappy::MaxCompressedLength(len)) == -1)
+	luaL_error(L, "out of memory while compressing %d bytes", (int)len);
+
+    size_t N;
+    snappy::RawCompress(input, len, b->data + b->len, &N);
+    b->len += N;
+
+    lua_pushinteger(L, N);
+    return 1;
+}
+
+//////////////////////////////
+
+static int new_encoder(lua_State *L) {
+    lsnap_encoder *e = (lsnap_encoder *)lua_newuserdata(L, sizeof(lsnap_encoder));
+    new (e) lsnap_encoder();
+    luaL_setmetatable(L, "caap.snappy.encoder");
+    return 1;
+}
+
+// encoder:write(data) returns the frames of every complete chunk, possibly
+// an empty string; the remainder is kept until the next write or flush
+static int encoder_write(lua_State *L) {
+    lsnap_encoder *e = checkencoder(L);
+    size_t len;
+    const char *data = checkbytes(L, 2, &len);
+    luaL_Buffer B;
+
+    luaL_buffinit(L, &B);
+    if (!e->started) {
+	luaL_addlstring(&B, STREAMID, 10);
+	e->started = 1;
+    }
+
+    if (e->pending.size() > 0) {
+	size_t k = MAXCHUNK - e->pending.size();
+	if (len < k) {
+	    e->pending.append(data, len);
+	    luaL_pushresult(&B);
+	    return 1;
+	}
+	e->pending.append(data, k);
+	add_chunk(&B, e->pending.data(), MAXCHUNK);
+	e->pending.clear();
+	data += k;
+	len -= k;
+    }
+
+    for (; len >= MAXCHUNK; data += MAXCHUNK, len -= MAXCHUNK)
+	add_chunk(&B, data, MAXCHUNK);
+    e->pending.assign(data, len);
+
+    luaL_pushresult(&B);
+    return 1;
+}
+
+// encoder:flush() returns the frame of the pending data
+static int encoder_flush(lua_State *L) {
+    lsnap_encoder *e = checkencoder(L);
+    luaL_Buffer B;
+
+    luaL_buffinit(L, &B);
+    if (!e->started) {
+	luaL_addlstring(&B, STREAMID, 10);
+	e->started = 1;
+    }
+    if (e->pending.size() > 0)
+	add_chunk(&B, e->pending.data(), e->pending.size());
+    e->pending.clear();
+
+    luaL_pushresult(&B);
+    return 1;
+}
+
+static int encoder_gc(lua_State *L) {
+    lsnap_encoder *e = checkencoder(L);
+    e->~lsnap_encoder();
+    return 0;
+}
+
+static int encoder_asstr(lua_State *L) {
+    lsnap_encoder *e = checkencoder(L);
+    lua_pushfstring(L, "SNAPPY encoder (%d bytes pending)", (int)e->pending.size());
+    return 1;
+}
+
+//////////////////////////////
+
+static int new_decoder(lua_State *L) {
+    lsnap_decoder *d = (lsnap_decoder *)lua_newuserdata(L, sizeof(lsnap_decoder));
+    new (d) lsnap_decoder();
+    luaL_setmetatable(L, "caap.snappy.decoder");
+    return 1;
+}
+
+// decoder:feed(frames) returns the data of every complete chunk, possibly
+// an empty string; or nil, an error message & the data of the chunks before
+// the error if the stream is invalid
+static int decoder_feed(lua_State *L) {
+    lsnap_decoder *d = checkdecoder(L);
+    size_t len;
+    const char *data = checkbytes(L, 2, &len);
+    const char *err = NULL;
+    luaL_Buffer B;
+
+    d->pending.append(data, len);
+    const char *p = d->pending.data();
+    size_t M = 0, N = d->pending.size();
 
-    snappy::Compress(input, strlen(input), &output);
+    luaL_buffinit(L, &B);
+    while (N - M >= 4) {
+	const char *q = p + M;
+	uint8_t type = (uint8_t)q[0];
+	size_t clen = get_le(q + 1, 3);
+	if (N - M < 4 + clen)
+	    break;
+	q += 4;
 
-    lua_pushstring(L, output.c_str());
+	if (!d->started && type != IDENTIFIER) { err = "ERROR: missing stream identifier"; break; }
+
+	if (type == IDENTIFIER) {
+	    if (clen != 6 || memcmp(q, "sNaPpY", 6)) { err = "ERROR: invalid stream identifier"; break; }
+	    d->started = 1;
+
+	} else if (type == COMPRESSED || type == UNCOMPRESSED) {
+	    if (clen < 4) { err = "ERROR: chunk too short"; break; }
+	    uint32_t crc = get_le(q, 4);
+	    const char *body = q + 4;
+	    size_t blen = clen - 4, ulen = blen;
+	    char *out;
+
+	    if (type == COMPRESSED) {
+		if (!snappy::GetUncompressedLength(body, blen, &ulen) || ulen > MAXCHUNK) { err = "ERROR: invalid compressed chunk"; break; }
+		out = luaL_prepbuffsize(&B, ulen);
+		if (!snappy::RawUncompress(body, blen, out)) { err = "ERROR: corrupt compressed chunk"; break; }
+	    } else {
+		if (ulen > MAXCHUNK) { err = "ERROR: uncompressed chunk too long"; break; }
+		out = luaL_prepbuffsize(&B, ulen);
+		memcpy(out, body, ulen);
+	    }
+
+	    if (masked_crc(out, ulen) != crc) { err = "ERROR: checksum mismatch"; break; }
+	    luaL_addsize(&B, ulen);
+
+	} else if (type < 0x80) { // reserved unskippable
+	    err = "ERROR: unknown unskippable chunk";
+	    break;
+	} // padding & reserved skippable chunks are ignored
+
+	M += 4 + clen;
+    }
+
+    if (err) {
+	d->pending.clear();
+	luaL_pushresult(&B);
+	lua_pushnil(L);
+	lua_pushstring(L, err);
+	lua_rotate(L, -3, 2); // nil, err, data
+	return 3;
+    }
+
+    d->pending.erase(0, M);
+    luaL_pushresult(&B);
+    return 1;
+}
+
+static int decoder_gc(lua_State *L) {
+    lsnap_decoder *d = checkdecoder(L);
+    d->~lsnap_decoder();
+    return 0;
+}
+
+static int decoder_asstr(lua_State *L) {
+    lsnap_decoder *d = checkdecoder(L);
+    lua_pushfstring(L, "SNAPPY decoder (%d bytes pending)", (int)d->pending.size());
     return 1;
 }
 
+//////////////////////////////
+
+static uint64_t get_le64(const char *p) {
+    return ((uint64_t)get_le(p + 4, 4) << 32) | get_le(p, 4);
+}
+
+static void put_le64(char *p, uint64_t x) {
+    put_le(p, (uint32_t)x, 4);
+    put_le(p + 4, (uint32_t)(x >> 32), 4);
+}
+
+// runs fn(i) for i in [0, N) over a pool of threads; never throws, threads
+// that cannot be started leave their share to the others
+extern "C++" {
+template <class F>
+static void parallel_for(size_t N, int threads, F fn) {
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+	size_t i;
+	while ((i = next++) < N)
+	    fn(i);
+    };
+    if (threads > (int)N)
+	threads = (int)N;
+    std::vector<std::thread> pool;
+    try {
+	pool.reserve(threads);
+	for (int k = 1; k < threads; k++)
+	    pool.emplace_back(work);
+    } catch (const std::exception &) {
+	// std::system_error or std::bad_alloc: go on with fewer threads
+    }
+    work();
+    for (auto &t : pool)
+	t.join();
+}
+}
+
+static int default_threads(lua_State *L, int k) {
+    int threads = luaL_optinteger(L, k, std::thread::hardware_concurrency());
+    return threads < 1 ? 1 : threads;
+}
+
+typedef struct lsnap_blocks {
+    uint32_t bsize, count;
+    uint64_t total;
+    const char *index, *data;
+    size_t len; // of data
+} lsnap_blocks;
+
+// validates header & index; returns an error message or NULL
+static size_t block_length(lsnap_blocks *bk, uint32_t i) {
+    return i + 1 < bk->count ? bk->bsize : bk->total - (uint64_t)bk->bsize * i;
+}
+
+// validates header & index, and that each block's stored length is the one
+// it must have; so total is checked before anything is allocated for it.
+// Returns an error message or NULL
+static const char *read_blocks(const char *src, size_t len, lsnap_blocks *bk) {
+    if (len < BLOCKHDR || memcmp(src, BLOCKMAGIC, 4))
+	return "ERROR: not a block container";
+    bk->bsize = get_le(src + 4, 4);
+    bk->count = get_le(src + 8, 4);
+    bk->total = get_le64(src + 12);
+    if (bk->bsize == 0 || (len - BLOCKHDR) / BLOCKIDX < bk->count
+	    || bk->total > (uint64_t)bk->bsize * bk->count
+	    || (bk->count > 0 && bk->total <= (uint64_t)bk->bsize * (bk->count - 1)))
+	return "ERROR: invalid block container header";
+    bk->index = src + BLOCKHDR;
+    bk->data = bk->index + (size_t)bk->count * BLOCKIDX;
+    bk->len = len - BLOCKHDR - (size_t)bk->count * BLOCKIDX;
+    uint32_t i;
+    for (i = 0; i < bk->count; i++) {
+	const char *q = bk->index + (size_t)i * BLOCKIDX;
+	uint64_t ofs = get_le64(q);
+	size_t blen = get_le(q + 8, 4), ulen;
+	if (ofs > bk->len || blen > bk->len - ofs)
+	    return "ERROR: invalid block index";
+	if (!snappy::GetUncompressedLength(bk->data + ofs, blen, &ulen)
+		|| ulen != block_length(bk, i) || ulen / MAXEXPAND > blen)
+	    return "ERROR: invalid compressed block";
+    }
+    return NULL;
+}
+
+// decompresses block i into out, which has room for block_length(i) bytes
+static int read_block(lsnap_blocks *bk, uint32_t i, char *out) {
+    const char *q = bk->index + (size_t)i * BLOCKIDX;
+    const char *body = bk->data + get_le64(q);
+    size_t blen = get_le(q + 8, 4), ulen;
+    if (!snappy::GetUncompressedLength(body, blen, &ulen) || ulen != block_length(bk, i))
+	return -1;
+    if (!snappy::RawUncompress(body, blen, out))
+	return -1;
+    return masked_crc(out, ulen) == get_le(q + 12, 4) ? 0 : -1;
+}
+
+// compress_parallel(data, block_size, threads): splits data into blocks
+// compressed independently on a pool of threads; the result starts with a
+// header and an index so blocks can be decompressed in any order
+static int compress_parallel(lua_State *L) {
+    size_t len;
+    const char *input = checkbytes(L, 1, &len);
+    lua_Integer bsize = luaL_optinteger(L, 2, 1 << 20);
+    int threads = default_threads(L, 3);
+    luaL_argcheck(L, bsize > 0 && bsize <= 0x7fffffff, 2, "block size out of range");
+
+    size_t N = (len + bsize - 1) / bsize;
+    luaL_argcheck(L, N <= 0xffffffff, 2, "too many blocks");
+    size_t slot = snappy::MaxCompressedLength(bsize);
+
+    // scratch lives in userdata, so that a Lua error leaks nothing
+    char *scratch = (char *)lua_newuserdata(L, N * slot + 1);
+    size_t *sizes = (size_t *)lua_newuserdata(L, N * sizeof(size_t) + 1);
+    uint32_t *crcs = (uint32_t *)lua_newuserdata(L, N * sizeof(uint32_t) + 1);
+
+    parallel_for(N, threads, [&](size_t i) {
+	size_t k = i + 1 < N ? bsize : len - i * bsize;
+	snappy::RawCompress(input + i * bsize, k, scratch + i * slot, &sizes[i]);
+	crcs[i] = masked_crc(input + i * bsize, k);
+    });
+
+    size_t i, ofs = 0, total = BLOCKHDR + N * BLOCKIDX;
+    for (i = 0; i < N; i++)
+	total += sizes[i];
+
+    luaL_Buffer b;
+    char *out = luaL_buffinitsize(L, &b, total);
+    memcpy(out, BLOCKMAGIC, 4);
+    put_le(out + 4, bsize, 4);
+    put_le(out + 8, N, 4);
+    put_le64(out + 12, len);
+
+    char *idx = out + BLOCKHDR, *data = idx + N * BLOCKIDX;
+    for (i = 0; i < N; i++, idx += BLOCKIDX) {
+	put_le64(idx, ofs);
+	put_le(idx + 8, sizes[i], 4);
+	put_le(idx + 12, crcs[i], 4);
+	memcpy(data + ofs, scratch + i * slot, sizes[i]);
+	ofs += sizes[i];
+    }
+
+    luaL_pushresultsize(&b, total);
+    return 1;
+}
+
+// decompress_parallel(data [, threads])
+static int decompress_parallel(lua_State *L) {
+    size_t len;
+    const char *input = checkbytes(L, 1, &len);
+    int threads = default_threads(L, 2);
+    lsnap_blocks bk;
+
+    const char *err = read_blocks(input, len, &bk);
+    if (err) {
+	lua_pushnil(L);
+	lua_pushstring(L, err);
+	return 2;
+    }
+
+    luaL_Buffer b;
+    char *out = luaL_buffinitsize(L, &b, bk.total);
+    std::atomic<int> failed(0);
+
+    parallel_for(bk.count, threads, [&](size_t i) {
+	if (read_block(&bk, i, out + i * bk.bsize) == -1)
+	    failed = 1;
+    });
+
+    if (failed) {
+	lua_pushnil(L);
+	lua_pushliteral(L, "ERROR: corrupt compressed block");
+	return 2;
+    }
+
+    luaL_pushresultsize(&b, bk.total);
+    return 1;
+}
+
+// decompress_block(data, i): block i, starting at 1
+static int decompress_block(lua_State *L) {
+    size_t len;
+    const char *input = checkbytes(L, 1, &len);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    lsnap_blocks bk;
+
+    const char *err = read_blocks(input, len, &bk);
+    if (err) {
+	lua_pushnil(L);
+	lua_pushstring(L, err);
+	return 2;
+    }
+    luaL_argcheck(L, i >= 1 && i <= bk.count, 2, "block index out of range");
+
+    luaL_Buffer b;
+    size_t N = block_length(&bk, i-1);
+    char *out = luaL_buffinitsize(L, &b, N);
+    if (read_block(&bk, i-1, out) == -1) {
+	lua_pushnil(L);
+	lua_pushliteral(L, "ERROR: corrupt compressed block");
+	return 2;
+    }
+
+    luaL_pushresultsize(&b, N);
+    return 1;
+}
+
+// blocks(data) returns number of blocks, block size & uncompressed length
+static int block_info(lua_State *L) {
+    size_t len;
+    const char *input = checkbytes(L, 1, &len);
+    lsnap_blocks bk;
+
+    const char *err = read_blocks(input, len, &bk);
+    if (err) {
+	lua_pushnil(L);
+	lua_pushstring(L, err);
+	return 2;
+    }
+
+    lua_pushinteger(L, bk.count);
+    lua_pushinteger(L, bk.bsize);
+    lua_pushinteger(L, bk.total);
+    return 3;
+}
+
 /////////////////////////////
 
 static const struct luaL_Reg lsanp_funcs[] = {
   {"compress", compress},
+  {"uncompress", uncompress},
+  {"compress_into", compress_into},
+  {"encoder", new_encoder},
+  {"decoder", new_decoder},
+  {"compress_parallel", compress_parallel},
+  {"decompress_parallel", decompress_parallel},
+  {"decompress_block", decompress_block},
+  {"blocks", block_info},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg encoder_meths[] = {
+  {"write", encoder_write},
+  {"flush", encoder_flush},
+  {"__gc", encoder_gc},
+  {"__tostring", encoder_asstr},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg decoder_meths[] = {
+  {"feed", decoder_feed},
+  {"__gc", decoder_gc},
+  {"__tostring", decoder_asstr},
   {NULL, NULL}
 };
 
 int luaopen_lsnap (lua_State *L) {
+  crc32c_init();
+
+  // framing format encoder & decoder
+  luaL_newmetatable(L, "caap.snappy.encoder");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, encoder_meths, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "caap.snappy.decoder");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, decoder_meths, 0);
+  lua_pop(L, 1);
+
   // create the library
   luaL_newlib(L, lsanp_funcs);
   return 1;
@@ -37,4 +613,3 @@ int luaopen_lsnap (lua_State *L) {
 #ifdef __cplusplus
 } // extern C
 #endif
-